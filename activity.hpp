@@ -0,0 +1,191 @@
+// activity.hpp -*- c++ -*-
+
+/*
+ * MIT License
+ *
+ * Copyright (c) 2022 Walker Griggs
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+
+extern "C" {
+#include <libavutil/rational.h>
+#include <libavutil/mathematics.h>
+}
+
+#include "change.hpp"
+
+/** A per-second record of how much of the screen changed, written beside
+ *  each segment as it is recorded.
+ *
+ * Each second's score is the fraction of tiles the change detector found
+ * dirty, or saw scroll, in any frame of that second: a few tiles for typing,
+ * most of them for a page load, none while the screen sits idle. Ignored
+ * regions never count. Lines are written as each second ends, so the log of
+ * a recording cut short is still good up to the cut.
+ *
+ * The sidecar is text, one second per line after a header:
+ *
+ *     # screencap activity 1
+ *     0 1.0000
+ *     1 0.0039
+ */
+class ActivityLog {
+public:
+  /** The sidecar's location for a segment.
+   */
+  static std::string path_of(const std::string& url) {
+    return url + ".activity";
+  }
+
+  ~ActivityLog() {
+    close();
+  }
+
+  /** Start a new log, replacing any file at the path.
+   *
+   * @param path      where to write the log
+   * @param time_base the time base of the timestamps passed to `add`
+   *
+   * @return Zero on success, a negative value on error.
+   */
+  int open(const std::string& path, AVRational time_base) {
+    close();
+    os.open(path, std::ios::out | std::ios::trunc);
+    if (!os) {
+      return -1;
+    }
+
+    this->time_base = time_base;
+    second = 0;
+    changed.clear();
+    os << "# screencap activity 1" << std::endl;
+    return 0;
+  }
+
+  bool is_open() const {
+    return os.is_open();
+  }
+
+  /** Fold one frame's change detection into its second.
+   *
+   * @param pts      the frame's timestamp from the start of the segment
+   * @param detector the detector that just ran on the frame
+   */
+  void add(int64_t pts, const ChangeDetector& detector) {
+    if (!is_open()) {
+      return;
+    }
+
+    int64_t s = av_rescale_q_rnd(pts, time_base, av_make_q(1, 1), AV_ROUND_DOWN);
+    while (second < s) {
+      emit();
+    }
+
+    auto& dirty = detector.dirty_tiles();
+    if (changed.size() != dirty.size()) {
+      changed.assign(dirty.size(), 0);
+    }
+    for (size_t i = 0; i < dirty.size(); i++) {
+      changed[i] |= dirty[i];
+    }
+
+    int tile = detector.get_tile();
+    int tiles_x = detector.get_tiles_x(), tiles_y = detector.get_tiles_y();
+    for (auto& scroll : detector.scrolled()) {
+      auto& r = scroll.area;
+      for (int ty = r.y / tile; ty <= (r.y + r.h - 1) / tile && ty < tiles_y; ty++) {
+        for (int tx = r.x / tile; tx <= (r.x + r.w - 1) / tile && tx < tiles_x; tx++) {
+          changed[ty * tiles_x + tx] = 1;
+        }
+      }
+    }
+  }
+
+  /** Write the last, partial second and close the log.
+   */
+  void close() {
+    if (!is_open()) {
+      return;
+    }
+    emit();
+    os.close();
+  }
+
+  /** Read a log back.
+   *
+   * @param path   the log's location
+   * @param scores each second's score, by second; seconds missing from the
+   *               log score zero
+   *
+   * @return Zero on success, a negative value if the log can't be read.
+   */
+  static int read(const std::string& path, std::vector<double>& scores) {
+    std::ifstream is(path);
+    if (!is) {
+      return -1;
+    }
+
+    scores.clear();
+    std::string line;
+    while (std::getline(is, line)) {
+      if (line.empty() || line[0] == '#') {
+        continue;
+      }
+
+      std::istringstream ls(line);
+      int64_t s;
+      double score;
+      if (!(ls >> s >> score) || s < 0) {
+        return -1;
+      }
+      if ((int64_t)scores.size() <= s) {
+        scores.resize(s + 1, 0);
+      }
+      scores[s] = score;
+    }
+    return 0;
+  }
+
+private:
+  /** Write the current second and move on to the next.
+   */
+  void emit() {
+    int n = std::count_if(changed.begin(), changed.end(), [](uint8_t c) { return c != 0; });
+    double score = changed.empty() ? 0 : (double)n / changed.size();
+    os << second << " " << std::fixed << std::setprecision(4) << score << std::endl;
+
+    std::fill(changed.begin(), changed.end(), 0);
+    second++;
+  }
+
+  std::ofstream os;
+  AVRational time_base = {1, 1};
+  int64_t second = 0;
+  std::vector<uint8_t> changed;
+};
@@ -0,0 +1,1070 @@
+// bench.cpp -*- c++ -*-
+
+/*
+ * MIT License
+ *
+ * Copyright (c) 2022 Walker Griggs
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * @file bench.cpp
+ *
+ * @brief Measures capture pipeline performance against a live X display.
+ *
+ * @author Walker Griggs (walker@walkergriggs.com)
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <ctime>
+#include <csignal>
+#include <random>
+#include <map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "libav.hpp"
+#include "capture.hpp"
+#include "change.hpp"
+#include "convert.hpp"
+#include "recorder.hpp"
+#include "udp.hpp"
+
+/** Print usage to stderr.
+ *
+ * @param name the program name
+ */
+void usage(const char* name)
+{
+  std::cerr << "usage: " << name << " [-d display] [-b max_bands] [-i iterations] [-p [-R | [-I] [-G]] [-g max]]" << std::endl
+            << "       " << name << " -r replay.nut [-R | [-I] [-G]] [-g max]" << std::endl
+            << "       " << name << " -m recording [-i seeks]" << std::endl
+            << "       " << name << " -x WxHxD[,WxHxD...] [-f fps] [-t seconds]" << std::endl
+            << "       " << name << " -u [-f fps] [-t seconds]" << std::endl
+            << "  -d display     the X display to capture, default $DISPLAY" << std::endl
+            << "  -b max_bands   measure 1, 2, 4, ... up to this many bands, default 8" << std::endl
+            << "  -i iterations  grabs or frames per measurement, default 100" << std::endl
+            << "  -p             run the capture, convert and encode pipeline and audit its copies" << std::endl
+            << "  -R             encode the captured RGB directly in the pipeline" << std::endl
+            << "  -I             detect changes and convert them in one fused pass in the pipeline" << std::endl
+            << "  -G             extract luma only and encode 4:0:0 in the pipeline" << std::endl
+            << "  -g max         fail if the pipeline copies more than max bytes per output pixel" << std::endl
+            << "  -r replay      run the pipeline on a sampled replay file instead of the screen" << std::endl
+            << "  -m recording   compare buffered and memory-mapped reads of a recording: a full scan and random seeks" << std::endl
+            << "  -x geometries  run the x11grab pipeline against Xvfb at each resolution and depth" << std::endl
+            << "  -f fps         the capture and drawing rate under Xvfb, default 30" << std::endl
+            << "  -t seconds     how long to record under Xvfb or stream over UDP, default 10" << std::endl
+            << "  -u             stream MPEG-TS over loopback UDP, unpaced and paced, to a receiver that reads every 10 ms" << std::endl;
+}
+
+/** Measure full-screen native capture latency for a given number of bands.
+ *
+ * Every iteration invalidates the capture so the whole screen is fetched,
+ * which is the worst case the bands are meant to speed up.
+ *
+ * @param display_name the X display to capture
+ * @param bands        the number of bands to fetch concurrently
+ * @param iterations   the number of grabs to time
+ *
+ * @return Zero on success, a negative value on error.
+ */
+int bench_bands(const char* display_name, int bands, int iterations) {
+  X11Capture capture;
+  if (capture.open(display_name, bands) < 0) {
+    return -1;
+  }
+
+  // Warm up the connections and shared memory before timing.
+  if (capture.grab() < 0) {
+    return -1;
+  }
+
+  std::vector<double> latencies;
+  for (int i = 0; i < iterations; i++) {
+    capture.invalidate();
+
+    auto start = std::chrono::steady_clock::now();
+    if (capture.grab() < 0) {
+      return -1;
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    latencies.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+  double mean = 0;
+  for (double l : latencies) {
+    mean += l;
+  }
+  mean /= latencies.size();
+
+  double mpixels = (double)capture.get_width() * capture.get_height() / 1e6;
+  std::cout << std::fixed << std::setprecision(2)
+            << std::setw(6) << capture.get_bands()
+            << std::setw(10) << mean
+            << std::setw(10) << latencies[latencies.size() / 2]
+            << std::setw(10) << latencies[latencies.size() * 99 / 100]
+            << std::setw(12) << mpixels / (mean / 1000)
+            << std::endl;
+  return 0;
+}
+
+/** Run the native capture, conversion and encode pipeline and audit copies.
+ *
+ * Frames are grabbed back to back, converted to YUV 4:2:0 (or kept as RGB,
+ * or reduced to luma) and encoded with libx264 at its fastest preset; packets are discarded. The
+ * byte-copy audit is printed afterwards.
+ *
+ * @param display_name the X display to capture
+ * @param frames       the number of frames to run
+ * @param rgb          skip the conversion and encode RGB with libx264rgb
+ * @param incremental  convert only the changed tiles, during change detection
+ * @param gray         extract luma only and encode 4:0:0
+ *
+ * @return Zero on success, a negative value on error.
+ */
+int bench_pipeline(const char* display_name, int frames, bool rgb, bool incremental, bool gray) {
+  X11Capture capture;
+  if (capture.open(display_name) < 0) {
+    return -1;
+  }
+
+  auto encoder = EncoderContext::alloc_context_by_name(rgb ? "libx264rgb" : "libx264");
+  if (!encoder.get()) {
+    return -1;
+  }
+
+  av_opt_set(encoder->priv_data, "preset", "ultrafast", 0);
+  encoder->pix_fmt   = rgb ? AV_PIX_FMT_BGR0 : gray ? AV_PIX_FMT_GRAY8 : AV_PIX_FMT_YUV420P;
+  encoder->width     = capture.get_width();
+  encoder->height    = capture.get_height();
+  encoder->time_base = av_make_q(1, 30);
+  if (encoder.open() < 0) {
+    return -1;
+  }
+
+  std::function<int(Packet)> discard = [](Packet) { return 0; };
+  ChangeDetector detector;
+  IncrementalConverter converter(gray);
+
+  CopyAudit::reset();
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < frames; i++) {
+    if (capture.grab() < 0) {
+      return -1;
+    }
+
+    Frame& frame = capture.get_frame();
+    if (rgb) {
+      frame->pts = i;
+      if (encoder.send_frame(frame, discard) < 0) {
+        return -1;
+      }
+    } else {
+      if (incremental && converter.update(frame, detector, &capture.damaged()) < 0) {
+        return -1;
+      }
+      auto scale_frame = incremental
+        ? converter.get_frame()
+        : gray
+        ? LumaKernel::convert(frame)
+        : frame.scale(frame->width, frame->height, AV_PIX_FMT_YUV420P);
+      if (!scale_frame) {
+        return -1;
+      }
+      scale_frame->pts = i;
+      if (encoder.send_frame(scale_frame, discard) < 0) {
+        return -1;
+      }
+    }
+  }
+
+  auto flush = Frame(NULL, [](AVFrame*) {});
+  encoder.send_frame(flush, discard);
+  auto end = std::chrono::steady_clock::now();
+
+  double seconds = std::chrono::duration<double>(end - start).count();
+  std::cout << std::fixed << std::setprecision(2)
+            << frames << " frames in " << seconds << " s ("
+            << frames / seconds << " fps)" << std::endl;
+  CopyAudit::report(std::cout);
+  return 0;
+}
+
+/** Read a recording one way, with a cold page cache.
+ *
+ * @param path   the recording
+ * @param mapped read through a memory mapping instead of avio's buffered reads
+ * @param seeks  zero to scan every packet, else the number of random seeks,
+ *               each followed by a packet read
+ * @param bytes  the packet bytes read
+ *
+ * @return The wall time in seconds, a negative value on error.
+ */
+double read_recording(const std::string& path, bool mapped, int seeks, int64_t& bytes) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  Access access = seeks ? Access::random : Access::sequential;
+  auto input = mapped
+    ? FormatContext::open_input_file(path, access)
+    : FormatContext::open_input_format(NULL, path.c_str());
+  if (!input.get()) {
+    return -1;
+  }
+
+  int idx = input.find_best_stream_idx(AVMEDIA_TYPE_VIDEO, -1);
+  if (idx < 0) {
+    return -1;
+  }
+  auto stream = input->streams[idx];
+  int64_t duration = stream->duration > 0 ? stream->duration
+    : av_rescale_q(input->duration, av_get_time_base_q(), stream->time_base);
+
+  auto packet = Packet::alloc();
+  std::mt19937 rng(1);
+  bytes = 0;
+
+  for (int i = 0; seeks == 0 || i < seeks; i++) {
+    if (seeks) {
+      int64_t ts = std::uniform_int_distribution<int64_t>(0, std::max<int64_t>(duration, 1))(rng);
+      if (av_seek_frame(input.get(), idx, ts, AVSEEK_FLAG_BACKWARD) < 0) {
+        return -1;
+      }
+    }
+    if (av_read_frame(input.get(), packet.get()) < 0) {
+      break;
+    }
+    bytes += packet->size;
+    av_packet_unref(packet.get());
+  }
+
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/** Compare avio's buffered reads with memory-mapped reads of a recording.
+ *
+ * Each reader scans the whole file, then seeks to random timestamps. The
+ * page cache is dropped for the file before each run, so the numbers include
+ * the disk; run it on recordings of several gigabytes to see read-ahead at
+ * work.
+ *
+ * @param path  the recording
+ * @param seeks the number of random seeks, zero to only scan
+ *
+ * @return Zero on success, a negative value on error.
+ */
+int bench_read(const std::string& path, int seeks) {
+  std::cout << "  reader     scan s     MB/s  seek ms" << std::endl;
+  for (bool mapped : {false, true}) {
+    int64_t bytes, unused;
+    double scan = read_recording(path, mapped, 0, bytes);
+    double seek = seeks > 0 ? read_recording(path, mapped, seeks, unused) : 0;
+    if (scan < 0 || seek < 0) {
+      return -1;
+    }
+
+    std::cout << std::fixed << std::setprecision(2)
+              << std::setw(8) << (mapped ? "mmap" : "avio")
+              << std::setw(11) << scan
+              << std::setw(9) << bytes / scan / 1e6;
+    if (seeks > 0) {
+      std::cout << std::setw(9) << seek * 1000 / seeks << std::endl;
+    } else {
+      std::cout << std::setw(9) << "-" << std::endl;
+    }
+  }
+  return 0;
+}
+
+/** Replay a sampled sequence through the conversion and encode pipeline.
+ *
+ * Pictures are processed back to back rather than at their recorded pace;
+ * the recorded span is printed next to the processing time, and their ratio
+ * is the headroom a recorder would have on this content.
+ *
+ * @param path        the replay file, as written by the Sampler
+ * @param rgb         skip the conversion and encode RGB with libx264rgb
+ * @param incremental convert only the changed tiles, during change detection
+ * @param gray        extract luma only and encode 4:0:0
+ *
+ * @return Zero on success, a negative value on error.
+ */
+int bench_replay(const std::string& path, bool rgb, bool incremental, bool gray) {
+  auto input = FormatContext::open_input_file(path);
+  if (!input.get()) {
+    return -1;
+  }
+
+  auto stream = input.find_best_stream(AVMEDIA_TYPE_VIDEO, -1);
+  if (!stream || stream->codecpar->codec_id != AV_CODEC_ID_RAWVIDEO) {
+    return -1;
+  }
+  int width = stream->codecpar->width;
+  int height = stream->codecpar->height;
+  auto pix_fmt = (AVPixelFormat)stream->codecpar->format;
+
+  auto encoder = EncoderContext::alloc_context_by_name(rgb ? "libx264rgb" : "libx264");
+  if (!encoder.get()) {
+    return -1;
+  }
+
+  av_opt_set(encoder->priv_data, "preset", "ultrafast", 0);
+  encoder->pix_fmt   = rgb ? pix_fmt : gray ? AV_PIX_FMT_GRAY8 : AV_PIX_FMT_YUV420P;
+  encoder->width     = width;
+  encoder->height    = height;
+  encoder->time_base = stream->time_base;
+  if (encoder.open() < 0) {
+    return -1;
+  }
+
+  std::function<int(Packet)> discard = [](Packet) { return 0; };
+  ChangeDetector detector;
+  IncrementalConverter converter(gray);
+  auto packet = Packet::alloc();
+  std::vector<double> latencies;
+  int64_t first = AV_NOPTS_VALUE, last = 0;
+
+  CopyAudit::reset();
+  while (av_read_frame(input.get(), packet.get()) >= 0) {
+    if (packet->stream_index != stream->index) {
+      av_packet_unref(packet.get());
+      continue;
+    }
+
+    if (first == AV_NOPTS_VALUE) {
+      first = packet->pts;
+    }
+    last = packet->pts;
+
+    auto start = std::chrono::steady_clock::now();
+    auto frame = Frame::wrap_packet(packet, width, height, pix_fmt);
+    if (!frame) {
+      return -1;
+    }
+
+    Frame out = Frame(NULL, [](AVFrame*) {});
+    if (rgb) {
+      out = std::move(frame);
+    } else if (incremental) {
+      if (converter.update(frame, detector) < 0) {
+        return -1;
+      }
+      out = converter.get_frame();
+    } else if (gray) {
+      out = LumaKernel::convert(frame);
+    } else {
+      out = frame.scale(width, height, AV_PIX_FMT_YUV420P);
+    }
+    if (!out) {
+      return -1;
+    }
+
+    out->pts = packet->pts;
+    if (encoder.send_frame(out, discard) < 0) {
+      return -1;
+    }
+    latencies.push_back(std::chrono::duration<double, std::milli>(
+                          std::chrono::steady_clock::now() - start).count());
+    av_packet_unref(packet.get());
+  }
+
+  auto flush = Frame(NULL, [](AVFrame*) {});
+  encoder.send_frame(flush, discard);
+  if (latencies.empty()) {
+    return -1;
+  }
+
+  double busy = 0;
+  for (double l : latencies) {
+    busy += l;
+  }
+  std::sort(latencies.begin(), latencies.end());
+  double recorded = (last - first) * av_q2d(stream->time_base);
+
+  std::cout << std::fixed << std::setprecision(2)
+            << latencies.size() << " frames (" << width << "x" << height << ") spanning "
+            << recorded << " s processed in " << busy / 1000 << " s; p50 "
+            << latencies[latencies.size() / 2] << " ms, p99 "
+            << latencies[latencies.size() * 99 / 100] << " ms" << std::endl;
+  CopyAudit::report(std::cout);
+  return 0;
+}
+
+/** A private Xvfb server with a client drawing into it at a fixed rate.
+ *
+ * The fixture starts Xvfb on the first free display number at the given
+ * geometry, then draws terminal-like content on the root window: each tick
+ * scrolls the screen up by a line, writes a new line of text at the bottom and
+ * moves a solid box across the screen. No GPU or window manager is involved.
+ */
+class XvfbFixture {
+public:
+  XvfbFixture(const XvfbFixture&) = delete;
+  XvfbFixture& operator=(const XvfbFixture&) = delete;
+
+  XvfbFixture(int w, int h, int depth) : width(w), height(h), depth(depth) {}
+
+  ~XvfbFixture() {
+    stop();
+  }
+
+  /** Start Xvfb and wait until it accepts connections.
+   *
+   * @return Zero on success, a negative value on error.
+   */
+  int start() {
+    for (int n = 90; n < 190; n++) {
+      if (access(("/tmp/.X11-unix/X" + std::to_string(n)).c_str(), F_OK) == 0 ||
+          access(("/tmp/.X" + std::to_string(n) + "-lock").c_str(), F_OK) == 0) {
+        continue;
+      }
+      display_name = ":" + std::to_string(n);
+      break;
+    }
+    if (display_name.empty()) {
+      return -1;
+    }
+
+    std::string screen = std::to_string(width) + "x" + std::to_string(height) +
+                         "x" + std::to_string(depth);
+
+    pid = fork();
+    if (pid < 0) {
+      return -1;
+    }
+    if (pid == 0) {
+      execlp("Xvfb", "Xvfb", display_name.c_str(), "-screen", "0", screen.c_str(),
+             "-nolisten", "tcp", "+extension", "DAMAGE", (char*)NULL);
+      _exit(127);
+    }
+
+    for (int i = 0; i < 100; i++) {
+      if (Display* display = XOpenDisplay(display_name.c_str())) {
+        XCloseDisplay(display);
+        return 0;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    return -1;
+  }
+
+  /** Start drawing at the given rate on a separate connection and thread.
+   *
+   * @return Zero on success, a negative value on error.
+   */
+  int draw(int fps) {
+    Display* display = XOpenDisplay(display_name.c_str());
+    if (!display) {
+      return -1;
+    }
+
+    drawing = true;
+    drawer = std::thread([this, display, fps] {
+      Window root = DefaultRootWindow(display);
+      GC gc = XCreateGC(display, root, 0, NULL);
+      int screen = DefaultScreen(display);
+      unsigned long white = WhitePixel(display, screen);
+      unsigned long black = BlackPixel(display, screen);
+      const int line = 16;
+
+      auto interval = std::chrono::microseconds(1000000 / fps);
+      auto next = std::chrono::steady_clock::now();
+      for (int tick = 0; drawing; tick++) {
+        XCopyArea(display, root, root, gc, 0, line, width, height - line, 0, 0);
+
+        XSetForeground(display, gc, black);
+        XFillRectangle(display, root, gc, 0, height - line, width, line);
+        XSetForeground(display, gc, white);
+        std::string text = "line " + std::to_string(tick) + ": the quick brown fox jumps over the lazy dog";
+        XDrawString(display, root, gc, 4, height - 4, text.c_str(), text.size());
+
+        XSetForeground(display, gc, (tick * 2654435761u) & 0xFFFFFF);
+        XFillRectangle(display, root, gc, (tick * 8) % std::max(1, width - 128),
+                       height / 3, 128, 128);
+        XFlush(display);
+
+        next += interval;
+        std::this_thread::sleep_until(next);
+      }
+
+      timespec ts;
+      clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+      drawer_cpu = ts.tv_sec + ts.tv_nsec / 1e9;
+
+      XFreeGC(display, gc);
+      XCloseDisplay(display);
+    });
+    return 0;
+  }
+
+  /** Stop drawing and terminate Xvfb.
+   */
+  void stop() {
+    drawing = false;
+    if (drawer.joinable()) {
+      drawer.join();
+    }
+
+    if (pid > 0) {
+      kill(pid, SIGTERM);
+      waitpid(pid, NULL, 0);
+      pid = -1;
+    }
+  }
+
+  /** The CPU seconds the server has used so far, from /proc.
+   */
+  double server_cpu() const {
+    std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+    std::string line;
+    if (pid <= 0 || !std::getline(stat, line)) {
+      return 0;
+    }
+
+    // Skip past the parenthesized command name; utime and stime are the 12th
+    // and 13th fields after it.
+    std::istringstream fields(line.substr(line.rfind(')') + 2));
+    std::string field;
+    double ticks = 0;
+    for (int i = 0; i < 13 && fields >> field; i++) {
+      if (i >= 11) {
+        ticks += std::stod(field);
+      }
+    }
+    return ticks / sysconf(_SC_CLK_TCK);
+  }
+
+  /** The CPU seconds the drawing thread used, valid once stopped.
+   */
+  double get_drawer_cpu() const {
+    return drawer_cpu;
+  }
+
+  const std::string& get_display_name() const {
+    return display_name;
+  }
+
+private:
+  int width;
+  int height;
+  int depth;
+  pid_t pid = -1;
+  std::string display_name;
+  std::atomic<bool> drawing{false};
+  std::thread drawer;
+  double drawer_cpu = 0;
+};
+
+/** Record from Xvfb through the real x11grab pipeline and report timing.
+ *
+ * A Recorder captures the fixture's display with x11grab, converts and
+ * encodes it, while a frame tap timestamps each captured frame. Reports the
+ * achieved frame rate, the jitter of the capture intervals, and CPU time per
+ * frame for the recorder and for the X server.
+ *
+ * @param geometry the Xvfb screen, WxHxD
+ * @param fps      the capture and drawing rate
+ * @param seconds  how long to record
+ *
+ * @return Zero on success, a negative value on error.
+ */
+int bench_xvfb(const std::string& geometry, int fps, int seconds) {
+  int w, h, depth;
+  if (sscanf(geometry.c_str(), "%dx%dx%d", &w, &h, &depth) != 3) {
+    return -1;
+  }
+
+  XvfbFixture xvfb(w, h, depth);
+  if (xvfb.start() < 0 || xvfb.draw(fps) < 0) {
+    return -1;
+  }
+
+  char path[] = "/tmp/bench-xvfb-XXXXXX.mp4";
+  int fd = mkstemps(path, 4);
+  if (fd < 0) {
+    return -1;
+  }
+  close(fd);
+
+  RecorderOptions options;
+  options.url = path;
+  options.display = xvfb.get_display_name();
+  options.fps = fps;
+  options.preset = "ultrafast";
+
+  std::vector<std::chrono::steady_clock::time_point> arrivals;
+  Recorder recorder(options);
+  recorder.add_frame_tap([&](Frame) {
+    arrivals.push_back(std::chrono::steady_clock::now());
+    return 0;
+  });
+
+  timespec cpu0, cpu1;
+  double server0 = xvfb.server_cpu();
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu0);
+
+  if (recorder.start().get() < 0) {
+    unlink(path);
+    return -1;
+  }
+  std::this_thread::sleep_for(std::chrono::seconds(seconds));
+  int res = recorder.stop().get();
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu1);
+  double server1 = xvfb.server_cpu();
+  xvfb.stop();
+  unlink(path);
+
+  if (res < 0 || arrivals.size() < 2) {
+    return -1;
+  }
+
+  std::vector<double> intervals;
+  for (size_t i = 1; i < arrivals.size(); i++) {
+    intervals.push_back(std::chrono::duration<double, std::milli>(arrivals[i] - arrivals[i - 1]).count());
+  }
+
+  double mean = 0;
+  for (double d : intervals) {
+    mean += d;
+  }
+  mean /= intervals.size();
+
+  double variance = 0;
+  for (double d : intervals) {
+    variance += (d - mean) * (d - mean);
+  }
+  double jitter = std::sqrt(variance / intervals.size());
+
+  std::sort(intervals.begin(), intervals.end());
+  double frames = arrivals.size();
+  double elapsed = std::chrono::duration<double>(arrivals.back() - arrivals.front()).count();
+  double client = (cpu1.tv_sec - cpu0.tv_sec) + (cpu1.tv_nsec - cpu0.tv_nsec) / 1e9 -
+                  xvfb.get_drawer_cpu();
+
+  std::cout << std::fixed << std::setprecision(2)
+            << std::setw(16) << geometry
+            << std::setw(9) << (frames - 1) / elapsed
+            << std::setw(11) << jitter
+            << std::setw(11) << intervals[intervals.size() * 99 / 100]
+            << std::setw(12) << client * 1000 / frames
+            << std::setw(12) << (server1 - server0) * 1000 / frames
+            << std::endl;
+  return 0;
+}
+
+/** A UDP receiver on the loopback interface that reads like a dashboard's
+ *  UI loop: it wakes every 10 ms and drains its socket, so a burst larger
+ *  than its receive buffer is lost, as it would be in a monitor.
+ *
+ * Each datagram's TS packets are checked for continuity-counter gaps, which
+ * is how a player would notice the loss.
+ */
+class LoopbackReceiver {
+public:
+  static constexpr int buffer_size = 64 * 1024;
+
+  ~LoopbackReceiver() {
+    stop();
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  /** Bind an ephemeral loopback port and start reading.
+   *
+   * @return The port on success, a negative value on error.
+   */
+  int start() {
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+      return -1;
+    }
+
+    int size = buffer_size;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        getsockname(fd, (struct sockaddr*)&addr, &len) < 0) {
+      return -1;
+    }
+
+    running = true;
+    thread = std::thread(&LoopbackReceiver::run, this);
+    return ntohs(addr.sin_port);
+  }
+
+  void stop() {
+    running = false;
+    if (thread.joinable()) {
+      thread.join();
+    }
+  }
+
+  int64_t get_datagrams() const {
+    return datagrams;
+  }
+
+  int64_t get_discontinuities() const {
+    return discontinuities;
+  }
+
+private:
+  void run() {
+    std::vector<uint8_t> buf(65536);
+    while (running) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      ssize_t n;
+      while ((n = recv(fd, buf.data(), buf.size(), MSG_DONTWAIT)) > 0) {
+        datagrams++;
+        check(buf.data(), n);
+      }
+    }
+  }
+
+  void check(const uint8_t* data, ssize_t size) {
+    for (ssize_t offset = 0; offset + 188 <= size; offset += 188) {
+      const uint8_t* ts = data + offset;
+      if (ts[0] != 0x47) {
+        discontinuities++;
+        continue;
+      }
+
+      int pid = (ts[1] & 0x1f) << 8 | ts[2];
+      int cc = ts[3] & 0x0f;
+      bool payload = ts[3] & 0x10;
+      if (pid == 0x1fff || !payload) {
+        continue;
+      }
+
+      auto last = counters.find(pid);
+      if (last != counters.end() && cc != ((last->second + 1) & 0x0f)) {
+        discontinuities++;
+      }
+      counters[pid] = cc;
+    }
+  }
+
+  int fd = -1;
+  std::thread thread;
+  std::atomic<bool> running{false};
+  std::map<int, int> counters;
+  std::atomic<int64_t> datagrams{0};
+  std::atomic<int64_t> discontinuities{0};
+};
+
+/** Stream a synthetic desktop as MPEG-TS over loopback UDP and report what
+ *  the receiver saw.
+ *
+ * Frames are encoded in real time with the recorder's rate control and a
+ * keyframe every two seconds, muxed to TS and sent through a PacedSender,
+ * paced as the recorder would or not at all. Reports datagrams sent and
+ * lost, continuity errors, the sender's peak queue and its pacing error.
+ *
+ * @param fps     the frame rate
+ * @param seconds how long to stream
+ * @param paced   pace at the derived rate, else send datagrams as written
+ *
+ * @return Zero on success, a negative value on error.
+ */
+int bench_udp(int fps, int seconds, bool paced) {
+  const int w = 1280, h = 720;
+
+  LoopbackReceiver receiver;
+  int port = receiver.start();
+  if (port < 0) {
+    return -1;
+  }
+
+  auto encoder = EncoderContext::alloc_context_by_name("libx264");
+  if (!encoder.get()) {
+    return -1;
+  }
+  av_opt_set(encoder->priv_data, "preset", "veryfast", 0);
+  encoder->pix_fmt        = AV_PIX_FMT_YUV420P;
+  encoder->width          = w;
+  encoder->height         = h;
+  encoder->time_base      = av_make_q(1, fps);
+  encoder->gop_size       = 2 * fps;
+  encoder->bit_rate       = 2 * 1000 * 1000;
+  encoder->rc_max_rate    = 2 * 1000 * 1000;
+  encoder->rc_buffer_size = 4 * 1000 * 1000;
+  if (encoder.open() < 0) {
+    return -1;
+  }
+
+  PacedSender sender;
+  if (sender.open("127.0.0.1", port) < 0) {
+    return -1;
+  }
+  PacingOptions pacing;
+  int64_t rate = paced ? std::llrint(encoder->rc_max_rate * pacing.overhead) : 0;
+  if (sender.start(rate, pacing.burst, 2 * (int64_t)encoder->rc_buffer_size / 8) < 0) {
+    return -1;
+  }
+
+  auto output = FormatContext::open_output_io("mpegts", &sender, &PacedSender::write, PacedSender::datagram_size);
+  if (!output.get()) {
+    return -1;
+  }
+  int stream_idx = output.create_stream(encoder);
+  if (stream_idx < 0 || avformat_write_header(output.get(), NULL) < 0) {
+    return -1;
+  }
+
+  auto canvas = Frame::alloc(w, h, AV_PIX_FMT_BGR0);
+  if (!canvas) {
+    return -1;
+  }
+
+  auto write = [&](Packet packet) {
+    packet->stream_index = stream_idx;
+    return output.write_packet(packet, encoder->time_base);
+  };
+
+  // A window moves across a gradient and a line of noise scrolls past,
+  // which keeps the P-frames small next to the keyframes.
+  std::mt19937 rng(1);
+  double error = 0, max_error = 0;
+  int error_samples = 0;
+  auto next = std::chrono::steady_clock::now();
+  auto sample = next;
+  for (int i = 0; i < fps * seconds; i++) {
+    for (int y = 0; y < h; y++) {
+      uint32_t* row = (uint32_t*)(canvas->data[0] + y * canvas->linesize[0]);
+      bool text = y >= (i * 4) % h && y < (i * 4) % h + 16;
+      for (int x = 0; x < w; x++) {
+        int x0 = (i * 8) % (w - 256), y0 = h / 3;
+        bool window = x >= x0 && x < x0 + 256 && y >= y0 && y < y0 + 256;
+        row[x] = text ? (rng() & 1 ? 0xffffff : 0)
+               : window ? 0xe0e0e0
+               : (x * 255 / w) << 16 | (y * 255 / h) << 8 | 0x80;
+      }
+    }
+
+    auto frame = canvas.scale(w, h, AV_PIX_FMT_YUV420P);
+    if (!frame) {
+      return -1;
+    }
+    frame->pts = i;
+    if (encoder.send_frame(frame, write) < 0) {
+      return -1;
+    }
+
+    next += std::chrono::microseconds(1000000 / fps);
+    std::this_thread::sleep_until(next);
+
+    if (next - sample >= std::chrono::seconds(1)) {
+      sample = next;
+      error += sender.get_pacing_error();
+      max_error = std::max(max_error, sender.get_max_pacing_error());
+      error_samples++;
+    }
+  }
+
+  auto flush = Frame(NULL, [](AVFrame*) {});
+  if (encoder.send_frame(flush, write) < 0 || av_write_trailer(output.get()) < 0) {
+    return -1;
+  }
+  output = FormatContext(NULL, [](AVFormatContext*) {});
+
+  sender.stop();
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  receiver.stop();
+
+  int64_t sent = sender.get_sent();
+  std::cout << std::fixed << std::setprecision(2)
+            << std::setw(8) << (paced ? "paced" : "unpaced")
+            << std::setw(11) << (rate / 1000)
+            << std::setw(10) << sent
+            << std::setw(8) << sent - receiver.get_datagrams()
+            << std::setw(8) << receiver.get_discontinuities()
+            << std::setw(12) << sender.get_peak_queued_bytes() / 1024.0
+            << std::setw(11) << (error_samples ? error / error_samples * 1000 : 0)
+            << std::setw(10) << max_error * 1000
+            << std::endl;
+  return 0;
+}
+
+/** Run the capture benchmarks
+ *
+ * @param argc number of arguments
+ * @param argv the arguments themselves
+ */
+int main(int argc, char **argv) {
+  const char* display_name = NULL;
+  int max_bands = 8;
+  int iterations = 100;
+  bool pipeline = false;
+  bool rgb = false;
+  bool incremental = false;
+  bool gray = false;
+  double gate = 0;
+  std::string geometries;
+  std::string replay;
+  std::string recording;
+  int fps = 30;
+  int seconds = 10;
+  bool udp = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "d:b:i:pRIGg:r:m:x:f:t:u")) != -1) {
+    switch (opt) {
+    case 'd':
+      display_name = optarg;
+      break;
+    case 'b':
+      max_bands = atoi(optarg);
+      break;
+    case 'i':
+      iterations = atoi(optarg);
+      break;
+    case 'p':
+      pipeline = true;
+      break;
+    case 'R':
+      rgb = true;
+      break;
+    case 'I':
+      incremental = true;
+      break;
+    case 'G':
+      gray = true;
+      break;
+    case 'g':
+      gate = atof(optarg);
+      break;
+    case 'r':
+      replay = optarg;
+      break;
+    case 'm':
+      recording = optarg;
+      break;
+    case 'x':
+      geometries = optarg;
+      break;
+    case 'f':
+      fps = atoi(optarg);
+      break;
+    case 't':
+      seconds = atoi(optarg);
+      break;
+    case 'u':
+      udp = true;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (max_bands <= 0 || iterations <= 0 || fps <= 0 || seconds <= 0 || (rgb && gray)) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if (!recording.empty()) {
+    if (bench_read(recording, iterations) < 0) {
+      std::cerr << "Failed to read " << recording << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  if (udp) {
+    std::cout << "    mode  rate kbps  datagrams  lost  cc err  peak q KiB  err ms avg  err ms max" << std::endl;
+    for (bool paced : {false, true}) {
+      if (bench_udp(fps, seconds, paced) < 0) {
+        std::cerr << "Failed to stream over loopback UDP" << std::endl;
+        return 1;
+      }
+    }
+    return 0;
+  }
+
+  if (!geometries.empty()) {
+    avdevice_register_all();
+
+    std::cout << "      resolution      fps  jitter ms     p99 ms  cpu ms/frm  srv ms/frm" << std::endl;
+    std::istringstream list(geometries);
+    std::string geometry;
+    while (std::getline(list, geometry, ',')) {
+      if (bench_xvfb(geometry, fps, seconds) < 0) {
+        std::cerr << "Failed to record from Xvfb at " << geometry << std::endl;
+        return 1;
+      }
+    }
+    return 0;
+  }
+
+  if (pipeline || !replay.empty()) {
+    if (!replay.empty() && bench_replay(replay, rgb, incremental, gray) < 0) {
+      std::cerr << "Failed to replay " << replay << std::endl;
+      return 1;
+    }
+
+    if (replay.empty() && bench_pipeline(display_name, iterations, rgb, incremental, gray) < 0) {
+      std::cerr << "Failed to run the capture pipeline" << std::endl;
+      return 1;
+    }
+
+    if (gate > 0 && CopyAudit::bytes_per_pixel() > gate) {
+      std::cerr << "Copied " << CopyAudit::bytes_per_pixel()
+                << " bytes per output pixel, more than the " << gate
+                << " allowed" << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  std::cout << " bands   mean ms    p50 ms    p99 ms   Mpixel/s" << std::endl;
+  for (int bands = 1; bands <= max_bands; bands *= 2) {
+    if (bench_bands(display_name, bands, iterations) < 0) {
+      std::cerr << "Failed to capture with " << bands << " bands" << std::endl;
+      return 1;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,573 @@
+// capture.hpp -*- c++ -*-
+
+/*
+ * MIT License
+ *
+ * Copyright (c) 2022 Walker Griggs
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xfixes.h>
+#include <X11/extensions/Xdamage.h>
+
+#include "libav.hpp"
+
+/** An axis-aligned rectangle in frame coordinates.
+ */
+struct Rect {
+  int x, y, w, h;
+
+  int area() const {
+    return w * h;
+  }
+
+  bool empty() const {
+    return w <= 0 || h <= 0;
+  }
+
+  /** The smallest rectangle containing both this and the other rectangle.
+   */
+  Rect united(const Rect& o) const {
+    int x0 = std::min(x, o.x);
+    int y0 = std::min(y, o.y);
+    int x1 = std::max(x + w, o.x + o.w);
+    int y1 = std::max(y + h, o.y + o.h);
+    return Rect{x0, y0, x1 - x0, y1 - y0};
+  }
+
+  /** The overlap of this and the other rectangle, empty if they are disjoint.
+   */
+  Rect intersected(const Rect& o) const {
+    int x0 = std::max(x, o.x);
+    int y0 = std::max(y, o.y);
+    int x1 = std::min(x + w, o.x + o.w);
+    int y1 = std::min(y + h, o.y + o.h);
+    return Rect{x0, y0, std::max(0, x1 - x0), std::max(0, y1 - y0)};
+  }
+};
+
+/** Coalesce a fragmented damage region into a handful of rectangles.
+ *
+ * Every rectangle costs one server round-trip to fetch, so typing or a
+ * blinking caret that produces dozens of tiny rectangles is cheaper to fetch
+ * as a few slightly larger ones. Two rectangles are merged whenever their
+ * bounding box wastes fewer than `slack` pixels. If more than `max_rects`
+ * remain, they are collapsed into a single bounding box.
+ *
+ * @param rects     the damaged rectangles, merged in place
+ * @param max_rects the maximum number of rectangles to keep
+ * @param slack     the number of undamaged pixels a merge may pull in
+ */
+inline void merge_rects(std::vector<Rect>& rects, size_t max_rects, int slack) {
+  bool merged = true;
+  while (merged && rects.size() > 1) {
+    merged = false;
+    for (size_t i = 0; i < rects.size() && !merged; i++) {
+      for (size_t j = i + 1; j < rects.size(); j++) {
+        Rect u = rects[i].united(rects[j]);
+        if (u.area() - rects[i].area() - rects[j].area() <= slack) {
+          rects[i] = u;
+          rects.erase(rects.begin() + j);
+          merged = true;
+          break;
+        }
+      }
+    }
+  }
+
+  if (rects.size() > max_rects) {
+    Rect u = rects[0];
+    for (auto& r : rects) {
+      u = u.united(r);
+    }
+    rects.assign(1, u);
+  }
+}
+
+/** Move a rectangle of pixels within one plane, like memmove.
+ *
+ * Rows are walked away from the overlap, so the source and destination may
+ * overlap in any direction.
+ *
+ * @param data            the plane
+ * @param linesize        the plane's bytes per row
+ * @param bytes_per_pixel the bytes per pixel in the plane
+ * @param dst             the destination rectangle
+ * @param src_x           the source rectangle's left edge
+ * @param src_y           the source rectangle's top edge
+ */
+inline void move_rect(uint8_t* data, int linesize, int bytes_per_pixel,
+                      const Rect& dst, int src_x, int src_y) {
+  size_t n = (size_t)dst.w * bytes_per_pixel;
+  auto row = [&](int x, int y) {
+    return data + (ptrdiff_t)y * linesize + x * bytes_per_pixel;
+  };
+
+  if (src_y < dst.y) {
+    for (int y = dst.h - 1; y >= 0; y--) {
+      memmove(row(dst.x, dst.y + y), row(src_x, src_y + y), n);
+    }
+  } else {
+    for (int y = 0; y < dst.h; y++) {
+      memmove(row(dst.x, dst.y + y), row(src_x, src_y + y), n);
+    }
+  }
+}
+
+/** A source that keeps a persistent frame of the screen up to date.
+ *
+ * Sources know which parts of the screen changed, from the X server's damage
+ * or a remote server's update rectangles, and report them so later stages
+ * only work on changed areas.
+ */
+class CaptureSource {
+public:
+  virtual ~CaptureSource() = default;
+
+  /** Brings the persistent frame up to date.
+   *
+   * @return The number of changed rectangles on success, a negative value on
+   *         error.
+   */
+  virtual int grab() = 0;
+
+  /** Forces the next call to `grab` to refresh the whole screen.
+   */
+  virtual void invalidate() = 0;
+
+  /** Releases the connection to the screen.
+   */
+  virtual void close() = 0;
+
+  /** The persistent, full-screen BGR0 frame.
+   */
+  virtual Frame& get_frame() = 0;
+
+  /** The rectangles updated by the last call to `grab`.
+   */
+  virtual const std::vector<Rect>& damaged() const = 0;
+
+  virtual int get_width() const = 0;
+
+  virtual int get_height() const = 0;
+};
+
+/** A native X11 screen capture source.
+ *
+ * Unlike x11grab, which pulls the whole root window from the server on every
+ * frame, X11Capture tracks damage with the XDamage extension and fetches only
+ * the damaged rectangles over MIT-SHM into a persistent, full-screen BGR0
+ * frame. Memory traffic per frame is proportional to the changed area rather
+ * than the screen size.
+ *
+ * Large displays can be split into horizontal bands, each fetched by its own
+ * thread over its own X connection and shared memory segment, so a 4K or 8K
+ * refresh is no longer serialized on a single round-trip.
+ *
+ * The persistent frame is updated in place; consumers that hold on to it
+ * across calls to `grab` must take their own reference or copy.
+ */
+class X11Capture : public CaptureSource {
+public:
+  /** The most rectangles fetched per frame before collapsing to a bounding box.
+   */
+  static constexpr size_t max_rects = 16;
+
+  /** The undamaged pixels a rectangle merge may pull in (one 64x64 tile).
+   */
+  static constexpr int merge_slack = 64 * 64;
+
+  X11Capture() = default;
+  X11Capture(const X11Capture&) = delete;
+  X11Capture& operator=(const X11Capture&) = delete;
+
+  ~X11Capture() override {
+    close();
+  }
+
+  /** Connects to the display and sets up damage tracking and shared memory.
+   *
+   * @param display_name the X display to capture, NULL for $DISPLAY
+   * @param nb_bands     the number of bands fetched concurrently, each over
+   *                     its own connection and thread
+   *
+   * @return Zero on success, a negative value on error.
+   */
+  int open(const char* display_name, int nb_bands = 1) {
+    display = XOpenDisplay(display_name);
+    if (!display) {
+      return -1;
+    }
+
+    int event_base, error_base;
+    if (!XShmQueryExtension(display) ||
+        !XFixesQueryExtension(display, &event_base, &error_base) ||
+        !XDamageQueryExtension(display, &event_base, &error_base)) {
+      close();
+      return -1;
+    }
+
+    root = DefaultRootWindow(display);
+    int screen = DefaultScreen(display);
+    width = DisplayWidth(display, screen);
+    height = DisplayHeight(display, screen);
+
+    // Bands are kept to an even number of rows for 4:2:0 consumers.
+    nb_bands = std::max(1, std::min(nb_bands, height / 2));
+    int band_height = ((height + nb_bands - 1) / nb_bands + 1) & ~1;
+    nb_bands = (height + band_height - 1) / band_height;
+
+    bands.resize(nb_bands);
+    for (int i = 0; i < nb_bands; i++) {
+      Band& band = bands[i];
+      int y = i * band_height;
+      band.area = Rect{0, y, width, std::min(band_height, height - y)};
+
+      // The first band shares the damage connection, the rest get their own.
+      band.display = i == 0 ? display : XOpenDisplay(display_name);
+      if (!band.display || open_band(band) < 0) {
+        close();
+        return -1;
+      }
+    }
+
+    damage = XDamageCreate(display, root, XDamageReportNonEmpty);
+    region = XFixesCreateRegion(display, NULL, 0);
+
+    frame = Frame::alloc(width, height, AV_PIX_FMT_BGR0);
+    if (!frame) {
+      close();
+      return -1;
+    }
+
+    quit = false;
+    for (size_t i = 1; i < bands.size(); i++) {
+      bands[i].thread = std::thread(&X11Capture::worker, this, i);
+    }
+
+    full_refresh = true;
+    return 0;
+  }
+
+  /** Stops the band threads and releases the damage object, shared memory
+   *  and display connections.
+   */
+  void close() override {
+    if (!display) {
+      return;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      quit = true;
+    }
+    start_cv.notify_all();
+
+    for (auto& band : bands) {
+      if (band.thread.joinable()) {
+        band.thread.join();
+      }
+    }
+
+    if (region) {
+      XFixesDestroyRegion(display, region);
+      region = 0;
+    }
+
+    if (damage) {
+      XDamageDestroy(display, damage);
+      damage = 0;
+    }
+
+    for (auto& band : bands) {
+      close_band(band);
+    }
+    bands.clear();
+
+    XCloseDisplay(display);
+    display = NULL;
+  }
+
+  /** Fetches the damaged rectangles into the persistent frame.
+   *
+   * The first call after `open` or `invalidate` fetches the whole screen.
+   * Afterwards only the region damaged since the previous call is fetched; the
+   * rectangles that were fetched are available from `damaged`.
+   *
+   * @return The number of damaged rectangles on success, a negative value on
+   *         error.
+   */
+  int grab() override {
+    rects.clear();
+
+    // An encoder may still hold the last frame; copy it out from under them
+    // rather than overwrite a picture that is in flight.
+    if (frame.make_writable() < 0) {
+      return -1;
+    }
+
+    // Drain the notify events; the accumulated region is what we act on.
+    while (XPending(display)) {
+      XEvent event;
+      XNextEvent(display, &event);
+    }
+
+    XDamageSubtract(display, damage, None, region);
+
+    if (full_refresh) {
+      rects.push_back(Rect{0, 0, width, height});
+      full_refresh = false;
+    } else {
+      int n = 0;
+      XRectangle* xrects = XFixesFetchRegion(display, region, &n);
+      Rect screen{0, 0, width, height};
+      for (int i = 0; i < n; i++) {
+        Rect r = Rect{xrects[i].x, xrects[i].y, xrects[i].width, xrects[i].height}.intersected(screen);
+        if (!r.empty()) {
+          rects.push_back(r);
+        }
+      }
+      if (xrects) {
+        XFree(xrects);
+      }
+      merge_rects(rects, max_rects, merge_slack);
+    }
+
+    for (auto& band : bands) {
+      band.rects.clear();
+      for (auto& r : rects) {
+        Rect clipped = r.intersected(band.area);
+        if (!clipped.empty()) {
+          band.rects.push_back(clipped);
+        }
+      }
+    }
+
+    if (bands.size() > 1) {
+      std::unique_lock<std::mutex> lock(mutex);
+      pending = bands.size() - 1;
+      generation++;
+      lock.unlock();
+      start_cv.notify_all();
+
+      bands[0].status = fetch_band(bands[0]);
+
+      lock.lock();
+      done_cv.wait(lock, [&] { return pending == 0; });
+    } else {
+      bands[0].status = fetch_band(bands[0]);
+    }
+
+    for (auto& band : bands) {
+      if (band.status < 0) {
+        return -1;
+      }
+    }
+
+    return rects.size();
+  }
+
+  /** Forces the next call to `grab` to fetch the whole screen.
+   */
+  void invalidate() override {
+    full_refresh = true;
+  }
+
+  /** The persistent, full-screen BGR0 frame.
+   */
+  Frame& get_frame() override {
+    return frame;
+  }
+
+  /** The rectangles fetched by the last call to `grab`.
+   */
+  const std::vector<Rect>& damaged() const override {
+    return rects;
+  }
+
+  int get_width() const override {
+    return width;
+  }
+
+  int get_height() const override {
+    return height;
+  }
+
+  int get_bands() const {
+    return bands.size();
+  }
+
+private:
+  /** One horizontal slice of the screen and the connection that fetches it.
+   */
+  struct Band {
+    Display* display = NULL;
+    XImage* image = NULL;
+    XShmSegmentInfo shminfo = {};
+    Rect area = {};
+    std::vector<Rect> rects;
+    int status = 0;
+    std::thread thread;
+  };
+
+  /** Create and attach a shared memory image large enough for the band.
+   */
+  int open_band(Band& band) {
+    int screen = DefaultScreen(band.display);
+    band.image = XShmCreateImage(band.display, DefaultVisual(band.display, screen),
+                                 DefaultDepth(band.display, screen), ZPixmap, NULL,
+                                 &band.shminfo, band.area.w, band.area.h);
+    if (!band.image || band.image->bits_per_pixel != 32) {
+      return -1;
+    }
+
+    band.shminfo.shmid = shmget(IPC_PRIVATE,
+                                band.image->bytes_per_line * band.image->height,
+                                IPC_CREAT | 0600);
+    if (band.shminfo.shmid < 0) {
+      return -1;
+    }
+
+    band.shminfo.shmaddr = band.image->data = (char*)shmat(band.shminfo.shmid, NULL, 0);
+    band.shminfo.readOnly = False;
+    if (band.shminfo.shmaddr == (char*)-1 || !XShmAttach(band.display, &band.shminfo)) {
+      return -1;
+    }
+
+    // Mark the segment for removal now; it lives until the last detach.
+    XSync(band.display, False);
+    shmctl(band.shminfo.shmid, IPC_RMID, NULL);
+    return 0;
+  }
+
+  void close_band(Band& band) {
+    if (band.image) {
+      if (band.shminfo.shmaddr && band.shminfo.shmaddr != (char*)-1) {
+        XShmDetach(band.display, &band.shminfo);
+        shmdt(band.shminfo.shmaddr);
+      }
+      band.image->data = NULL;
+      XDestroyImage(band.image);
+      band.image = NULL;
+    }
+
+    if (band.display && band.display != display) {
+      XCloseDisplay(band.display);
+    }
+    band.display = NULL;
+  }
+
+  /** Wait for each grab and fetch this thread's band.
+   */
+  void worker(size_t i) {
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      start_cv.wait(lock, [&] { return quit || generation != seen; });
+      if (quit) {
+        return;
+      }
+      seen = generation;
+
+      lock.unlock();
+      bands[i].status = fetch_band(bands[i]);
+      lock.lock();
+
+      if (--pending == 0) {
+        done_cv.notify_one();
+      }
+    }
+  }
+
+  int fetch_band(Band& band) {
+    for (auto& r : band.rects) {
+      if (fetch(band, r) < 0) {
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  /** Fetch one rectangle into the persistent frame.
+   *
+   * XShmGetImage sizes the request from the image header and the server packs
+   * the rows tightly at the start of the segment, so the header is shrunk to
+   * the rectangle for the request and the rows are then copied into place.
+   */
+  int fetch(Band& band, const Rect& r) {
+    XImage* image = band.image;
+    int w = image->width, h = image->height, bpl = image->bytes_per_line;
+    image->width = r.w;
+    image->height = r.h;
+    image->bytes_per_line = r.w * 4;
+
+    Status ok = XShmGetImage(band.display, root, image, r.x, r.y, AllPlanes);
+
+    image->width = w;
+    image->height = h;
+    image->bytes_per_line = bpl;
+    if (!ok) {
+      return -1;
+    }
+
+    uint8_t* dst = frame->data[0] + r.y * frame->linesize[0] + r.x * 4;
+    const uint8_t* src = (const uint8_t*)image->data;
+    for (int y = 0; y < r.h; y++) {
+      memcpy(dst + y * frame->linesize[0], src + y * r.w * 4, r.w * 4);
+    }
+
+    CopyAudit::add(CopyAudit::fetch, (int64_t)r.w * r.h * 4);
+    CopyAudit::add(CopyAudit::capture, (int64_t)r.w * r.h * 4);
+    return 0;
+  }
+
+  Display* display = NULL;
+  Window root = 0;
+  Damage damage = 0;
+  XserverRegion region = 0;
+  int width = 0;
+  int height = 0;
+  bool full_refresh = true;
+  std::vector<Rect> rects;
+  std::vector<Band> bands;
+  Frame frame = Frame(NULL, [](AVFrame*) {});
+
+  std::mutex mutex;
+  std::condition_variable start_cv;
+  std::condition_variable done_cv;
+  uint64_t generation = 0;
+  size_t pending = 0;
+  bool quit = false;
+};
@@ -0,0 +1,495 @@
+// change.hpp -*- c++ -*-
+
+/*
+ * MIT License
+ *
+ * Copyright (c) 2022 Walker Griggs
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+#include "libav.hpp"
+#include "capture.hpp"
+
+/** Settings for what counts as a significant change.
+ */
+struct ChangeOptions {
+  int tile = 64;                 ///< tile edge length in pixels
+  int threshold_pixels = 1;      ///< changed pixels a tile needs to be dirty
+  int64_t threshold_sad = 0;     ///< sum of absolute differences a tile needs, 0 to ignore
+  std::vector<Rect> ignore;      ///< regions whose changes are cosmetic
+  double ignore_refresh = 10.0;  ///< seconds between refreshes of ignored regions, 0 for never
+  bool scroll = false;           ///< detect vertically scrolled regions
+};
+
+/** A region whose rows moved vertically since the last frame.
+ */
+struct Scroll {
+  Rect area;  ///< where the rows are now
+  int dy;     ///< how far they moved, positive downwards
+};
+
+/** Receives the detector's findings as it makes them.
+ *
+ * A listener that handles each dirty tile as it is reported does so while the
+ * tile is still in cache from being compared, instead of reading the frame
+ * again in a pass of its own.
+ */
+class ChangeListener {
+public:
+  virtual ~ChangeListener() = default;
+
+  /** A region scrolled and was moved in the reference. Every scroll is
+   *  reported before the first dirty tile.
+   */
+  virtual void scrolled(const Frame& /*frame*/, const Scroll& /*scroll*/) {}
+
+  /** A tile changed significantly and was copied into the reference.
+   */
+  virtual void dirty(const Frame& /*frame*/, const Rect& /*tile*/) {}
+};
+
+/** Tile-based change detection over packed 32-bit RGB frames.
+ *
+ * The detector keeps a reference copy of the last significant picture and
+ * compares each candidate tile against it. A tile is dirty only if enough of
+ * its pixels changed, by count and optionally by SAD; pixels inside ignore
+ * regions (a clock, a blinking caret, a spinner) are not compared at all,
+ * except on the periodic refresh that keeps them from going stale.
+ *
+ * Tiles that change too little are not copied into the reference, so slow
+ * drifts accumulate until they cross the threshold instead of going unseen.
+ * Damage reports each change only once, so under damage a tile left with
+ * differences below the threshold stays a candidate on later frames until it
+ * crosses it.
+ *
+ * With scroll detection on, each tile-wide column of the frame keeps a hash
+ * per row. Rows that changed vote, by looking their new hash up among the
+ * column's old hashes, for how far the content moved; the longest run of rows
+ * that agree with the winning shift is reported as a Scroll and moved in the
+ * reference before tiles are compared. Only the newly exposed strip is then
+ * dirty, so a scroll costs about as much as a small edit.
+ */
+class ChangeDetector {
+public:
+  explicit ChangeDetector(ChangeOptions opts = ChangeOptions()) : options(std::move(opts)) {
+    options.tile = std::max(options.tile, 8) & ~1;
+    options.threshold_pixels = std::max(options.threshold_pixels, 1);
+  }
+
+  /** Compare a frame against the reference and mark the dirty tiles.
+   *
+   * @param frame  the captured BGR0 or BGRA frame
+   * @param damage   the regions that may have changed, NULL to compare every
+   *                 tile
+   * @param listener told about each scroll and dirty tile as it is found, or
+   *                 NULL
+   *
+   * @return The number of dirty tiles.
+   */
+  int detect(const Frame& frame, const std::vector<Rect>* damage = NULL,
+             ChangeListener* listener = NULL) {
+    if (!reference || reference->width != frame->width ||
+        reference->height != frame->height || reference->format != frame->format) {
+      if (reset(frame) < 0) {
+        return -1;
+      }
+    }
+
+    std::fill(dirty.begin(), dirty.end(), 0);
+    nb_dirty = 0;
+
+    if (!comparable) {
+      std::fill(dirty.begin(), dirty.end(), 1);
+      nb_dirty = dirty.size();
+      return nb_dirty;
+    }
+
+    bool refresh = false;
+    auto now = std::chrono::steady_clock::now();
+    if (options.ignore_refresh > 0 && !options.ignore.empty() &&
+        now - last_refresh >= std::chrono::duration<double>(options.ignore_refresh)) {
+      refresh = true;
+      last_refresh = now;
+    }
+
+    std::fill(candidate.begin(), candidate.end(), damage == NULL || first);
+    if (damage && !first) {
+      for (auto& r : *damage) {
+        int tx0 = r.x / options.tile, tx1 = (r.x + r.w - 1) / options.tile;
+        int ty0 = r.y / options.tile, ty1 = (r.y + r.h - 1) / options.tile;
+        for (int ty = ty0; ty <= ty1 && ty < tiles_y; ty++) {
+          for (int tx = tx0; tx <= tx1 && tx < tiles_x; tx++) {
+            candidate[ty * tiles_x + tx] = 1;
+          }
+        }
+      }
+      for (int i = 0; i < (int)candidate.size(); i++) {
+        candidate[i] |= pending[i];
+      }
+    }
+
+    // Damage in ignored regions was consumed frames ago; revisit them all.
+    if (refresh) {
+      for (int i = 0; i < (int)ignored.size(); i++) {
+        if (!ignored[i].empty()) {
+          candidate[i] = 1;
+        }
+      }
+    }
+
+    scrolls.clear();
+    if (options.scroll) {
+      hash_rows(frame);
+      if (!first) {
+        find_scrolls(frame, listener);
+      }
+      std::swap(hashes, next_hashes);
+    }
+
+    for (int i = 0; i < (int)dirty.size(); i++) {
+      if (!candidate[i]) {
+        continue;
+      }
+
+      Rect r = tile_rect(i);
+      bool differs = false;
+      if (first || significant(frame, r, refresh ? no_ignore : ignored[i], differs)) {
+        pending[i] = 0;
+        dirty[i] = 1;
+        nb_dirty++;
+        copy_tile(frame, r);
+        if (listener) {
+          listener->dirty(frame, r);
+        }
+      } else {
+        pending[i] = damage && differs;
+      }
+    }
+
+    first = false;
+    return nb_dirty;
+  }
+
+  /** The regions found to have scrolled in the last frame, already applied
+   *  to the reference. Consumers holding a copy of the reference picture
+   *  apply them, in order, before updating the dirty tiles.
+   */
+  const std::vector<Scroll>& scrolled() const {
+    return scrolls;
+  }
+
+  /** Forget the reference, so the next frame is entirely dirty.
+   */
+  void invalidate() {
+    first = true;
+  }
+
+  /** One byte per tile, row-major, non-zero where the last frame was dirty.
+   */
+  const std::vector<uint8_t>& dirty_tiles() const {
+    return dirty;
+  }
+
+  /** The fraction of tiles that were dirty in the last frame.
+   */
+  double dirty_ratio() const {
+    return dirty.empty() ? 0 : (double)nb_dirty / dirty.size();
+  }
+
+  int get_tiles_x() const {
+    return tiles_x;
+  }
+
+  int get_tiles_y() const {
+    return tiles_y;
+  }
+
+  int get_tile() const {
+    return options.tile;
+  }
+
+  /** The frame area covered by a tile, clipped to the frame.
+   */
+  Rect tile_rect(int i) const {
+    int x = (i % tiles_x) * options.tile;
+    int y = (i / tiles_x) * options.tile;
+    return Rect{x, y, std::min(options.tile, reference->width - x),
+                std::min(options.tile, reference->height - y)};
+  }
+
+  const ChangeOptions& get_options() const {
+    return options;
+  }
+
+private:
+  /** Size the tile grid and reference for a new frame geometry.
+   */
+  int reset(const Frame& frame) {
+    reference = Frame::alloc(frame->width, frame->height, (AVPixelFormat)frame->format);
+    if (!reference) {
+      return -1;
+    }
+
+    comparable = frame->format == AV_PIX_FMT_BGR0 || frame->format == AV_PIX_FMT_BGRA;
+    tiles_x = (frame->width + options.tile - 1) / options.tile;
+    tiles_y = (frame->height + options.tile - 1) / options.tile;
+    dirty.assign(tiles_x * tiles_y, 0);
+    candidate.assign(tiles_x * tiles_y, 0);
+    pending.assign(tiles_x * tiles_y, 0);
+    hashes.assign((size_t)tiles_x * frame->height, 0);
+    next_hashes.assign((size_t)tiles_x * frame->height, 0);
+    scrolls.clear();
+
+    // Precompute, per tile, the parts of it that lie in an ignore region.
+    ignored.assign(tiles_x * tiles_y, std::vector<Rect>());
+    for (int i = 0; i < (int)ignored.size(); i++) {
+      Rect r = tile_rect(i);
+      for (auto& mask : options.ignore) {
+        Rect part = r.intersected(mask);
+        if (!part.empty()) {
+          ignored[i].push_back(part);
+        }
+      }
+    }
+
+    last_refresh = std::chrono::steady_clock::now();
+    first = true;
+    return 0;
+  }
+
+  /** Whether the tile changed enough, outside its ignored parts, to matter.
+   *
+   * @param differs set if any compared pixel differs, significant or not
+   */
+  bool significant(const Frame& frame, const Rect& r, const std::vector<Rect>& masks,
+                   bool& differs) {
+    int count = 0;
+    int64_t sad = 0;
+    bool want_sad = options.threshold_sad > 0;
+
+    for (int y = r.y; y < r.y + r.h; y++) {
+      auto a = (const uint32_t*)(frame->data[0] + y * frame->linesize[0]);
+      auto b = (const uint32_t*)(reference->data[0] + y * reference->linesize[0]);
+
+      // Compare the spans of this row that fall outside every mask.
+      int x = r.x;
+      while (x < r.x + r.w) {
+        int end = r.x + r.w;
+        for (auto& m : masks) {
+          if (y < m.y || y >= m.y + m.h || m.x + m.w <= x) {
+            continue;
+          }
+          if (m.x <= x) {
+            x = m.x + m.w;
+            end = x;
+            break;
+          }
+          end = std::min(end, m.x);
+        }
+        if (x >= end) {
+          continue;
+        }
+
+        compare(a + x, b + x, end - x, count, sad, want_sad);
+        x = end;
+      }
+
+      if (count >= options.threshold_pixels && (!want_sad || sad >= options.threshold_sad)) {
+        differs = true;
+        return true;
+      }
+    }
+    differs = count > 0;
+    return false;
+  }
+
+  /** Count the differing pixels of a span and, if wanted, their SAD.
+   *
+   * The padding byte of BGR0 is undefined and masked out.
+   */
+  static void compare(const uint32_t* a, const uint32_t* b, int n,
+                      int& count, int64_t& sad, bool want_sad) {
+    for (int i = 0; i < n; i++) {
+      uint32_t x = a[i], y = b[i];
+      if (!((x ^ y) & 0xFFFFFF)) {
+        continue;
+      }
+      count++;
+      if (want_sad) {
+        sad += std::abs((int)(x & 0xFF) - (int)(y & 0xFF)) +
+               std::abs((int)((x >> 8) & 0xFF) - (int)((y >> 8) & 0xFF)) +
+               std::abs((int)((x >> 16) & 0xFF) - (int)((y >> 16) & 0xFF));
+      }
+    }
+  }
+
+  /** Hash each row of each candidate tile; other rows keep their hashes.
+   *
+   * Hashes are kept per tile-wide column, so a scrolling pane next to a static
+   * sidebar still matches.
+   */
+  void hash_rows(const Frame& frame) {
+    int h = frame->height;
+    for (int i = 0; i < (int)candidate.size(); i++) {
+      Rect r = tile_rect(i);
+      uint64_t* out = next_hashes.data() + (size_t)(i % tiles_x) * h;
+      const uint64_t* in = hashes.data() + (size_t)(i % tiles_x) * h;
+
+      if (!candidate[i]) {
+        std::copy(in + r.y, in + r.y + r.h, out + r.y);
+        continue;
+      }
+
+      for (int y = r.y; y < r.y + r.h; y++) {
+        auto p = (const uint32_t*)(frame->data[0] + y * frame->linesize[0]) + r.x;
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (int x = 0; x < r.w; x++) {
+          hash = (hash ^ (p[x] & 0xFFFFFF)) * 0x100000001b3ULL;
+        }
+        out[y] = hash;
+      }
+    }
+  }
+
+  /** Find, per tile-wide column, the rows that moved together, and move them
+   *  in the reference.
+   *
+   * Rows whose hash repeats within a column, such as blank lines, say nothing
+   * about where they came from and do not vote. Runs are trimmed to even rows
+   * so 4:2:0 consumers can move chroma along with luma.
+   */
+  void find_scrolls(const Frame& frame, ChangeListener* listener) {
+    int h = reference->height;
+    std::unordered_map<uint64_t, int> rows;
+    std::unordered_map<int, int> votes;
+
+    for (int tx = 0; tx < tiles_x; tx++) {
+      const uint64_t* old = hashes.data() + (size_t)tx * h;
+      const uint64_t* now = next_hashes.data() + (size_t)tx * h;
+
+      int changed = 0;
+      for (int y = 0; y < h; y++) {
+        changed += old[y] != now[y];
+      }
+      if (changed < min_scroll_votes) {
+        continue;
+      }
+
+      rows.clear();
+      for (int y = 0; y < h; y++) {
+        auto res = rows.emplace(old[y], y);
+        if (!res.second) {
+          res.first->second = -1;
+        }
+      }
+
+      votes.clear();
+      for (int y = 0; y < h; y++) {
+        if (old[y] == now[y]) {
+          continue;
+        }
+        auto it = rows.find(now[y]);
+        if (it != rows.end() && it->second >= 0) {
+          votes[y - it->second]++;
+        }
+      }
+
+      int dy = 0, best = 0;
+      for (auto& v : votes) {
+        if (v.second > best) {
+          dy = v.first;
+          best = v.second;
+        }
+      }
+      if (best < min_scroll_votes) {
+        continue;
+      }
+
+      // The longest run of rows that agree with the shift.
+      int y0 = 0, y1 = 0;
+      for (int y = std::max(0, dy); y < std::min(h, h + dy);) {
+        int start = y;
+        while (y < std::min(h, h + dy) && now[y] == old[y - dy]) {
+          y++;
+        }
+        if (y - start > y1 - y0) {
+          y0 = start;
+          y1 = y;
+        }
+        y = std::max(y, start + 1);
+      }
+
+      y0 = (y0 + 1) & ~1;
+      y1 &= ~1;
+      if (y1 - y0 < min_scroll_rows) {
+        continue;
+      }
+
+      Scroll scroll;
+      scroll.area = Rect{tx * options.tile, y0, std::min(options.tile, reference->width - tx * options.tile), y1 - y0};
+      scroll.dy = dy;
+      move_rect(reference->data[0], reference->linesize[0], 4, scroll.area,
+                scroll.area.x, scroll.area.y - dy);
+      CopyAudit::add(CopyAudit::detect, (int64_t)scroll.area.area() * 4);
+      scrolls.push_back(scroll);
+      if (listener) {
+        listener->scrolled(frame, scroll);
+      }
+    }
+  }
+
+  void copy_tile(const Frame& frame, const Rect& r) {
+    for (int y = r.y; y < r.y + r.h; y++) {
+      memcpy(reference->data[0] + y * reference->linesize[0] + r.x * 4,
+             frame->data[0] + y * frame->linesize[0] + r.x * 4, r.w * 4);
+    }
+    CopyAudit::add(CopyAudit::detect, (int64_t)r.w * r.h * 4);
+  }
+
+  /** The rows that must agree on a shift before it counts as a scroll.
+   */
+  static constexpr int min_scroll_votes = 4;
+  static constexpr int min_scroll_rows = 16;
+
+  ChangeOptions options;
+  Frame reference = Frame(NULL, [](AVFrame*) {});
+  bool comparable = false;
+  bool first = true;
+  int tiles_x = 0;
+  int tiles_y = 0;
+  int nb_dirty = 0;
+  std::vector<uint8_t> dirty;
+  std::vector<uint8_t> candidate;
+  std::vector<uint8_t> pending;     ///< tiles with changes below the threshold, compared again
+  std::vector<std::vector<Rect>> ignored;
+  const std::vector<Rect> no_ignore;
+  std::chrono::steady_clock::time_point last_refresh;
+  std::vector<uint64_t> hashes;
+  std::vector<uint64_t> next_hashes;
+  std::vector<Scroll> scrolls;
+};
@@ -0,0 +1,142 @@
+// condense.cpp -*- c++ -*-
+
+/*
+ * MIT License
+ *
+ * Copyright (c) 2022 Walker Griggs
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * @file condense.cpp
+ *
+ * @brief Cuts the idle stretches out of a recording made with --activity.
+ *
+ * @author Walker Griggs (walker@walkergriggs.com)
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <unistd.h>
+
+#include "libav.hpp"
+#include "activity.hpp"
+#include "condense.hpp"
+
+/** Print usage to stderr.
+ *
+ * @param name the program name
+ */
+void usage(const char* name)
+{
+  std::cerr << "usage: " << name << " [-t threshold] [-p secs] [-i secs] [-P preset] [-q crf] recording [output]" << std::endl
+            << "  -t threshold   the fraction of the screen that must change in a second for it to count, default 0.002" << std::endl
+            << "  -p secs        keep this much either side of activity, default 1" << std::endl
+            << "  -i secs        keep idle stretches shorter than this, default 5" << std::endl
+            << "  -P preset      the preset for re-encoded GOP edges, default fast" << std::endl
+            << "  -q crf         the CRF for re-encoded GOP edges, default 18" << std::endl
+            << "The activity log is read from recording.activity. The output, MPEG-TS, defaults to" << std::endl
+            << "the recording's name with .condensed.ts, and its time map is written beside it as" << std::endl
+            << "output.timemap." << std::endl;
+}
+
+/** Condense a recording
+ *
+ * @param argc number of arguments
+ * @param argv the arguments themselves
+ */
+int main(int argc, char **argv) {
+  CondenseOptions options;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:p:i:P:q:")) != -1) {
+    switch (opt) {
+    case 't':
+      options.threshold = atof(optarg);
+      break;
+    case 'p':
+      options.pad = atof(optarg);
+      break;
+    case 'i':
+      options.min_idle = atof(optarg);
+      break;
+    case 'P':
+      options.preset = optarg;
+      break;
+    case 'q':
+      options.crf = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (optind >= argc || argc - optind > 2 || options.pad < 0 || options.min_idle < 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::string src = argv[optind];
+  std::string dst = optind + 1 < argc ? argv[optind + 1] : "";
+  if (dst.empty()) {
+    size_t dot = src.rfind('.');
+    size_t slash = src.rfind('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+      dot = src.size();
+    }
+    dst = src.substr(0, dot) + ".condensed.ts";
+  }
+
+  std::vector<double> scores;
+  if (ActivityLog::read(ActivityLog::path_of(src), scores) < 0) {
+    std::cerr << "Failed to read " << ActivityLog::path_of(src) << std::endl;
+    return 1;
+  }
+
+  auto spans = Condenser::plan(scores, options);
+  if (spans.empty()) {
+    std::cerr << "Nothing in " << src << " is active" << std::endl;
+    return 1;
+  }
+
+  Condenser condenser(options);
+  if (condenser.condense(src, dst, spans) < 0) {
+    std::cerr << condenser.get_error() << std::endl;
+    return 1;
+  }
+  if (condenser.write_time_map(dst + ".timemap") < 0) {
+    std::cerr << "Failed to write " << dst << ".timemap" << std::endl;
+    return 1;
+  }
+
+  double kept = 0;
+  for (auto& e : condenser.get_time_map()) {
+    kept += e.duration;
+  }
+  std::cerr << "Kept " << kept << " s of " << condenser.get_duration() << " s in "
+            << condenser.get_time_map().size() << " stretches: "
+            << condenser.get_copied() << " GOPs copied, "
+            << condenser.get_encoded() << " re-encoded, "
+            << condenser.get_skipped() << " skipped" << std::endl;
+  return 0;
+}
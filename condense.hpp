@@ -0,0 +1,616 @@
+// condense.hpp -*- c++ -*-
+
+/*
+ * MIT License
+ *
+ * Copyright (c) 2022 Walker Griggs
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+#include <cmath>
+
+extern "C" {
+#include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
+}
+
+#include "libav.hpp"
+
+/** What a condensed recording keeps, and how its edges are coded.
+ */
+struct CondenseOptions {
+  double threshold = 0.002;     ///< the activity score at which a second counts as active
+  double pad = 1;               ///< seconds kept either side of activity
+  double min_idle = 5;          ///< idle stretches shorter than this, in seconds, are kept
+  std::string preset = "fast";  ///< the preset for re-encoded GOP edges
+  int crf = 18;                 ///< the constant rate factor for re-encoded GOP edges
+};
+
+/** A stretch of the recording to keep, in seconds from its start.
+ */
+struct Span {
+  double start;
+  double end;
+};
+
+/** Where a stretch of the source landed in the condensed recording.
+ */
+struct TimeMapEntry {
+  double out;       ///< seconds into the condensed recording
+  double in;        ///< seconds into the source
+  double duration;  ///< seconds the stretch lasts
+};
+
+/** Cuts the idle stretches out of a recording.
+ *
+ * The kept spans come from the recording's activity log. A GOP that lies
+ * wholly inside a span is copied as it is; one that a span starts or ends
+ * inside is decoded and its kept frames coded again, beginning with an IDR,
+ * so only the edges of each span cost an encode. This relies on closed GOPs,
+ * which is how the recorder's encoders are set up.
+ *
+ * The result is MPEG-TS: copied GOPs carry the source's parameter sets in-band
+ * and re-encoded ones their own, so a player switches between them at each
+ * IDR, where MP4's single set of parameters in the header could describe only
+ * one of them. H.264 and HEVC recordings can be condensed.
+ *
+ * Timestamps run on across the cuts. Where a copied GOP's decode delay would
+ * take its DTS behind what was already written, the rest of the output is
+ * pushed back a few frames instead; the time map records where every stretch
+ * ended up.
+ */
+class Condenser {
+public:
+  explicit Condenser(CondenseOptions opts = CondenseOptions()) : options(std::move(opts)) {}
+
+  /** Choose the spans to keep from per-second activity scores.
+   *
+   * Active seconds are widened by the padding either side, and spans closer
+   * than the minimum idle stretch are joined.
+   */
+  static std::vector<Span> plan(const std::vector<double>& scores, const CondenseOptions& options) {
+    std::vector<Span> spans;
+    for (int i = 0; i < (int)scores.size(); i++) {
+      if (scores[i] < options.threshold) {
+        continue;
+      }
+
+      double start = std::max(i - options.pad, 0.0);
+      double end = i + 1 + options.pad;
+      if (!spans.empty() && start - spans.back().end < options.min_idle) {
+        spans.back().end = std::max(spans.back().end, end);
+      } else {
+        spans.push_back(Span{start, end});
+      }
+    }
+    return spans;
+  }
+
+  /** Write the given spans of a recording as one condensed recording.
+   *
+   * @param src   the recording
+   * @param dst   where to write the condensed recording, as MPEG-TS
+   * @param spans the spans to keep, in order and not overlapping
+   *
+   * @return Zero on success, a negative value on error.
+   */
+  int condense(const std::string& src, const std::string& dst, const std::vector<Span>& spans) {
+    time_map.clear();
+
+    if (index(src) < 0) {
+      return -1;
+    }
+    place(spans);
+
+    auto input_avfc = FormatContext::open_input_file(src);
+    if (!input_avfc.get()) {
+      return fail("Failed to open " + src);
+    }
+    AVStream* input_avs = input_avfc->streams[stream_idx];
+    time_base = input_avs->time_base;
+
+    const char* filter_name = input_avs->codecpar->codec_id == AV_CODEC_ID_H264 ? "h264_mp4toannexb"
+                            : input_avs->codecpar->codec_id == AV_CODEC_ID_HEVC ? "hevc_mp4toannexb"
+                            : NULL;
+    if (!filter_name) {
+      return fail("Only H.264 and HEVC recordings can be condensed");
+    }
+    bsf = BitstreamFilter::open(filter_name, input_avs->codecpar, time_base);
+    if (!bsf.get()) {
+      return fail("Failed to open the " + std::string(filter_name) + " filter");
+    }
+
+    decoder = DecoderContext::open_context(input_avs->codecpar);
+    if (!decoder.get()) {
+      return fail("Failed to open the decoder");
+    }
+
+    output_avfc = FormatContext::open_output(dst, "mpegts");
+    if (!output_avfc.get()) {
+      return fail("Failed to open " + dst);
+    }
+    output_idx = output_avfc.create_copy_stream(bsf->par_out, time_base);
+    if (output_idx < 0) {
+      return fail("Failed to create the output stream");
+    }
+    if (avformat_write_header(output_avfc.get(), NULL) < 0) {
+      return fail("Failed to write the output header");
+    }
+
+    shift = 0;
+    last_dts = AV_NOPTS_VALUE;
+    copying = -1;
+    map_span = -1;
+    int64_t n = 0;
+    int g = -1;
+    auto packet = Packet::alloc();
+    while (av_read_frame(input_avfc.get(), packet.get()) >= 0) {
+      if (packet->stream_index != stream_idx) {
+        av_packet_unref(packet.get());
+        continue;
+      }
+
+      if (g + 1 < (int)gops.size() && n == gops[g + 1].first) {
+        if (g >= 0 && finish(gops[g]) < 0) {
+          return -1;
+        }
+        g++;
+      }
+      n++;
+
+      int res = 0;
+      if (g >= 0) {
+        res = gops[g].mode == Gop::copy ? copy(packet, gops[g])
+            : gops[g].mode == Gop::encode ? decode(packet)
+            : 0;
+      }
+      av_packet_unref(packet.get());
+      if (res < 0) {
+        return -1;
+      }
+    }
+    if (g >= 0 && finish(gops[g]) < 0) {
+      return -1;
+    }
+
+    auto drain = Packet(NULL, [](AVPacket*) {});
+    if (bsf.send_packet(drain, [&](Packet p) { return write(p, copying); }) < 0) {
+      return fail("Failed to drain the bitstream filter");
+    }
+    if (av_write_trailer(output_avfc.get()) < 0) {
+      return fail("Failed to write the output trailer");
+    }
+    output_avfc = FormatContext(NULL, [](AVFormatContext*) {});
+
+    close_time_map();
+    return 0;
+  }
+
+  /** Write the time map, one stretch per line after a header:
+   *
+   *     # screencap timemap 1
+   *     # out in duration
+   *     0.000 12.000 4.000
+   *
+   * @return Zero on success, a negative value on error.
+   */
+  int write_time_map(const std::string& path) const {
+    std::ofstream os(path, std::ios::out | std::ios::trunc);
+    if (!os) {
+      return -1;
+    }
+
+    os << "# screencap timemap 1" << std::endl
+       << "# out in duration" << std::endl
+       << std::fixed << std::setprecision(3);
+    for (auto& e : time_map) {
+      os << e.out << " " << e.in << " " << e.duration << std::endl;
+    }
+    return os ? 0 : -1;
+  }
+
+  const std::vector<TimeMapEntry>& get_time_map() const {
+    return time_map;
+  }
+
+  /** GOPs copied as they were.
+   */
+  int get_copied() const {
+    return copied;
+  }
+
+  /** GOPs cut by a span edge and coded again.
+   */
+  int get_encoded() const {
+    return encoded;
+  }
+
+  /** GOPs left out entirely.
+   */
+  int get_skipped() const {
+    return skipped;
+  }
+
+  /** The source's duration, in seconds.
+   */
+  double get_duration() const {
+    return (end_pts - first_pts) * av_q2d(time_base);
+  }
+
+  /** A description of the last error, empty if there was none.
+   */
+  const std::string& get_error() const {
+    return error;
+  }
+
+private:
+  /** A run of packets from one keyframe to the next, in decode order.
+   */
+  struct Gop {
+    enum Mode { skip, copy, encode };
+
+    int64_t first;  ///< the keyframe's position among the stream's packets
+    int64_t start;  ///< the keyframe's PTS
+    int64_t end;    ///< the next keyframe's PTS, or the end of the stream
+    Mode mode = skip;
+    int span = -1;  ///< the span a copied GOP lies in
+  };
+
+  /** A span in the stream's time base, and where it starts in the output.
+   */
+  struct Placed {
+    int64_t start;
+    int64_t end;
+    int64_t out;
+  };
+
+  /** Find the video stream and its GOPs without decoding anything.
+   */
+  int index(const std::string& src) {
+    auto avfc = FormatContext::open_input_file(src);
+    if (!avfc.get()) {
+      return fail("Failed to open " + src);
+    }
+
+    stream_idx = avfc.find_best_stream_idx(AVMEDIA_TYPE_VIDEO, -1);
+    if (stream_idx < 0) {
+      return fail("No video stream in " + src);
+    }
+    time_base = avfc->streams[stream_idx]->time_base;
+
+    gops.clear();
+    first_pts = end_pts = AV_NOPTS_VALUE;
+    int64_t n = 0;
+    auto packet = Packet::alloc();
+    while (av_read_frame(avfc.get(), packet.get()) >= 0) {
+      if (packet->stream_index == stream_idx && packet->pts != AV_NOPTS_VALUE) {
+        if (packet->flags & AV_PKT_FLAG_KEY) {
+          if (!gops.empty()) {
+            gops.back().end = packet->pts;
+          }
+          gops.push_back(Gop{n, packet->pts, packet->pts});
+        }
+        if (first_pts == AV_NOPTS_VALUE || packet->pts < first_pts) {
+          first_pts = packet->pts;
+        }
+        if (end_pts == AV_NOPTS_VALUE || packet->pts + packet->duration > end_pts) {
+          end_pts = packet->pts + packet->duration;
+        }
+      }
+      if (packet->stream_index == stream_idx) {
+        n++;
+      }
+      av_packet_unref(packet.get());
+    }
+
+    if (gops.empty()) {
+      return fail("No keyframes in " + src);
+    }
+    gops.back().end = end_pts;
+    return 0;
+  }
+
+  /** Convert the spans to the stream's time base, clipped to the stream, and
+   *  decide what to do with each GOP.
+   */
+  void place(const std::vector<Span>& spans) {
+    placed.clear();
+    int64_t out = 0;
+    for (auto& s : spans) {
+      int64_t start = std::max<int64_t>(first_pts + std::llrint(s.start / av_q2d(time_base)), first_pts);
+      int64_t end = std::min<int64_t>(first_pts + std::llrint(s.end / av_q2d(time_base)), end_pts);
+      if (end <= start) {
+        continue;
+      }
+      placed.push_back(Placed{start, end, out});
+      out += end - start;
+    }
+
+    copied = encoded = skipped = 0;
+    for (auto& g : gops) {
+      g.mode = Gop::skip;
+      for (int j = 0; j < (int)placed.size(); j++) {
+        if (placed[j].start <= g.start && g.end <= placed[j].end) {
+          g.mode = Gop::copy;
+          g.span = j;
+          break;
+        }
+        if (placed[j].start < g.end && g.start < placed[j].end) {
+          g.mode = Gop::encode;
+        }
+      }
+      (g.mode == Gop::copy ? copied : g.mode == Gop::encode ? encoded : skipped)++;
+    }
+  }
+
+  /** The span a source timestamp falls in, or -1.
+   */
+  int span_of(int64_t pts) const {
+    for (int j = 0; j < (int)placed.size(); j++) {
+      if (placed[j].start <= pts && pts < placed[j].end) {
+        return j;
+      }
+    }
+    return -1;
+  }
+
+  /** Copy a packet of a GOP inside a span, through the filter that gives it
+   *  start codes.
+   */
+  int copy(Packet& packet, const Gop& gop) {
+    copying = gop.span;
+    int64_t offset = placed[gop.span].out - placed[gop.span].start;
+    if (packet->pts != AV_NOPTS_VALUE) {
+      packet->pts += offset;
+    }
+    if (packet->dts != AV_NOPTS_VALUE) {
+      packet->dts += offset;
+    }
+
+    if (bsf.send_packet(packet, [&](Packet p) { return write(p, gop.span); }) < 0) {
+      return fail("Failed to filter a copied packet");
+    }
+    return 0;
+  }
+
+  /** Decode a packet of a GOP a span edge cuts, and code its kept frames
+   *  again.
+   */
+  int decode(Packet& packet) {
+    if (decoder.send_packet(packet, [&](Frame frame) { return reencode(frame); }) < 0) {
+      return fail("Failed to decode a GOP edge");
+    }
+    return 0;
+  }
+
+  /** Code a decoded frame again, if it falls in a span. The first kept frame
+   *  of a GOP opens a fresh encoder and is coded as an IDR.
+   */
+  int reencode(Frame& frame) {
+    int64_t pts = frame->best_effort_timestamp;
+    int j = span_of(pts);
+    if (j < 0) {
+      return 0;
+    }
+
+    bool first = !encoder.get();
+    if (first && open_encoder() < 0) {
+      return -1;
+    }
+
+    Frame converted = Frame(NULL, [](AVFrame*) {});
+    if (frame->format != encoder->pix_fmt) {
+      converted = frame.scale(frame->width, frame->height, encoder->pix_fmt);
+      if (!converted) {
+        return fail("Failed to convert a GOP edge for its encoder");
+      }
+    }
+    Frame& input = converted ? converted : frame;
+
+    input->pts = pts + placed[j].out - placed[j].start;
+    input->pkt_dts = AV_NOPTS_VALUE;
+    int res = encoder.send_frame(input, [&](Packet p) {
+      return write(p, span_of_out(p->pts));
+    }, first);
+    return res < 0 ? -1 : 0;
+  }
+
+  /** The span an output timestamp falls in, or -1.
+   */
+  int span_of_out(int64_t out) const {
+    for (int j = 0; j < (int)placed.size(); j++) {
+      if (placed[j].out <= out && out < placed[j].out + placed[j].end - placed[j].start) {
+        return j;
+      }
+    }
+    return -1;
+  }
+
+  /** Finish a GOP: drain what the decoder and encoder still hold.
+   */
+  int finish(const Gop& gop) {
+    if (gop.mode != Gop::encode) {
+      return 0;
+    }
+
+    auto drain = Packet(NULL, [](AVPacket*) {});
+    if (decoder.send_packet(drain, [&](Frame frame) { return reencode(frame); }) < 0) {
+      return fail("Failed to decode a GOP edge");
+    }
+    avcodec_flush_buffers(decoder.get());
+
+    if (encoder.get()) {
+      auto flush = Frame(NULL, [](AVFrame*) {});
+      if (encoder.send_frame(flush, [&](Packet p) { return write(p, span_of_out(p->pts)); }) < 0) {
+        return fail("Failed to flush a GOP edge");
+      }
+      encoder = EncoderContext(NULL, [](AVCodecContext*) {});
+    }
+    return 0;
+  }
+
+  /** Open an encoder for a GOP edge, matching the decoded pictures.
+   *
+   * No B-frames, so the edge's DTS follow its PTS and meet the next copied
+   * GOP's in order. Without a global header the encoder repeats its parameter
+   * sets at each IDR.
+   *
+   * An RGB recording decodes to planar GBR, which libx264 can't code; it is
+   * coded with libx264rgb instead, converted to a layout that takes.
+   */
+  int open_encoder() {
+    const AVCodec* codec = NULL;
+    auto desc = av_pix_fmt_desc_get(decoder->pix_fmt);
+    if (decoder->codec_id == AV_CODEC_ID_H264 && desc && (desc->flags & AV_PIX_FMT_FLAG_RGB)) {
+      codec = avcodec_find_encoder_by_name("libx264rgb");
+    }
+    if (!codec) {
+      codec = avcodec_find_encoder(decoder->codec_id);
+    }
+    if (!codec) {
+      return fail("No encoder for the recording's codec");
+    }
+    encoder = EncoderContext::alloc_context((AVCodec*)codec);
+    if (!encoder.get()) {
+      return fail("Failed to allocate the encoder for a GOP edge");
+    }
+
+    encoder->pix_fmt = decoder->pix_fmt;
+    if (codec->pix_fmts) {
+      const AVPixelFormat* p = codec->pix_fmts;
+      while (*p != AV_PIX_FMT_NONE && *p != decoder->pix_fmt) {
+        p++;
+      }
+      if (*p == AV_PIX_FMT_NONE) {
+        encoder->pix_fmt = codec->pix_fmts[0];
+      }
+    }
+
+    av_opt_set(encoder->priv_data, "preset", options.preset.c_str(), 0);
+    av_opt_set_int(encoder->priv_data, "crf", options.crf, 0);
+    av_opt_set_int(encoder->priv_data, "forced-idr", 1, 0);
+    encoder->width               = decoder->width;
+    encoder->height              = decoder->height;
+    encoder->sample_aspect_ratio = decoder->sample_aspect_ratio;
+    encoder->time_base           = time_base;
+    encoder->max_b_frames        = 0;
+
+    if (encoder.open() < 0) {
+      return fail("Failed to open the encoder for a GOP edge");
+    }
+    return 0;
+  }
+
+  /** Write a packet whose timestamps are mapped into the output, keeping DTS
+   *  increasing and the time map up to date.
+   *
+   * @param packet the packet
+   * @param span   the span it came from
+   */
+  int write(Packet& packet, int span) {
+    if (span < 0) {
+      return 0;
+    }
+
+    int64_t source = packet->pts - (placed[span].out - placed[span].start);
+    packet->pts += shift;
+    packet->dts += shift;
+    if (last_dts != AV_NOPTS_VALUE && packet->dts <= last_dts) {
+      int64_t behind = last_dts + 1 - packet->dts;
+      shift += behind;
+      packet->pts += behind;
+      packet->dts += behind;
+    }
+    last_dts = packet->dts;
+
+    if (span != map_span || shift != map_shift) {
+      close_time_map();
+      map_span = span;
+      map_shift = shift;
+      map_in = source;
+      map_out = packet->pts;
+    }
+
+    packet->stream_index = output_idx;
+    if (output_avfc.write_packet(packet, time_base) < 0) {
+      return fail("Failed to write the condensed recording");
+    }
+    return 0;
+  }
+
+  /** Close the time map's current stretch at the end of its span, or where
+   *  the next stretch of the same span begins.
+   */
+  void close_time_map() {
+    if (map_span < 0) {
+      return;
+    }
+
+    double tb = av_q2d(time_base);
+    if (!time_map.empty() && time_map.back().in + time_map.back().duration > (map_in - first_pts) * tb) {
+      time_map.back().duration = (map_in - first_pts) * tb - time_map.back().in;
+    }
+    time_map.push_back(TimeMapEntry{map_out * tb, (map_in - first_pts) * tb,
+                                    (placed[map_span].end - map_in) * tb});
+    map_span = -1;
+  }
+
+  int fail(const std::string& message) {
+    error = message;
+    return -1;
+  }
+
+  CondenseOptions options;
+
+  int stream_idx = -1;
+  AVRational time_base = {1, 1};
+  int64_t first_pts = 0;
+  int64_t end_pts = 0;
+  std::vector<Gop> gops;
+  std::vector<Placed> placed;
+
+  BitstreamFilter bsf = BitstreamFilter(NULL, [](AVBSFContext*) {});
+  DecoderContext decoder = DecoderContext(NULL, [](AVCodecContext*) {});
+  EncoderContext encoder = EncoderContext(NULL, [](AVCodecContext*) {});
+  FormatContext output_avfc = FormatContext(NULL, [](AVFormatContext*) {});
+  int output_idx = -1;
+
+  int copying = -1;
+  int64_t shift = 0;
+  int64_t last_dts = AV_NOPTS_VALUE;
+
+  int map_span = -1;
+  int64_t map_shift = 0;
+  int64_t map_in = 0;
+  int64_t map_out = 0;
+  std::vector<TimeMapEntry> time_map;
+
+  int copied = 0;
+  int encoded = 0;
+  int skipped = 0;
+  std::string error;
+};
@@ -0,0 +1,376 @@
+// convert.hpp -*- c++ -*-
+
+/*
+ * MIT License
+ *
+ * Copyright (c) 2022 Walker Griggs
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "libav.hpp"
+#include "capture.hpp"
+#include "change.hpp"
+
+/** Extracts BT.601 limited-range luma from packed 32-bit RGB, for recorders
+ *  that encode 4:0:0 and have no use for chroma.
+ *
+ * On x86-64 rows are converted eight pixels at a time with SSE2
+ * intrinsics, part of its baseline, so the speed doesn't rest on the
+ * compiler's vectorizer, which GCC only runs at -O2 from version 12. A scalar
+ * loop with the same arithmetic converts the rest of the row, and whole rows
+ * elsewhere. It writes one byte per pixel where 4:2:0 writes one and a half.
+ */
+struct LumaKernel {
+  /** Convert one row of `w` BGR0 or BGRA pixels to luma.
+   */
+  static void row(const uint8_t* src, uint8_t* dst, int w) {
+    int x = 0;
+#if defined(__SSE2__)
+    for (; x + 8 <= w; x += 8) {
+      __m128i b, g, r;
+      channels(src + 4 * x, b, g, r);
+      luma8(b, g, r, dst + x);
+    }
+#endif
+    for (; x < w; x++) {
+      uint32_t p;
+      memcpy(&p, src + 4 * x, sizeof(p));
+      dst[x] = luma_of(p);
+    }
+  }
+
+#if defined(__SSE2__)
+  /** Split eight BGR0 pixels into 16-bit blue, green and red.
+   */
+  static void channels(const uint8_t* src, __m128i& b, __m128i& g, __m128i& r) {
+    const __m128i mask = _mm_set1_epi32(0xff);
+    __m128i lo = _mm_loadu_si128((const __m128i*)src);
+    __m128i hi = _mm_loadu_si128((const __m128i*)(src + 16));
+    b = _mm_packs_epi32(_mm_and_si128(lo, mask), _mm_and_si128(hi, mask));
+    g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(lo, 8), mask),
+                        _mm_and_si128(_mm_srli_epi32(hi, 8), mask));
+    r = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(lo, 16), mask),
+                        _mm_and_si128(_mm_srli_epi32(hi, 16), mask));
+  }
+
+  /** Eight luma samples. The weighted sum stays under 65536, so it is formed
+   *  in wrapping 16-bit lanes and shifted as unsigned.
+   */
+  static void luma8(__m128i b, __m128i g, __m128i r, uint8_t* dst) {
+    __m128i y = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(66)),
+                                            _mm_mullo_epi16(g, _mm_set1_epi16(129))),
+                              _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(25)),
+                                            _mm_set1_epi16(128)));
+    y = _mm_add_epi16(_mm_srli_epi16(y, 8), _mm_set1_epi16(16));
+    _mm_storel_epi64((__m128i*)dst, _mm_packus_epi16(y, y));
+  }
+#endif
+
+  /** Convert a whole frame into a new GRAY8 frame. Frames in other formats
+   *  fall back to `Frame::scale`.
+   *
+   * @return The GRAY8 picture on success, a null frame on error.
+   */
+  static Frame convert(Frame& frame) {
+    if (frame->format != AV_PIX_FMT_BGR0 && frame->format != AV_PIX_FMT_BGRA) {
+      return frame.scale(frame->width, frame->height, AV_PIX_FMT_GRAY8);
+    }
+
+    auto gray = Frame::alloc(frame->width, frame->height, AV_PIX_FMT_GRAY8);
+    if (!gray) {
+      return gray;
+    }
+    for (int y = 0; y < frame->height; y++) {
+      row(frame->data[0] + y * frame->linesize[0], gray->data[0] + y * gray->linesize[0], frame->width);
+    }
+    CopyAudit::add(CopyAudit::scale, (int64_t)frame->width * frame->height);
+    return gray;
+  }
+
+  /** The luma of one little-endian BGR0 word.
+   */
+  static uint8_t luma_of(uint32_t p) {
+    return ((66 * (p >> 16 & 0xff) + 129 * (p >> 8 & 0xff) + 25 * (p & 0xff) + 128) >> 8) + 16;
+  }
+};
+
+/** Converts pairs of packed 32-bit RGB rows to BT.601 limited-range 4:2:0,
+ *  with chroma averaged over each 2x2 block.
+ *
+ * On x86-64, whose baseline includes SSE2, eight pixels of each row, four
+ * chroma blocks, are converted at a time with intrinsics; elsewhere, and for
+ * the blocks left over, a scalar loop does the same arithmetic, so both give
+ * identical pictures. A last column of an odd width is the only block that
+ * repeats a pixel, and is converted on its own after the loops.
+ */
+struct Yuv420Kernel {
+  /** Convert the blocks of two rows from column `x0`, which is even, up to
+   *  column `x_end`.
+   *
+   * @param s0   the upper source row, BGR0 or BGRA
+   * @param s1   the lower source row; the upper again for a last odd row
+   * @param d0   the upper luma row
+   * @param d1   the lower luma row
+   * @param u    the chroma rows, indexed by block
+   * @param v
+   * @param w    the frame's width
+   * @param luma whether to write luma as well as chroma
+   */
+  static void rows(const uint8_t* s0, const uint8_t* s1, uint8_t* d0, uint8_t* d1,
+                   uint8_t* u, uint8_t* v, int x0, int x_end, int w, bool luma) {
+    // Blocks wholly inside the frame.
+    int stop = std::min(x_end, w - 1);
+    int x = x0;
+#if defined(__SSE2__)
+    for (; x + 6 < stop; x += 8) {
+      simd8(s0 + 4 * x, s1 + 4 * x, d0 + x, d1 + x, u + x / 2, v + x / 2, luma);
+    }
+#endif
+    for (; x < stop; x += 2) {
+      block(s0 + 4 * x, s0 + 4 * x + 4, s1 + 4 * x, s1 + 4 * x + 4,
+            d0 + x, d0 + x + 1, d1 + x, d1 + x + 1, u + x / 2, v + x / 2, luma);
+    }
+    if (x < x_end) {
+      block(s0 + 4 * x, s0 + 4 * x, s1 + 4 * x, s1 + 4 * x,
+            d0 + x, d0 + x, d1 + x, d1 + x, u + x / 2, v + x / 2, luma);
+    }
+  }
+
+private:
+  static void block(const uint8_t* p0, const uint8_t* p1, const uint8_t* p2, const uint8_t* p3,
+                    uint8_t* y0, uint8_t* y1, uint8_t* y2, uint8_t* y3,
+                    uint8_t* u, uint8_t* v, bool luma) {
+    if (luma) {
+      *y0 = luma_of(p0);
+      *y1 = luma_of(p1);
+      *y2 = luma_of(p2);
+      *y3 = luma_of(p3);
+    }
+
+    int b = p0[0] + p1[0] + p2[0] + p3[0];
+    int g = p0[1] + p1[1] + p2[1] + p3[1];
+    int r = p0[2] + p1[2] + p2[2] + p3[2];
+    *u = ((-38 * r - 74 * g + 112 * b + 512) >> 10) + 128;
+    *v = ((112 * r - 94 * g - 18 * b + 512) >> 10) + 128;
+  }
+
+  static uint8_t luma_of(const uint8_t* p) {
+    return ((66 * p[2] + 129 * p[1] + 25 * p[0] + 128) >> 8) + 16;
+  }
+
+#if defined(__SSE2__)
+  /** Four 2x2 blocks: eight pixels of each row.
+   */
+  static void simd8(const uint8_t* s0, const uint8_t* s1, uint8_t* d0, uint8_t* d1,
+                    uint8_t* u, uint8_t* v, bool luma) {
+    __m128i b0, g0, r0, b1, g1, r1;
+    LumaKernel::channels(s0, b0, g0, r0);
+    LumaKernel::channels(s1, b1, g1, r1);
+    if (luma) {
+      LumaKernel::luma8(b0, g0, r0, d0);
+      LumaKernel::luma8(b1, g1, r1, d1);
+    }
+
+    // Sum each block's four pixels, then weigh the sums pairwise with madd.
+    const __m128i ones = _mm_set1_epi16(1);
+    __m128i b = _mm_add_epi32(_mm_madd_epi16(b0, ones), _mm_madd_epi16(b1, ones));
+    __m128i g = _mm_add_epi32(_mm_madd_epi16(g0, ones), _mm_madd_epi16(g1, ones));
+    __m128i r = _mm_add_epi32(_mm_madd_epi16(r0, ones), _mm_madd_epi16(r1, ones));
+    __m128i rg = _mm_unpacklo_epi16(_mm_packs_epi32(r, r), _mm_packs_epi32(g, g));
+    __m128i b1s = _mm_unpacklo_epi16(_mm_packs_epi32(b, b), ones);
+
+    __m128i cu = _mm_add_epi32(_mm_madd_epi16(rg, _mm_setr_epi16(-38, -74, -38, -74, -38, -74, -38, -74)),
+                               _mm_madd_epi16(b1s, _mm_setr_epi16(112, 512, 112, 512, 112, 512, 112, 512)));
+    __m128i cv = _mm_add_epi32(_mm_madd_epi16(rg, _mm_setr_epi16(112, -94, 112, -94, 112, -94, 112, -94)),
+                               _mm_madd_epi16(b1s, _mm_setr_epi16(-18, 512, -18, 512, -18, 512, -18, 512)));
+    const __m128i bias = _mm_set1_epi32(128);
+    cu = _mm_add_epi32(_mm_srai_epi32(cu, 10), bias);
+    cv = _mm_add_epi32(_mm_srai_epi32(cv, 10), bias);
+
+    __m128i uv = _mm_packus_epi16(_mm_packs_epi32(cu, cv), _mm_setzero_si128());
+    uint32_t w = _mm_cvtsi128_si32(uv);
+    memcpy(u, &w, 4);
+    w = _mm_cvtsi128_si32(_mm_srli_si128(uv, 4));
+    memcpy(v, &w, 4);
+  }
+#endif
+};
+
+/** Converts packed 32-bit RGB captures into a persistent YUV420P frame,
+ *  touching only what changed.
+ *
+ * Where `Frame::scale` converts the whole picture every frame, the converter
+ * keeps the last YUV picture and updates it from inside change detection: it
+ * listens to a ChangeDetector, replays each scroll on the YUV planes and
+ * converts each dirty tile the moment the detector has compared it, while the
+ * tile is still in cache. The frame is read from memory once per frame for
+ * detection and conversion together, and the YUV picture always matches the
+ * detector's reference.
+ *
+ * Scrolls by an even number of rows move luma and chroma alike. An odd shift
+ * splits the 2x2 chroma blocks, so luma is moved and chroma is reconverted
+ * for the scrolled region.
+ *
+ * The conversion is BT.601, limited range, with chroma averaged over each 2x2
+ * block. Frames in other formats fall back to `Frame::scale`. In gray mode the
+ * persistent frame is GRAY8 and only luma is converted and moved.
+ */
+class IncrementalConverter : public ChangeListener {
+public:
+  explicit IncrementalConverter(bool gray = false) : gray(gray) {}
+
+  /** Runs change detection on a frame and brings the YUV picture up to date
+   *  in the same pass.
+   *
+   * @param frame    the captured frame
+   * @param detector the detector to run
+   * @param damage   the regions that may have changed, NULL for all of them
+   *
+   * @return The number of dirty tiles on success, a negative value on error.
+   */
+  int update(Frame& frame, ChangeDetector& detector, const std::vector<Rect>* damage = NULL) {
+    if (frame->format != AV_PIX_FMT_BGR0 && frame->format != AV_PIX_FMT_BGRA) {
+      scaled = frame.scale(frame->width, frame->height, pix_fmt());
+      if (!scaled) {
+        return -1;
+      }
+      return detector.detect(frame, damage);
+    }
+    scaled = Frame(NULL, [](AVFrame*) {});
+
+    if (!yuv || yuv->width != frame->width || yuv->height != frame->height) {
+      yuv = Frame::alloc(frame->width, frame->height, pix_fmt());
+      if (!yuv) {
+        return -1;
+      }
+      first = true;
+    }
+
+    // The encoder may still hold the last picture.
+    if (yuv.make_writable() < 0) {
+      return -1;
+    }
+
+    // Every tile is dirty on the detector's first frame, so it converts the
+    // whole picture for us.
+    if (first) {
+      detector.invalidate();
+      first = false;
+    }
+
+    return detector.detect(frame, damage, this);
+  }
+
+  /** A new reference to the picture converted by the last call to `update`.
+   *
+   * @return The YUV420P, or GRAY8, picture on success, a null frame on error.
+   */
+  Frame get_frame() const {
+    return scaled ? scaled.ref() : yuv.ref();
+  }
+
+  /** Forces the next call to `update` to convert the whole frame.
+   */
+  void invalidate() {
+    first = true;
+  }
+
+  void scrolled(const Frame& frame, const Scroll& scroll) override {
+    move(frame, scroll);
+  }
+
+  void dirty(const Frame& frame, const Rect& tile) override {
+    if (gray) {
+      for (int y = tile.y; y < tile.y + tile.h; y++) {
+        LumaKernel::row(frame->data[0] + y * frame->linesize[0] + 4 * tile.x,
+                        yuv->data[0] + y * yuv->linesize[0] + tile.x, tile.w);
+      }
+      CopyAudit::add(CopyAudit::scale, tile.area());
+      return;
+    }
+    convert_rect(frame, tile, true);
+  }
+
+private:
+  AVPixelFormat pix_fmt() const {
+    return gray ? AV_PIX_FMT_GRAY8 : AV_PIX_FMT_YUV420P;
+  }
+
+  /** Replay a scroll on the YUV planes.
+   */
+  void move(const Frame& frame, const Scroll& s) {
+    const Rect& a = s.area;
+    move_rect(yuv->data[0], yuv->linesize[0], 1, a, a.x, a.y - s.dy);
+    int64_t bytes = a.area();
+
+    if (gray) {
+      CopyAudit::add(CopyAudit::scale, bytes);
+      return;
+    }
+
+    if (s.dy % 2 == 0) {
+      Rect c{a.x / 2, a.y / 2, (a.w + 1) / 2, a.h / 2};
+      for (int p = 1; p < 3; p++) {
+        move_rect(yuv->data[p], yuv->linesize[p], 1, c, c.x, c.y - s.dy / 2);
+      }
+      bytes += 2 * c.area();
+    } else {
+      convert_rect(frame, a, false);
+    }
+    CopyAudit::add(CopyAudit::scale, bytes);
+  }
+
+  /** Convert an even-aligned rectangle of the frame.
+   *
+   * @param frame the BGR0 or BGRA frame
+   * @param r     the rectangle, with even x and y
+   * @param luma  whether to write luma as well as chroma
+   */
+  void convert_rect(const Frame& frame, const Rect& r, bool luma) {
+    int h = frame->height;
+    for (int y = r.y; y < r.y + r.h; y += 2) {
+      int y1 = std::min(y + 1, h - 1);
+      Yuv420Kernel::rows(frame->data[0] + y * frame->linesize[0],
+                         frame->data[0] + y1 * frame->linesize[0],
+                         yuv->data[0] + y * yuv->linesize[0],
+                         yuv->data[0] + y1 * yuv->linesize[0],
+                         yuv->data[1] + (y / 2) * yuv->linesize[1],
+                         yuv->data[2] + (y / 2) * yuv->linesize[2],
+                         r.x, r.x + r.w, frame->width, luma);
+    }
+
+    int chroma = ((r.w + 1) / 2) * ((r.h + 1) / 2) * 2;
+    CopyAudit::add(CopyAudit::scale, (luma ? (int64_t)r.area() : 0) + chroma);
+  }
+
+  Frame yuv = Frame(NULL, [](AVFrame*) {});
+  Frame scaled = Frame(NULL, [](AVFrame*) {});
+  bool gray = false;
+  bool first = true;
+};
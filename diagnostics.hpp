@@ -0,0 +1,436 @@
+// diagnostics.hpp -*- c++ -*-
+
+/*
+ * MIT License
+ *
+ * Copyright (c) 2022 Walker Griggs
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <condition_variable>
+#include <functional>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/** Service level objectives for a recording, and where to report breaches.
+ */
+struct SloOptions {
+  double latency_ms = 0;       ///< the p99 per-frame processing time allowed, 0 for no objective
+  double drop_rate = 0;        ///< the fraction of frames that may be dropped, 0 for no objective
+  double window = 10;          ///< seconds of frames evaluated, and kept for a snapshot
+  std::string dir = ".";       ///< where diagnostics files are written
+  double min_interval = 300;   ///< the least time, in seconds, between snapshots
+  bool perf = false;           ///< also sample the recorder thread's hardware counters
+};
+
+/** What happened to one frame.
+ */
+struct FrameTrace {
+  double time = 0;       ///< seconds since the recording started
+  float grab_ms = 0;     ///< capturing the frame; 0 for x11grab, whose reads include its pacing
+  float convert_ms = 0;  ///< taps, change detection and conversion
+  float encode_ms = 0;   ///< encoding and muxing
+  float total_ms = 0;    ///< everything, from the grab to the mux
+  int dropped = 0;       ///< frames missed since the previous one
+  int dirty = -1;        ///< dirty tiles, -1 if detection didn't run
+  int in_flight = 0;     ///< frames held by the encoder after this one
+  int bytes = 0;         ///< encoded bytes this frame produced
+  bool skipped = false;  ///< not encoded, for lack of change
+  bool keyframe = false; ///< forced to be an IDR
+};
+
+/** A log2 histogram of durations, in microseconds.
+ */
+struct Histogram {
+  static constexpr int nb_buckets = 24;
+  int64_t buckets[nb_buckets] = {};
+
+  void add(double ms) {
+    int64_t us = (int64_t)(ms * 1000);
+    int b = 0;
+    while (b < nb_buckets - 1 && (int64_t)1 << b <= us) {
+      b++;
+    }
+    buckets[b]++;
+  }
+
+  /** One line of bucket counts, each under its upper bound.
+   */
+  void write(std::ostream& os) const {
+    for (int b = 0; b < nb_buckets; b++) {
+      if (buckets[b]) {
+        os << " <" << ((int64_t)1 << b) << "us:" << buckets[b];
+      }
+    }
+    os << "\n";
+  }
+};
+
+/** Per-stage histograms since the recording started.
+ */
+struct StageHistograms {
+  Histogram grab, convert, encode, total;
+
+  void add(const FrameTrace& t) {
+    grab.add(t.grab_ms);
+    convert.add(t.convert_ms);
+    encode.add(t.encode_ms);
+    total.add(t.total_ms);
+  }
+};
+
+/** Everything written to a diagnostics file.
+ */
+struct Snapshot {
+  std::string reason;
+  std::vector<FrameTrace> frames;
+  StageHistograms histograms;
+  std::vector<std::pair<std::string, std::string>> states;
+  pid_t tid = 0;  ///< the recorder thread, for the counter sample
+};
+
+/** The last `window` seconds of frame traces, and the SLO check over them.
+ *
+ * The recorder thread is the only writer and the only reader, so nothing is
+ * locked; taking a snapshot copies a few hundred small records.
+ */
+class TraceWindow {
+public:
+  explicit TraceWindow(const SloOptions& opts = SloOptions()) : options(opts) {}
+
+  void add(const FrameTrace& trace) {
+    frames.push_back(trace);
+    histograms.add(trace);
+    while (frames.front().time < trace.time - options.window) {
+      frames.pop_front();
+    }
+  }
+
+  /** Check the objectives over the window.
+   *
+   * @param reason what was breached, if anything
+   *
+   * @return Whether an objective is breached.
+   */
+  bool breached(std::string& reason) const {
+    if (frames.empty()) {
+      return false;
+    }
+
+    int total = 0, dropped = 0, slow = 0;
+    for (auto& f : frames) {
+      total += 1 + f.dropped;
+      dropped += f.dropped;
+      slow += options.latency_ms > 0 && f.total_ms > options.latency_ms;
+    }
+
+    char buf[128];
+    if (options.latency_ms > 0 && slow > 0.01 * frames.size()) {
+      snprintf(buf, sizeof(buf), "p99 latency over %.1f ms (%d of %zu frames)",
+               options.latency_ms, slow, frames.size());
+      reason = buf;
+      return true;
+    }
+    if (options.drop_rate > 0 && dropped > options.drop_rate * total) {
+      snprintf(buf, sizeof(buf), "drop rate %.3f over %.3f (%d of %d frames)",
+               (double)dropped / total, options.drop_rate, dropped, total);
+      reason = buf;
+      return true;
+    }
+    return false;
+  }
+
+  const std::deque<FrameTrace>& get_frames() const {
+    return frames;
+  }
+
+  const StageHistograms& get_histograms() const {
+    return histograms;
+  }
+
+  void clear() {
+    frames.clear();
+    histograms = StageHistograms();
+  }
+
+private:
+  SloOptions options;
+  std::deque<FrameTrace> frames;
+  StageHistograms histograms;
+};
+
+/** Writes diagnostics snapshots on a background thread.
+ *
+ * Snapshots are rate limited: at most one every `min_interval` seconds, and
+ * never more than one waiting to be written. The
+ * writer runs under SCHED_IDLE, so writing the file, and the one second
+ * counter sample, never competes with a recorder that is already behind.
+ */
+class DiagnosticsWriter {
+public:
+  explicit DiagnosticsWriter(SloOptions opts) : options(std::move(opts)) {}
+
+  DiagnosticsWriter(const DiagnosticsWriter&) = delete;
+  DiagnosticsWriter& operator=(const DiagnosticsWriter&) = delete;
+
+  ~DiagnosticsWriter() {
+    stop();
+  }
+
+  void start() {
+    quit = false;
+    worker = std::thread(&DiagnosticsWriter::run, this);
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      quit = true;
+    }
+    cv.notify_all();
+    if (worker.joinable()) {
+      worker.join();
+    }
+  }
+
+  /** Whether a snapshot would be accepted now; check before building one.
+   */
+  bool ready() {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto now = std::chrono::steady_clock::now();
+    if (pending || (written_any && now - last < std::chrono::duration<double>(options.min_interval))) {
+      suppressed++;
+      return false;
+    }
+    return true;
+  }
+
+  /** Hand over a snapshot to write.
+   */
+  void submit(std::unique_ptr<Snapshot> snapshot) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      pending = std::move(snapshot);
+      last = std::chrono::steady_clock::now();
+      written_any = true;
+    }
+    cv.notify_one();
+  }
+
+  /** The number of snapshots written.
+   */
+  int get_written() const {
+    return written;
+  }
+
+  /** The number of breaches not snapshotted because of the rate limit.
+   */
+  int get_suppressed() const {
+    return suppressed;
+  }
+
+private:
+  void run() {
+    struct sched_param param = {};
+    if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0) {
+      setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+    }
+
+    while (true) {
+      std::unique_ptr<Snapshot> snapshot;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return quit || pending; });
+        if (!pending) {
+          return;
+        }
+        snapshot = std::move(pending);
+      }
+
+      std::string counters = options.perf ? sample_counters(snapshot->tid) : "";
+      if (write(*snapshot, counters) >= 0) {
+        written++;
+      }
+    }
+  }
+
+  int write(const Snapshot& s, const std::string& counters) {
+    char name[64];
+    time_t t = time(NULL);
+    struct tm tm;
+    localtime_r(&t, &tm);
+    strftime(name, sizeof(name), "diag-%Y%m%d-%H%M%S", &tm);
+
+    std::ofstream os(options.dir + "/" + name + "-" + std::to_string(sequence++) + ".txt");
+    if (!os) {
+      return -1;
+    }
+
+    os << "breach: " << s.reason << "\n\n";
+
+    os << "stage histograms, microseconds:\n";
+    os << "  grab:   ";
+    s.histograms.grab.write(os);
+    os << "  convert:";
+    s.histograms.convert.write(os);
+    os << "  encode: ";
+    s.histograms.encode.write(os);
+    os << "  total:  ";
+    s.histograms.total.write(os);
+
+    os << "\nqueues:\n";
+    for (auto& state : s.states) {
+      os << "  " << state.first << ": " << state.second << "\n";
+    }
+
+    if (!counters.empty()) {
+      os << "\nrecorder thread counters over one second after the breach:\n" << counters;
+    }
+
+    os << "\nframes:\n"
+       << "      time  grab ms  conv ms   enc ms total ms  drop  dirty  queue   bytes  flags\n";
+    os << std::fixed;
+    for (auto& f : s.frames) {
+      os << std::setprecision(3) << std::setw(10) << f.time
+         << std::setprecision(2)
+         << std::setw(9) << f.grab_ms
+         << std::setw(9) << f.convert_ms
+         << std::setw(9) << f.encode_ms
+         << std::setw(9) << f.total_ms
+         << std::setw(6) << f.dropped
+         << std::setw(7) << f.dirty
+         << std::setw(7) << f.in_flight
+         << std::setw(8) << f.bytes
+         << "  " << (f.skipped ? "S" : "") << (f.keyframe ? "K" : "") << "\n";
+    }
+    return os.good() ? 0 : -1;
+  }
+
+  /** Count cycles, instructions, cache misses and context switches on the
+   *  recorder thread for a second.
+   *
+   * The hardware counters count user space only. Context switches happen in
+   * the kernel, so they are read from the thread's status in /proc instead.
+   */
+  static std::string sample_counters(pid_t tid) {
+    struct Counter {
+      uint32_t type;
+      uint64_t config;
+      const char* name;
+    } counters[] = {
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache-misses"},
+    };
+
+    std::vector<int> fds;
+    for (auto& c : counters) {
+      struct perf_event_attr attr = {};
+      attr.size = sizeof(attr);
+      attr.type = c.type;
+      attr.config = c.config;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      fds.push_back(syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0));
+    }
+    int64_t voluntary, involuntary;
+    bool switches = context_switches(tid, voluntary, involuntary) == 0;
+
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+
+    std::string out;
+    for (size_t i = 0; i < fds.size(); i++) {
+      uint64_t value = 0;
+      out += std::string("  ") + counters[i].name + ": ";
+      if (fds[i] >= 0 && read(fds[i], &value, sizeof(value)) == sizeof(value)) {
+        out += std::to_string(value) + "\n";
+      } else {
+        out += "unavailable\n";
+      }
+      if (fds[i] >= 0) {
+        close(fds[i]);
+      }
+    }
+
+    int64_t voluntary_end, involuntary_end;
+    if (switches && context_switches(tid, voluntary_end, involuntary_end) == 0) {
+      out += "  context-switches: " + std::to_string(voluntary_end - voluntary) + " voluntary, " +
+             std::to_string(involuntary_end - involuntary) + " involuntary\n";
+    } else {
+      out += "  context-switches: unavailable\n";
+    }
+    return out;
+  }
+
+  /** Read a thread's voluntary and involuntary context switches so far.
+   *
+   * @return Zero on success, a negative value if the thread is gone.
+   */
+  static int context_switches(pid_t tid, int64_t& voluntary, int64_t& involuntary) {
+    std::ifstream is("/proc/self/task/" + std::to_string(tid) + "/status");
+    std::string line;
+    int found = 0;
+    while (std::getline(is, line)) {
+      if (line.compare(0, 24, "voluntary_ctxt_switches:") == 0) {
+        voluntary = atoll(line.c_str() + 24);
+        found++;
+      } else if (line.compare(0, 27, "nonvoluntary_ctxt_switches:") == 0) {
+        involuntary = atoll(line.c_str() + 27);
+        found++;
+      }
+    }
+    return found == 2 ? 0 : -1;
+  }
+
+  SloOptions options;
+
+  std::thread worker;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::unique_ptr<Snapshot> pending;
+  bool quit = false;
+  bool written_any = false;
+  std::chrono::steady_clock::time_point last;
+
+  int sequence = 0;
+  std::atomic<int> written{0};
+  std::atomic<int> suppressed{0};
+};
@@ -24,19 +24,34 @@
  * SOFTWARE.
  */
 
+#pragma once
+
 #include <iostream>
 #include <string>
 #include <chrono>
 #include <memory>
+#include <functional>
+#include <vector>
+#include <atomic>
+#include <iomanip>
+#include <cstring>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #ifdef __cplusplus
 extern "C"
 {
 #include <libavcodec/avcodec.h>
+#include <libavcodec/bsf.h>
 #include <libavformat/avformat.h>
 #include <libswscale/swscale.h>
 #include <libavdevice/avdevice.h>
 #include <libavutil/frame.h>
+#include <libavutil/imgutils.h>
 }
 #endif
 
@@ -44,11 +59,148 @@ using FormatContextPtr = std::unique_ptr<AVFormatContext, void (*)(AVFormatConte
 using CodecContextPtr = std::unique_ptr<AVCodecContext, void (*)(AVCodecContext*)>;
 using FramePtr = std::unique_ptr<AVFrame, void (*)(AVFrame*)>;
 using PacketPtr = std::unique_ptr<AVPacket, void(*)(AVPacket*)>;
+using BitstreamFilterPtr = std::unique_ptr<AVBSFContext, void (*)(AVBSFContext*)>;
+
+/** Counters of the bytes each pipeline stage copies or writes.
+ *
+ * Every wrapper that produces pixels or bitstream adds what it wrote to its
+ * stage, so a run can be summarized as bytes moved per output pixel. Stages
+ * that alias their input (a wrapped packet, a rawvideo decode that references
+ * the packet) count the call but not the bytes, which is how zero-copy paths
+ * show up in the report.
+ *
+ * Counters are process-wide and relaxed; they cost one atomic add per call.
+ * Work that isn't part of a recording, such as calibration, can divert its
+ * thread's counts with a Diversion.
+ */
+class CopyAudit {
+public:
+  enum Stage {
+    fetch,    ///< written by the X server or the demuxer into a packet or shm
+    capture,  ///< copied from shm into the persistent capture frame
+    cow,      ///< copy-on-write of a frame still referenced elsewhere
+    detect,   ///< copied into the change detector's reference picture
+    decode,   ///< written by the decoder into a new frame
+    scale,    ///< written by the scaler / color conversion
+    encode,   ///< bitstream produced by the encoder
+    mux,      ///< bitstream written by the muxer
+    nb_stages
+  };
+
+  /** Record one call of a stage and the bytes it copied or wrote.
+   *
+   * @param stage the pipeline stage
+   * @param bytes the bytes copied or written, zero for an aliasing call
+   */
+  static void add(Stage stage, int64_t bytes) {
+    if (diverted) {
+      *diverted += bytes;
+      return;
+    }
+    calls[stage].fetch_add(1, std::memory_order_relaxed);
+    bytes_copied[stage].fetch_add(bytes, std::memory_order_relaxed);
+  }
+
+  /** Record pixels handed to the encoder, the denominator of the report.
+   */
+  static void add_pixels(int64_t n) {
+    if (diverted) {
+      return;
+    }
+    pixels.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  /** While it lives, the calling thread's counts go to the diversion's own
+   *  total of bytes instead of the process's counters.
+   */
+  class Diversion {
+  public:
+    Diversion() : previous(diverted) {
+      diverted = &bytes;
+    }
+
+    ~Diversion() {
+      diverted = previous;
+    }
+
+    Diversion(const Diversion&) = delete;
+    Diversion& operator=(const Diversion&) = delete;
+
+    int64_t get_bytes() const {
+      return bytes;
+    }
+
+  private:
+    int64_t bytes = 0;
+    int64_t* previous;
+  };
+
+  static int64_t get_bytes(Stage stage) {
+    return bytes_copied[stage].load(std::memory_order_relaxed);
+  }
+
+  /** The bytes copied by all stages per output pixel.
+   */
+  static double bytes_per_pixel() {
+    int64_t total = 0;
+    for (int i = 0; i < nb_stages; i++) {
+      total += get_bytes((Stage)i);
+    }
+    int64_t n = pixels.load(std::memory_order_relaxed);
+    return n ? (double)total / n : 0;
+  }
+
+  static void reset() {
+    for (int i = 0; i < nb_stages; i++) {
+      calls[i] = 0;
+      bytes_copied[i] = 0;
+    }
+    pixels = 0;
+  }
+
+  /** Print a per-stage table of calls, bytes and bytes per output pixel.
+   */
+  static void report(std::ostream& os) {
+    static const char* names[nb_stages] = {
+      "fetch", "capture", "cow", "detect", "decode", "scale", "encode", "mux"
+    };
+    int64_t n = pixels.load(std::memory_order_relaxed);
+
+    os << "stage          calls           bytes  bytes/pixel" << std::endl;
+    for (int i = 0; i < nb_stages; i++) {
+      int64_t b = get_bytes((Stage)i);
+      os << std::left << std::setw(8) << names[i] << std::right
+         << std::setw(11) << calls[i].load(std::memory_order_relaxed)
+         << std::setw(16) << b
+         << std::setw(13) << std::fixed << std::setprecision(3)
+         << (n ? (double)b / n : 0) << std::endl;
+    }
+    os << "total" << std::setw(43) << bytes_per_pixel() << std::endl;
+  }
+
+  /** The bytes of picture data a frame holds.
+   */
+  static int64_t frame_bytes(const AVFrame* frame) {
+    int size = av_image_get_buffer_size((AVPixelFormat)frame->format,
+                                        frame->width, frame->height, 1);
+    return size < 0 ? 0 : size;
+  }
+
+private:
+  static inline std::atomic<int64_t> calls[nb_stages];
+  static inline std::atomic<int64_t> bytes_copied[nb_stages];
+  static inline std::atomic<int64_t> pixels;
+  static inline thread_local int64_t* diverted = nullptr;
+};
 
 /** A smart pointer wrapper for AVPacket
  *
  * Primarily used for packet allocation. Smart pointers will handle destruction
  * and garbage collection.
+ *
+ * Packets are uniquely owned, but `ref` hands out another Packet sharing the
+ * same refcounted payload, so one packet can feed several consumers for the
+ * price of a refcount increment each.
  */
 class Packet : public PacketPtr {
 public:
@@ -64,12 +216,52 @@ public:
       av_packet_free(&packet);
     });
   }
+
+  /** Creates a new reference to this packet's payload.
+   *
+   * The payload is shared, not copied; the properties are copied.
+   *
+   * @return A Packet referencing the same data on success, a null Packet on
+   *         error.
+   */
+  Packet ref() const {
+    auto packet = alloc();
+    if (!packet || av_packet_ref(packet.get(), get()) < 0) {
+      return Packet(NULL, [](AVPacket*) {});
+    }
+    return packet;
+  }
+
+  /** Hands a reference to this packet to each consumer in turn.
+   *
+   * @param consumers the callbacks to run, each passed its own reference
+   *
+   * @return Zero on success, the first negative value a consumer returns on
+   *         error.
+   */
+  int fan_out(const std::vector<std::function<int(Packet)>>& consumers) const {
+    for (auto& fn : consumers) {
+      auto packet = ref();
+      if (!packet) {
+        return -1;
+      }
+      if (int res = fn(std::move(packet)); res < 0) {
+        return res;
+      }
+    }
+    return 0;
+  }
 };
 
 /** A smart pointer wrapper for AVFrame
  *
  * Primarily used for frame allocation. Smart pointers will handle destruction
  * and garbage collection.
+ *
+ * Like Packet, `ref` shares the picture buffers between Frames. Stages that
+ * modify pixels in place (masking, overlays, the capture sources) must call
+ * `make_writable` first, which copies only if someone else still holds a
+ * reference.
  */
 class Frame : public FramePtr {
 public:
@@ -85,6 +277,65 @@ public:
     });
   }
 
+  /** Creates a new reference to this frame's picture.
+   *
+   * The buffers are shared, not copied; the properties are copied.
+   *
+   * @return A Frame referencing the same picture on success, a null frame on
+   *         error.
+   */
+  Frame ref() const {
+    auto frame = alloc();
+    if (!frame || av_frame_ref(frame.get(), get()) < 0) {
+      return Frame(NULL, [](AVFrame*) {});
+    }
+    return frame;
+  }
+
+  /** Ensures the picture is not shared before it is modified in place.
+   *
+   * If any other reference to the buffers exists, the picture is copied into
+   * new buffers owned by this frame alone (copy-on-write); otherwise this is a
+   * no-op.
+   *
+   * @return Zero on success, a negative AVERROR on error.
+   */
+  int make_writable() {
+    if (av_frame_is_writable(get())) {
+      return 0;
+    }
+
+    if (int res = av_frame_make_writable(get()); res < 0) {
+      return res;
+    }
+    CopyAudit::add(CopyAudit::cow, CopyAudit::frame_bytes(get()));
+    return 0;
+  }
+
+  /** Hands a reference to this frame to each consumer in turn.
+   *
+   * Fanning out to N consumers costs N buffer references, never a picture
+   * copy. Consumers that want to modify the picture call `make_writable` on
+   * their reference.
+   *
+   * @param consumers the callbacks to run, each passed its own reference
+   *
+   * @return Zero on success, the first negative value a consumer returns on
+   *         error.
+   */
+  int fan_out(const std::vector<std::function<int(Frame)>>& consumers) const {
+    for (auto& fn : consumers) {
+      auto frame = ref();
+      if (!frame) {
+        return -1;
+      }
+      if (int res = fn(std::move(frame)); res < 0) {
+        return res;
+      }
+    }
+    return 0;
+  }
+
   /** Allocates an empty frames given dimensions and format.
    *
    * Allocates an empty frame with buffer to populate the ~data~ and ~buf~
@@ -109,6 +360,44 @@ public:
     return frame;
   }
 
+  /** Wraps a raw video packet's picture in a frame without copying.
+   *
+   * The frame takes its own reference to the packet's buffer, so the packet
+   * may be unreferenced or reused once the frame is created. This lets raw
+   * sources such as x11grab skip the rawvideo decoder entirely.
+   *
+   * @param packet  a refcounted packet holding one tightly packed picture
+   * @param w       picture width
+   * @param h       picture height
+   * @param pix_fmt picture format
+   *
+   * @return A Frame sharing the packet's data on success, a null frame on
+   *         error.
+   */
+  static Frame wrap_packet(Packet& packet, int w, int h, enum AVPixelFormat pix_fmt) {
+    if (!packet->buf || packet->size < av_image_get_buffer_size(pix_fmt, w, h, 1)) {
+      return Frame(NULL, [](AVFrame*) {});
+    }
+
+    auto frame = alloc();
+    frame->width = w;
+    frame->height = h;
+    frame->format = pix_fmt;
+
+    frame->buf[0] = av_buffer_ref(packet->buf);
+    if (!frame->buf[0]) {
+      return Frame(NULL, [](AVFrame*) {});
+    }
+
+    if (av_image_fill_arrays(frame->data, frame->linesize, packet->data,
+                             pix_fmt, w, h, 1) < 0) {
+      return Frame(NULL, [](AVFrame*) {});
+    }
+
+    CopyAudit::add(CopyAudit::decode, 0);
+    return frame;
+  }
+
   /** Allocates and scales a new frame, preserving data and extended data.
    *
    * Allocates and scales a new frame target dimensions and picture format,
@@ -147,6 +436,7 @@ public:
     }
 
     sws_freeContext(sws_ctx);
+    CopyAudit::add(CopyAudit::scale, CopyAudit::frame_bytes(sframe));
     return frame;
   }
 };
@@ -202,23 +492,29 @@ public:
    * Always call this function before using encoding routines like
    * `avcodec_receive_packet`.
    *
+   * @param options codec and private options to apply; those used are
+   *                removed from the dictionary
+   *
    * @return Zero on success, a negative value on error.
    */
-  int open() {
-    return avcodec_open2(get(), NULL, NULL);
+  int open(AVDictionary** options = NULL) {
+    return avcodec_open2(get(), NULL, options);
   }
 
   /** Pass a raw frame through the encoder, and run the given callback.
    *
-   * @param frame the raw video or audio frame
-   * @param fn    the callback function to run after successfully receiving a
-   *              packet from the encoder
+   * @param frame    the raw video or audio frame
+   * @param fn       the callback function to run after successfully receiving
+   *                 a packet from the encoder
+   * @param keyframe force the frame to be coded as a keyframe; with the
+   *                 encoder's forced-idr option set, an IDR frame
    *
    * @return Zero on success, negative AVERROR on error.
    */
-  int send_frame(Frame& frame, std::function<int(Packet)> fn) {
+  int send_frame(Frame& frame, std::function<int(Packet)> fn, bool keyframe = false) {
     if (frame) {
-      frame->pict_type = AV_PICTURE_TYPE_NONE;
+      frame->pict_type = keyframe ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+      CopyAudit::add_pixels((int64_t)frame->width * frame->height);
     }
 
     int res = avcodec_send_frame(get(), frame.get());
@@ -232,6 +528,7 @@ public:
         return -1;
       }
 
+      CopyAudit::add(CopyAudit::encode, packet->size);
       res = fn(std::move(packet));
       if (res < 0) {
         return res;
@@ -313,6 +610,10 @@ public:
         return res;
       }
 
+      // rawvideo hands back frames that reference the packet; those are free.
+      bool aliased = packet && packet->buf && frame->buf[0] &&
+                     frame->buf[0]->buffer == packet->buf->buffer;
+      CopyAudit::add(CopyAudit::decode, aliased ? 0 : CopyAudit::frame_bytes(frame.get()));
       res = fn(std::move(frame));
       if (res < 0) {
         return res;
@@ -323,6 +624,187 @@ public:
   }
 };
 
+/** A smart pointer wrapper for AVBSFContext with methods for easy filtering.
+ *
+ * Bitstream filters rewrite encoded packets without decoding them, such as
+ * converting H.264 from MP4's length-prefixed form to the start codes MPEG-TS
+ * carries.
+ */
+class BitstreamFilter : public BitstreamFilterPtr {
+public:
+  using BitstreamFilterPtr::BitstreamFilterPtr;
+
+  /** Allocates and initializes a bitstream filter for a stream.
+   *
+   * @param name      the filter's name
+   * @param codecpar  the parameters of the stream to filter
+   * @param time_base the time base of the stream's packets
+   *
+   * @return An initialized BitstreamFilter on success, a null filter on error.
+   */
+  static BitstreamFilter open(const std::string& name, const AVCodecParameters* codecpar,
+                              AVRational time_base) {
+    const AVBitStreamFilter* filter = av_bsf_get_by_name(name.c_str());
+    AVBSFContext* bsf = NULL;
+    if (!filter || av_bsf_alloc(filter, &bsf) < 0) {
+      return BitstreamFilter(NULL, [](AVBSFContext*) {});
+    }
+
+    auto ctx = BitstreamFilter(bsf, [](AVBSFContext* bsf) {
+      av_bsf_free(&bsf);
+    });
+
+    if (avcodec_parameters_copy(ctx->par_in, codecpar) < 0) {
+      return BitstreamFilter(NULL, [](AVBSFContext*) {});
+    }
+    ctx->time_base_in = time_base;
+
+    if (av_bsf_init(ctx.get()) < 0) {
+      return BitstreamFilter(NULL, [](AVBSFContext*) {});
+    }
+    return ctx;
+  }
+
+  /** Pass a packet through the filter, and run the given callback on each
+   *  packet that comes out.
+   *
+   * @param packet the input packet, or a null packet to drain the filter.
+   *               The filter takes the packet's data, leaving it blank.
+   * @param fn     the callback function to run on each filtered packet
+   *
+   * @return Zero on success, negative AVERROR on error.
+   */
+  int send_packet(Packet& packet, std::function<int(Packet)> fn) {
+    int res = av_bsf_send_packet(get(), packet.get());
+
+    while (res >= 0) {
+      auto filtered = Packet::alloc();
+      res = av_bsf_receive_packet(get(), filtered.get());
+      if (res == AVERROR(EAGAIN) || res == AVERROR_EOF) {
+        break;
+      } else if (res < 0) {
+        return res;
+      }
+
+      res = fn(std::move(filtered));
+      if (res < 0) {
+        return res;
+      }
+    }
+
+    return 0;
+  }
+};
+
+/** How a reader will move through a file, for the kernel's read-ahead.
+ */
+enum class Access {
+  sequential,  ///< one pass from start to end, such as a scan or a transcode
+  random,      ///< seeks here and there, such as extracting frames
+};
+
+/** A read-only memory mapping of a local file, read by libavformat through a
+ *  custom AVIOContext.
+ *
+ * Reads are copies out of the mapping rather than read(2) calls into
+ * libavformat's small buffer, and the kernel is told the access pattern:
+ * sequential readers get aggressive read-ahead and drop the pages they have
+ * passed, so a multi-gigabyte scan doesn't evict the page cache; random
+ * readers get no read-ahead, so a seek faults in only what it touches.
+ */
+struct MappedInput {
+  static constexpr int buffer_size = 256 * 1024;
+  static constexpr size_t drop_interval = 64 << 20;
+
+  int fd = -1;
+  uint8_t* data = NULL;
+  size_t size = 0;
+  size_t pos = 0;
+  size_t dropped = 0;
+  Access access = Access::sequential;
+
+  ~MappedInput() {
+    if (data) {
+      munmap(data, size);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  /** Map the file and advise the kernel.
+   *
+   * @return Zero on success, a negative value on error.
+   */
+  int open(const std::string& path, Access how) {
+    access = how;
+    fd = ::open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+      return -1;
+    }
+
+    size = st.st_size;
+    void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      return -1;
+    }
+    data = (uint8_t*)map;
+
+    int advice = access == Access::sequential ? MADV_SEQUENTIAL : MADV_RANDOM;
+    madvise(data, size, advice);
+    posix_fadvise(fd, 0, 0, access == Access::sequential ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_RANDOM);
+    return 0;
+  }
+
+  static int read(void* opaque, uint8_t* buf, int buf_size) {
+    auto m = (MappedInput*)opaque;
+    if (m->pos >= m->size) {
+      return AVERROR_EOF;
+    }
+
+    size_t n = std::min((size_t)buf_size, m->size - m->pos);
+    memcpy(buf, m->data + m->pos, n);
+    m->pos += n;
+
+    // The cache can't drop pages we still map, so unmap the passed range's
+    // pages from our own address space first.
+    if (m->access == Access::sequential && m->pos - m->dropped >= drop_interval) {
+      size_t end = m->pos & ~(drop_interval - 1);
+      madvise(m->data + m->dropped, end - m->dropped, MADV_DONTNEED);
+      posix_fadvise(m->fd, m->dropped, end - m->dropped, POSIX_FADV_DONTNEED);
+      m->dropped = end;
+    }
+    return n;
+  }
+
+  static int64_t seek(void* opaque, int64_t offset, int whence) {
+    auto m = (MappedInput*)opaque;
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+      return m->size;
+    case SEEK_SET:
+      break;
+    case SEEK_CUR:
+      offset += m->pos;
+      break;
+    case SEEK_END:
+      offset += m->size;
+      break;
+    default:
+      return -1;
+    }
+
+    if (offset < 0 || (size_t)offset > m->size) {
+      return -1;
+    }
+    m->pos = offset;
+    // Keep the start of the next drop on a page boundary for madvise.
+    m->dropped = std::min(m->dropped, m->pos) & ~(drop_interval - 1);
+    return offset;
+  }
+};
+
 /** A smart pointer wrapper for AVInputFormat
  *
  * FormatContext is used for both input and output
@@ -331,6 +813,60 @@ class FormatContext : public FormatContextPtr {
 public:
   using FormatContextPtr::FormatContextPtr;
 
+  /** Allocate and open an input FormatContext that reads a local file through
+   *  a memory mapping.
+   *
+   * The file must not change while it is open. Stream information is read as
+   * in `open_input_format`.
+   *
+   * @param path   the file to open
+   * @param access how the caller will read it
+   *
+   * @return An allocated FormatContext on success, an empty context on error.
+   */
+  static FormatContext open_input_file(const std::string& path, Access access = Access::sequential) {
+    auto mapped = new MappedInput();
+    if (mapped->open(path, access) < 0) {
+      delete mapped;
+      return FormatContext(NULL, [](AVFormatContext*) {});
+    }
+
+    uint8_t* buffer = (uint8_t*)av_malloc(MappedInput::buffer_size);
+    AVIOContext* pb = buffer
+      ? avio_alloc_context(buffer, MappedInput::buffer_size, 0, mapped, &MappedInput::read, NULL, &MappedInput::seek)
+      : NULL;
+    if (!pb) {
+      av_free(buffer);
+      delete mapped;
+      return FormatContext(NULL, [](AVFormatContext*) {});
+    }
+
+    AVFormatContext* avfc = avformat_alloc_context();
+    if (!avfc) {
+      close_mapped(pb);
+      return FormatContext(NULL, [](AVFormatContext*) {});
+    }
+    avfc->pb = pb;
+    avfc->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    // avformat_open_input frees the context on failure, but never custom IO.
+    if (avformat_open_input(&avfc, path.c_str(), NULL, NULL) < 0) {
+      close_mapped(pb);
+      return FormatContext(NULL, [](AVFormatContext*) {});
+    }
+
+    auto ctx = FormatContext(avfc, [](AVFormatContext* avfc) {
+      AVIOContext* pb = avfc->pb;
+      avformat_close_input(&avfc);
+      close_mapped(pb);
+    });
+
+    if (avformat_find_stream_info(ctx.get(), NULL) < 0) {
+      return FormatContext(NULL, [](AVFormatContext*) {});
+    }
+    return ctx;
+  }
+
   /** Allocate and open a new input FormatContext
    *
    * Allocate and open a new input FormatContext, and read header packets to get
@@ -338,16 +874,22 @@ public:
    * packets may be buffered for later processing.
    *
    * @param input_format A pointer to the populated AVInputFormat
+   * @param url          The input to open (for x11grab, the display), NULL for
+   *                     the format's default
+   * @param options      Private options for the input format, such as
+   *                     video_size or framerate. Consumed entries are removed.
    *
    * @return An allocated FormatContext on success, an empty context on error.
    */
-  static FormatContext open_input_format(const AVInputFormat *input_format) {
+  static FormatContext open_input_format(const AVInputFormat *input_format,
+                                         const char* url = NULL,
+                                         AVDictionary** options = NULL) {
     AVFormatContext* avfc = avformat_alloc_context();
     if (!avfc) {
       return FormatContext(nullptr, [](AVFormatContext*) {});
     }
 
-    if (avformat_open_input(&avfc, NULL, input_format, NULL) < 0) {
+    if (avformat_open_input(&avfc, url, input_format, options) < 0) {
       return FormatContext(NULL, [](AVFormatContext*) {});
     }
 
@@ -361,18 +903,28 @@ public:
     return ctx;
   }
 
+  /** Free a custom AVIOContext over a MappedInput, and the mapping.
+   */
+  static void close_mapped(AVIOContext* pb) {
+    delete (MappedInput*)pb->opaque;
+    av_freep(&pb->buffer);
+    avio_context_free(&pb);
+  }
+
   /** Allocate and open a new output FormatContext
    *
    * Allocate and open a new output FormatContext. The format context's target
    * resource can only be written to.
    *
-   * @param url location of the target output resource
+   * @param url    location of the target output resource
+   * @param format the output format's short name, NULL to guess it from the
+   *               url
    *
    * @return An allocated FormatContext on success, an empty context on error.
    */
-  static FormatContext open_output(const std::string url) {
+  static FormatContext open_output(const std::string url, const char* format = NULL) {
     AVFormatContext* avfc = NULL;
-    if (avformat_alloc_output_context2(&avfc, NULL, NULL, url.c_str()) < 0) {
+    if (avformat_alloc_output_context2(&avfc, NULL, format, url.c_str()) < 0) {
       return FormatContext(nullptr, [](AVFormatContext*) {});
     }
 
@@ -387,6 +939,55 @@ public:
     return ctx;
   }
 
+  /** Allocate a new output FormatContext that writes through a callback.
+   *
+   * The output can't seek, so the format must be one that streams, such as
+   * mpegts. Writes are at most `packet_size` bytes, so a callback that sends
+   * datagrams gets its output already cut to size.
+   *
+   * @param format      the output format's short name
+   * @param opaque      passed to the callback
+   * @param write       called with each run of output bytes
+   * @param packet_size the most bytes passed to one call
+   *
+   * @return An allocated FormatContext on success, an empty context on error.
+   */
+  static FormatContext open_output_io(const char* format, void* opaque,
+                                      int (*write)(void*, const uint8_t*, int),
+                                      int packet_size) {
+    AVFormatContext* avfc = NULL;
+    if (avformat_alloc_output_context2(&avfc, NULL, format, NULL) < 0) {
+      return FormatContext(nullptr, [](AVFormatContext*) {});
+    }
+
+    // libavformat only took a const buffer from version 61 on.
+#if LIBAVFORMAT_VERSION_MAJOR < 61
+    auto write_packet = (int (*)(void*, uint8_t*, int))write;
+#else
+    auto write_packet = write;
+#endif
+    uint8_t* buffer = (uint8_t*)av_malloc(packet_size);
+    AVIOContext* pb = buffer
+      ? avio_alloc_context(buffer, packet_size, 1, opaque, NULL, write_packet, NULL)
+      : NULL;
+    if (!pb) {
+      av_free(buffer);
+      avformat_free_context(avfc);
+      return FormatContext(nullptr, [](AVFormatContext*) {});
+    }
+    pb->max_packet_size = packet_size;
+    avfc->pb = pb;
+    avfc->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    return FormatContext(avfc, [](AVFormatContext* avfc) {
+      AVIOContext* pb = avfc->pb;
+      avio_flush(pb);
+      avformat_free_context(avfc);
+      av_freep(&pb->buffer);
+      avio_context_free(&pb);
+    });
+  }
+
   /** Create a new stream and set the appropriate header flags
    *
    * Some formats may require you set flags before you open the codec, and copy
@@ -416,6 +1017,75 @@ public:
     return stream->index;
   }
 
+  /** Create a stream for packets copied from elsewhere, with the given
+   *  parameters.
+   *
+   * @param codecpar  the parameters of the packets' codec
+   * @param time_base the time base of the packets' timestamps
+   *
+   * @return The stream's index on success, a negative value on error.
+   */
+  int create_copy_stream(const AVCodecParameters* codecpar, AVRational time_base) {
+    auto stream = avformat_new_stream(get(), NULL);
+    if (!stream) {
+      return -1;
+    }
+
+    stream->time_base = time_base;
+    if (int res = avcodec_parameters_copy(stream->codecpar, codecpar); res < 0) {
+      return res;
+    }
+    stream->codecpar->codec_tag = 0;
+    return stream->index;
+  }
+
+  /** Create a stream of uncompressed pictures.
+   *
+   * Packets written to the stream hold one tightly packed picture each, as
+   * `Frame::wrap_packet` expects to read them back.
+   *
+   * @param w         picture width
+   * @param h         picture height
+   * @param pix_fmt   picture format
+   * @param time_base the time base of the packets' timestamps
+   *
+   * @return The stream's index on success, a negative value on error.
+   */
+  int create_raw_stream(int w, int h, enum AVPixelFormat pix_fmt, AVRational time_base) {
+    auto stream = avformat_new_stream(get(), NULL);
+    if (!stream) {
+      return -1;
+    }
+
+    stream->time_base            = time_base;
+    stream->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+    stream->codecpar->codec_id   = AV_CODEC_ID_RAWVIDEO;
+    stream->codecpar->codec_tag  = avcodec_pix_fmt_to_codec_tag(pix_fmt);
+    stream->codecpar->format     = pix_fmt;
+    stream->codecpar->width      = w;
+    stream->codecpar->height     = h;
+    return stream->index;
+  }
+
+  /** Write an encoded packet to its stream.
+   *
+   * Muxers may pick their own stream time base when the header is written (MP4
+   * raises low-denominator time bases, for one), so the packet's timestamps are
+   * rescaled from the encoder's time base first.
+   *
+   * @param packet    the encoded packet, with its stream_index set
+   * @param time_base the time base of the packet's timestamps
+   *
+   * @return Zero on success, a negative AVERROR on error.
+   */
+  int write_packet(Packet& packet, AVRational time_base) {
+    av_packet_rescale_ts(packet.get(), time_base,
+                         get()->streams[packet->stream_index]->time_base);
+
+    CopyAudit::add(CopyAudit::mux, packet->size);
+    return av_write_frame(get(), packet.get());
+  }
+
   /** Find the best stream in the format context.
    *
    * The best stream is determed according to various heuristics as the most
@@ -0,0 +1,362 @@
+// log.hpp -*- c++ -*-
+
+/*
+ * MIT License
+ *
+ * Copyright (c) 2022 Walker Griggs
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+extern "C" {
+#include <libavutil/log.h>
+}
+
+#include "metrics.hpp"
+
+/** Writes FFmpeg's log from a background thread, so that a slow or blocked
+ *  stderr never stalls the threads that log.
+ *
+ * FFmpeg's default callback writes each message to stderr from the thread
+ * that logged it: the recorder, a codec's worker threads, the muxer. Installed
+ * in its place, `callback` formats the line into a fixed-size record in a
+ * bounded, lock-free ring and returns; a single writer thread drains the ring
+ * to the descriptor. When the writer falls behind and the ring fills, new
+ * records are dropped and counted rather than waited for.
+ *
+ * Lines are also rate limited by kind, a kind being the format string of
+ * their first call to av_log, so one call site repeating itself every frame
+ * can't crowd out the rest. A line is kept or dropped whole, even when FFmpeg
+ * builds it from several calls, as av_dump_format does. Once a second the
+ * writer notes how many lines of each kind it didn't write.
+ *
+ * There is one log per process, as there is one av_log callback.
+ */
+class AsyncLog {
+public:
+  static constexpr size_t capacity = 1024;   ///< records in the ring
+  static constexpr int line_size = 512;      ///< bytes per record; longer lines are cut
+  static constexpr size_t kinds = 256;       ///< kinds of line limited separately
+
+  static AsyncLog& instance() {
+    static AsyncLog log;
+    return log;
+  }
+
+  AsyncLog(const AsyncLog&) = delete;
+  AsyncLog& operator=(const AsyncLog&) = delete;
+
+  ~AsyncLog() {
+    stop();
+  }
+
+  /** Start the writer and install the callback.
+   *
+   * @param rate lines of one kind written each second, or zero for no limit
+   * @param fd   where lines are written
+   */
+  void start(int rate = 20, int fd = STDERR_FILENO) {
+    if (thread.joinable()) {
+      return;
+    }
+    this->rate = rate;
+    this->fd = fd;
+    quit = false;
+    thread = std::thread(&AsyncLog::run, this);
+    av_log_set_callback(&AsyncLog::callback);
+  }
+
+  /** Restore FFmpeg's default callback, then write what is queued and stop
+   *  the writer.
+   */
+  void stop() {
+    if (!thread.joinable()) {
+      return;
+    }
+    av_log_set_callback(&av_log_default_callback);
+    quit = true;
+    thread.join();
+  }
+
+  /** The av_log callback.
+   */
+  static void callback(void* avcl, int level, const char* fmt, va_list vl) {
+    instance().log(avcl, level, fmt, vl);
+  }
+
+  int64_t get_written() const {
+    return written;
+  }
+
+  int64_t get_limited() const {
+    return limited;
+  }
+
+  int64_t get_overflowed() const {
+    return overflowed;
+  }
+
+  /** Registers the log's counters with a metrics registry.
+   */
+  void publish(Metrics& metrics) {
+    metrics.add([this](std::ostream& os) {
+      const char* name = "screencap_log_lines_total";
+      Metrics::header(os, name, "counter",
+                      "Log lines written, or dropped by the rate limit or a full queue");
+      Metrics::sample(os, name, get_written(), "result=\"written\"");
+      Metrics::sample(os, name, get_limited(), "result=\"rate_limited\"");
+      Metrics::sample(os, name, get_overflowed(), "result=\"overflow\"");
+    });
+  }
+
+private:
+  AsyncLog() {
+    for (size_t i = 0; i < capacity; i++) {
+      ring[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  /** One formatted record in the ring. Its sequence tells a producer when the
+   *  slot is free to fill and the writer when it is full.
+   */
+  struct Record {
+    std::atomic<size_t> sequence{0};
+    int length = 0;
+    char line[line_size];
+  };
+
+  /** A kind of line and its rate limit, a count within the current second.
+   */
+  struct Kind {
+    std::atomic<const char*> fmt{nullptr};
+    std::atomic<int64_t> second{0};
+    std::atomic<int> count{0};
+    std::atomic<int64_t> dropped{0};
+    int64_t reported = 0;                    ///< drops already noted, the writer's only
+  };
+
+  void log(void* avcl, int level, const char* fmt, va_list vl) {
+    if ((level & 0xff) > av_log_get_level()) {
+      return;
+    }
+
+    // Whether a line is kept is decided by its first call; the calls that
+    // finish it follow.
+    thread_local int print_prefix = 1;
+    thread_local bool dropping = false;
+    if (print_prefix) {
+      dropping = !admit(fmt);
+    }
+
+    char line[line_size];
+    int n = av_log_format_line2(avcl, level, fmt, vl, line, sizeof(line), &print_prefix);
+    if (dropping || n <= 0) {
+      return;
+    }
+    if (n >= (int)sizeof(line)) {
+      n = sizeof(line) - 1;
+      line[n - 1] = '\n';
+    }
+
+    if (!push(line, n) && line[n - 1] == '\n') {
+      overflowed++;
+    }
+  }
+
+  /** Count a line against its kind's limit.
+   *
+   * @return Whether the line may be written.
+   */
+  bool admit(const char* fmt) {
+    if (rate <= 0) {
+      return true;
+    }
+
+    Kind& kind = find(fmt);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    int64_t now = ts.tv_sec;
+    int64_t second = kind.second.load(std::memory_order_relaxed);
+    if (second != now && kind.second.compare_exchange_strong(second, now)) {
+      kind.count.store(0, std::memory_order_relaxed);
+    }
+    if (kind.count.fetch_add(1, std::memory_order_relaxed) < rate) {
+      return true;
+    }
+    kind.dropped.fetch_add(1, std::memory_order_relaxed);
+    limited++;
+    return false;
+  }
+
+  /** The kind for a format string, claiming a free slot for one not seen
+   *  before. Kinds past the table's capacity share one limit.
+   */
+  Kind& find(const char* fmt) {
+    size_t hash = ((uintptr_t)fmt >> 3) * 0x9e3779b97f4a7c15ull;
+    for (size_t i = 0; i < 16; i++) {
+      Kind& kind = table[((hash >> 56) + i) % kinds];
+      const char* seen = kind.fmt.load(std::memory_order_acquire);
+      if (seen == fmt) {
+        return kind;
+      }
+      if (!seen && (kind.fmt.compare_exchange_strong(seen, fmt) || seen == fmt)) {
+        return kind;
+      }
+    }
+    return other;
+  }
+
+  /** Claim a slot and copy the line into it.
+   *
+   * @return Whether there was room.
+   */
+  bool push(const char* line, int length) {
+    size_t pos = head.load(std::memory_order_relaxed);
+    Record* record;
+    while (true) {
+      record = &ring[pos % capacity];
+      size_t sequence = record->sequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+      if (diff == 0) {
+        if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = head.load(std::memory_order_relaxed);
+      }
+    }
+
+    memcpy(record->line, line, length);
+    record->length = length;
+    record->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  /** The writer: drain the ring in batches, and note suppressed lines once a
+   *  second. It mostly sleeps, in the poll or blocked writing, so it keeps
+   *  normal priority rather than waiting behind the encoder for its turn.
+   */
+  void run() {
+    std::string batch;
+    auto last_report = std::chrono::steady_clock::now();
+
+    while (true) {
+      bool stopping = quit;
+      batch.clear();
+      int64_t lines = 0;
+      while (batch.size() < 64 * 1024) {
+        Record& record = ring[tail % capacity];
+        if (record.sequence.load(std::memory_order_acquire) != tail + 1) {
+          break;
+        }
+        batch.append(record.line, record.length);
+        lines += record.line[record.length - 1] == '\n';
+        record.sequence.store(tail + capacity, std::memory_order_release);
+        tail++;
+      }
+
+      auto now = std::chrono::steady_clock::now();
+      if (now - last_report >= std::chrono::seconds(1) || stopping) {
+        last_report = now;
+        report(batch, other);
+        for (auto& kind : table) {
+          report(batch, kind);
+        }
+      }
+
+      if (!batch.empty()) {
+        write_all(batch);
+        written += lines;
+      } else if (stopping) {
+        return;
+      } else {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+    }
+  }
+
+  /** Append a note of a kind's lines dropped since the last.
+   */
+  void report(std::string& batch, Kind& kind) {
+    int64_t dropped = kind.dropped.load(std::memory_order_relaxed);
+    if (dropped == kind.reported) {
+      return;
+    }
+
+    std::string fmt = &kind == &other ? "(various)" : kind.fmt.load();
+    fmt = fmt.substr(0, 60);
+    for (char& c : fmt) {
+      if (c == '\n' || c == '\r') {
+        c = ' ';
+      }
+    }
+
+    char line[128];
+    snprintf(line, sizeof(line), "screencap: suppressed %lld log lines like \"%s\"\n",
+             (long long)(dropped - kind.reported), fmt.c_str());
+    batch += line;
+    kind.reported = dropped;
+  }
+
+  void write_all(const std::string& s) {
+    for (size_t sent = 0; sent < s.size();) {
+      ssize_t n = ::write(fd, s.data() + sent, s.size() - sent);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return;
+      }
+      sent += n;
+    }
+  }
+
+  Record ring[capacity];
+  alignas(64) std::atomic<size_t> head{0};
+  alignas(64) size_t tail = 0;               ///< the writer's only
+
+  Kind table[kinds];
+  Kind other;
+  int rate = 20;
+  int fd = STDERR_FILENO;
+
+  std::atomic<int64_t> written{0};
+  std::atomic<int64_t> limited{0};
+  std::atomic<int64_t> overflowed{0};
+
+  std::thread thread;
+  std::atomic<bool> quit{false};
+};
@@ -27,18 +27,32 @@
 /**
  * @file main.cpp
  *
- * @brief Transcodes frames from X11 server to X264, written to an MP4
- *        container.
+ * @brief Transcodes frames from an X11 or VNC server to X264, written to an
+ *        MP4 container.
  *
  * @author Walker Griggs (walker@walkergriggs.com)
  */
 
 #include <iostream>
 #include <chrono>
-#include <functional>
+#include <thread>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
 #include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
 
 #include "libav.hpp"
+#include "recorder.hpp"
+#include "recompress.hpp"
+#include "sampler.hpp"
+#include "session.hpp"
+#include "metrics.hpp"
+#include "log.hpp"
+#include "upload.hpp"
 
 volatile sig_atomic_t stop;
 
@@ -52,134 +66,707 @@ void signal_handler(int n)
   stop = 1;
 }
 
-/** Run screencap
- *
- * Main's scope includes codec setup, callback definitions, and the main read
- * loop.
+/** Long-only option identifiers, numbered past any short option.
+ */
+enum {
+  OPT_TILE = 256,
+  OPT_THRESHOLD_PIXELS,
+  OPT_THRESHOLD_SAD,
+  OPT_IGNORE,
+  OPT_IGNORE_REFRESH,
+  OPT_SEGMENT,
+  OPT_RECOMPRESS,
+  OPT_RECOMPRESS_CPU,
+  OPT_INCREMENTAL,
+  OPT_SCROLL,
+  OPT_SAMPLE,
+  OPT_SAMPLE_INTERVAL,
+  OPT_SAMPLE_LENGTH,
+  OPT_SAMPLE_DOWNSCALE,
+  OPT_SAMPLE_MASK,
+  OPT_KEYFRAME_RATIO,
+  OPT_MAX_GOP,
+  OPT_ADMISSION,
+  OPT_METRICS,
+  OPT_UPLOAD,
+  OPT_UPLOAD_FRAGMENTS,
+  OPT_UPLOAD_KEEP,
+  OPT_UPLOAD_PARALLEL,
+  OPT_UPLOAD_PART_SIZE,
+  OPT_SLO_LATENCY,
+  OPT_SLO_DROP_RATE,
+  OPT_SLO_WINDOW,
+  OPT_SLO_DIR,
+  OPT_SLO_INTERVAL,
+  OPT_SLO_PERF,
+  OPT_PACE_RATE,
+  OPT_PACE_BURST,
+  OPT_PACE_QUEUE,
+  OPT_ADAPT,
+  OPT_ADAPT_DOWN,
+  OPT_ADAPT_UP,
+  OPT_ADAPT_STEPS,
+  OPT_GRAY,
+  OPT_SHADOW,
+  OPT_SHADOW_CRF,
+  OPT_SHADOW_PARAMS,
+  OPT_SHADOW_EVERY,
+  OPT_ACTIVITY,
+  OPT_TAG,
+  OPT_USAGE_LOG,
+  OPT_LOG_RATE,
+};
+
+/** Print usage to stderr.
  *
- * @param argc number of arguments
- * @param argv the arguments themselves
+ * @param name the program name
  */
-int main(int argc, char **argv) {
-  signal(SIGINT, &signal_handler);
-  avdevice_register_all();
+void usage(const char* name)
+{
+  std::cerr << "usage: " << name << " [options]" << std::endl
+            << "  -n, --native              capture natively (XDamage + MIT-SHM) instead of x11grab" << std::endl
+            << "  -d, --display display     the X display to capture, default $DISPLAY" << std::endl
+            << "  -v, --vnc host[:display]  capture a VNC server (host::port for a port), password in $VNC_PASSWORD" << std::endl
+            << "  -b, --bands bands         fetch the native capture in this many parallel bands, default 1" << std::endl
+            << "  -r, --fps fps             the capture frame rate, default 30" << std::endl
+            << "  -R, --rgb                 encode the captured RGB directly, skipping decode and conversion" << std::endl
+            << "      --gray                encode luma only (4:0:0), for monitoring; needs libx264 or ffv1" << std::endl
+            << "  -c, --codec codec         the encoder, default libx264 (libx264rgb with -R)" << std::endl
+            << "  -o, --output url          the output location, default out.mp4; udp://host:port sends paced MPEG-TS" << std::endl
+            << "  -a, --audit               print the per-stage byte-copy audit on exit" << std::endl
+            << "  -s, --skip-idle           don't encode frames without a significant change" << std::endl
+            << "      --incremental         convert only changed tiles into a persistent YUV frame" << std::endl
+            << "      --scroll              detect scrolled regions and move them instead (implies --incremental)" << std::endl
+            << "      --keyframe-ratio r    force an IDR when this fraction of tiles changes at once" << std::endl
+            << "      --max-gop secs        the longest GOP with --keyframe-ratio, default 60" << std::endl
+            << "      --tile pixels         the change detection tile size, default 64" << std::endl
+            << "      --threshold-pixels n  changed pixels for a tile to count as changed, default 1" << std::endl
+            << "      --threshold-sad n     sum of absolute differences for a tile to count, default off" << std::endl
+            << "      --ignore WxH+X+Y      ignore changes in this region; may be repeated" << std::endl
+            << "      --ignore-refresh secs refresh ignored regions this often, default 10, 0 for never" << std::endl
+            << "      --segment secs        start a new segment this often; the output may hold a %d or %0Nd" << std::endl
+            << "      --activity            log how much of the screen changed each second beside each segment," << std::endl
+            << "                            as segment.activity, for condense; uploaded with it, not for udp://" << std::endl
+            << "      --recompress codec[:preset]" << std::endl
+            << "                            re-encode finished segments in the background when idle" << std::endl
+            << "      --recompress-cpu n    the CPU cores recompression may use, default 0.5" << std::endl
+            << "      --sample dir          occasionally save raw frames to dir for bench replay" << std::endl
+            << "      --sample-interval secs" << std::endl
+            << "                            the mean time between samples, default 600" << std::endl
+            << "      --sample-length secs  the length of each sample, default 5" << std::endl
+            << "      --sample-downscale n  divide sampled frames' width and height by n, default 1" << std::endl
+            << "      --sample-mask WxH+X+Y black out this region in samples; may be repeated" << std::endl
+            << "      --admission policy    refuse, queue or downgrade a recording the host can't afford, measured" << std::endl
+            << "                            by a calibration encode; default off, start it as given" << std::endl
+            << "      --metrics port        serve metrics at http://127.0.0.1:port/metrics" << std::endl
+            << "      --tag name            who the recording is charged to, in its metrics and usage record" << std::endl
+            << "      --usage-log file      append the recording's CPU, output, frames and peak memory to file," << std::endl
+            << "                            as a line of JSON, when it ends" << std::endl
+            << "      --log-rate n          write at most n log lines of a kind each second, default 20, 0 for no limit" << std::endl
+            << "      --upload http://host[:port]/bucket[/prefix]" << std::endl
+            << "                            upload finished segments to S3, keys from $AWS_ACCESS_KEY_ID and" << std::endl
+            << "                            $AWS_SECRET_ACCESS_KEY" << std::endl
+            << "      --upload-fragments    upload segments while they are written, as fragmented MP4" << std::endl
+            << "      --upload-keep         keep segments on disk once uploaded" << std::endl
+            << "      --upload-parallel n   concurrent part uploads, default 4" << std::endl
+            << "      --upload-part-size MiB" << std::endl
+            << "                            the multipart upload part size, default 8" << std::endl
+            << "      --slo-latency ms      snapshot diagnostics when p99 frame processing time exceeds this" << std::endl
+            << "      --slo-drop-rate r     snapshot diagnostics when more than this fraction of frames is dropped" << std::endl
+            << "      --slo-window secs     the frames evaluated and snapshotted, default 10" << std::endl
+            << "      --slo-dir dir         where diagnostics are written, default ." << std::endl
+            << "      --slo-interval secs   the least time between snapshots, default 300" << std::endl
+            << "      --slo-perf            add a hardware counter sample of the recorder thread" << std::endl
+            << "      --pace-rate kbps      the UDP sending rate, default 1.2x the encoder's peak rate" << std::endl
+            << "      --pace-burst n        datagrams UDP output may send back to back, default 4" << std::endl
+            << "      --pace-queue KiB      UDP output queued before datagrams are dropped, default twice the VBV buffer" << std::endl
+            << "      --adapt               encode at a lower resolution, in a new segment, while the recorder can't keep up" << std::endl
+            << "      --adapt-down secs     overload before stepping down to 3/4 of the width and height, default 5" << std::endl
+            << "      --adapt-up secs       headroom before stepping back up, default 30" << std::endl
+            << "      --adapt-steps n       the most steps down, default 3" << std::endl
+            << "      --shadow [codec][:preset]" << std::endl
+            << "                            also code sampled GOPs with these settings in the background, and" << std::endl
+            << "                            compare their size, CPU time and PSNR with the live settings'" << std::endl
+            << "      --shadow-crf n        code shadow GOPs at this CRF instead of the live rate targets" << std::endl
+            << "      --shadow-params k=v:k=v" << std::endl
+            << "                            further encoder options for shadow GOPs" << std::endl
+            << "      --shadow-every n      shadow one GOP in n, default 20" << std::endl;
+}
 
-  const AVInputFormat *input_format = av_find_input_format("x11grab");
-  if (!input_format) {
-    throw std::runtime_error("Failed to find input format");
+/** Parse an X geometry string, WxH+X+Y, into a rectangle.
+ *
+ * @param geometry the geometry string
+ * @param rect     the parsed rectangle
+ *
+ * @return Zero on success, a negative value on error.
+ */
+int parse_geometry(const char* geometry, Rect& rect)
+{
+  if (sscanf(geometry, "%dx%d+%d+%d", &rect.w, &rect.h, &rect.x, &rect.y) != 4 ||
+      rect.empty()) {
+    return -1;
   }
+  return 0;
+}
 
-  Packet packet = Packet::alloc();
-  if (!packet) {
-    throw std::runtime_error("Failed to allocate a decoder packet");
+/** Find the index placeholder in a segment pattern, a %d or %0Nd.
+ *
+ * @param pattern the output location given on the command line
+ * @param pos     where the placeholder starts
+ * @param length  the placeholder's length
+ * @param width   the zero-padded width, or zero
+ *
+ * @return One if the pattern holds a single placeholder, zero if it holds no
+ *         %, or a negative value if it holds any other use of %.
+ */
+int find_placeholder(const std::string& pattern, size_t& pos, size_t& length, int& width)
+{
+  pos = pattern.find('%');
+  if (pos == std::string::npos) {
+    return 0;
   }
 
-  int frames = 0;
+  size_t end = pos + 1;
+  width = 0;
+  if (end < pattern.size() && pattern[end] == '0') {
+    end++;
+    size_t digits = end;
+    while (end < pattern.size() && isdigit((unsigned char)pattern[end]) && end - digits < 2) {
+      width = width * 10 + (pattern[end++] - '0');
+    }
+    if (end == digits) {
+      return -1;
+    }
+  }
+  if (end >= pattern.size() || pattern[end] != 'd' ||
+      pattern.find('%', end) != std::string::npos) {
+    return -1;
+  }
 
-  /** Setup the decoder format and input context.
-   *
-   * These calls:
-   *   1. allocates and opens the input format context.
-   *   2. reads stream metadata from the input format context.
-   *   3. allocates and opens the appropriate decoder / codec context.
-   *   4. find the input timebase.
-   */
+  length = end + 1 - pos;
+  return 1;
+}
 
-  auto input_avfc = FormatContext::open_input_format(input_format);
-  if (!input_avfc.get()) {
-    throw std::runtime_error("Failed to open the input format");
+/** Format the output location of the nth segment.
+ *
+ * The index replaces a %d or %0Nd in the pattern; otherwise it is inserted
+ * before the extension, out.mp4 becoming out-001.mp4. Patterns are checked
+ * with `find_placeholder` when the options are parsed.
+ *
+ * @param pattern the output location given on the command line
+ * @param index   the segment number
+ *
+ * @return The segment's output location.
+ */
+std::string segment_url(const std::string& pattern, int index)
+{
+  char buf[32];
+  size_t pos, length;
+  int width;
+  if (find_placeholder(pattern, pos, length, width) > 0) {
+    snprintf(buf, sizeof(buf), "%0*d", width, index);
+    return pattern.substr(0, pos) + buf + pattern.substr(pos + length);
   }
 
-  auto input_avs = input_avfc.find_best_stream(AVMEDIA_TYPE_VIDEO, -1);
-
-  auto input_avcc = DecoderContext::open_context(input_avs->codecpar);
-  if (!input_avcc.get()) {
-    throw std::runtime_error("Failed to allocate the input codec context");
+  size_t dot = pattern.rfind('.');
+  size_t slash = pattern.rfind('/');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+    dot = pattern.size();
   }
+  snprintf(buf, sizeof(buf), "-%03d", index);
+  return pattern.substr(0, dot) + buf + pattern.substr(dot);
+}
 
-  auto framerate = av_guess_frame_rate(input_avfc.get(), input_avs, NULL);
-  auto timebase = av_inv_q(framerate);
+/** Run screencap
+ *
+ * Main parses the options and runs a Recorder, admitted by a SessionManager,
+ * until it is interrupted.
+ *
+ * @param argc number of arguments
+ * @param argv the arguments themselves
+ */
+int main(int argc, char **argv) {
+  RecorderOptions options;
+  bool audit = false;
+  int segment = 0;
+  bool recompress = false;
+  RecompressOptions recompress_options;
+  bool sample = false;
+  SamplerOptions sample_options;
+  SessionOptions session_options;
+  int metrics_port = 0;
+  bool upload = false;
+  bool upload_fragments = false;
+  UploadOptions upload_options;
+  int log_rate = 20;
 
-  /** Setup the encoder format and input context.
-   *
-   * These calls:
-   *   1. allocates and opens the output format context.
-   *   2. allocates and opens the appropriate encoder / codec context.
-   *   3. set all relevant codec context fields (derived from the decoder)
-   *   4. creates a video stream for the output format context
-   *   5. writes the file header to the output format context.
-   */
+  static const struct option long_options[] = {
+    {"native",           no_argument,       NULL, 'n'},
+    {"display",          required_argument, NULL, 'd'},
+    {"vnc",              required_argument, NULL, 'v'},
+    {"bands",            required_argument, NULL, 'b'},
+    {"fps",              required_argument, NULL, 'r'},
+    {"rgb",              no_argument,       NULL, 'R'},
+    {"gray",             no_argument,       NULL, OPT_GRAY},
+    {"codec",            required_argument, NULL, 'c'},
+    {"output",           required_argument, NULL, 'o'},
+    {"audit",            no_argument,       NULL, 'a'},
+    {"skip-idle",        no_argument,       NULL, 's'},
+    {"incremental",      no_argument,       NULL, OPT_INCREMENTAL},
+    {"scroll",           no_argument,       NULL, OPT_SCROLL},
+    {"keyframe-ratio",   required_argument, NULL, OPT_KEYFRAME_RATIO},
+    {"max-gop",          required_argument, NULL, OPT_MAX_GOP},
+    {"tile",             required_argument, NULL, OPT_TILE},
+    {"threshold-pixels", required_argument, NULL, OPT_THRESHOLD_PIXELS},
+    {"threshold-sad",    required_argument, NULL, OPT_THRESHOLD_SAD},
+    {"ignore",           required_argument, NULL, OPT_IGNORE},
+    {"ignore-refresh",   required_argument, NULL, OPT_IGNORE_REFRESH},
+    {"segment",          required_argument, NULL, OPT_SEGMENT},
+    {"activity",         no_argument,       NULL, OPT_ACTIVITY},
+    {"recompress",       required_argument, NULL, OPT_RECOMPRESS},
+    {"recompress-cpu",   required_argument, NULL, OPT_RECOMPRESS_CPU},
+    {"sample",           required_argument, NULL, OPT_SAMPLE},
+    {"sample-interval",  required_argument, NULL, OPT_SAMPLE_INTERVAL},
+    {"sample-length",    required_argument, NULL, OPT_SAMPLE_LENGTH},
+    {"sample-downscale", required_argument, NULL, OPT_SAMPLE_DOWNSCALE},
+    {"sample-mask",      required_argument, NULL, OPT_SAMPLE_MASK},
+    {"admission",        required_argument, NULL, OPT_ADMISSION},
+    {"metrics",          required_argument, NULL, OPT_METRICS},
+    {"tag",              required_argument, NULL, OPT_TAG},
+    {"usage-log",        required_argument, NULL, OPT_USAGE_LOG},
+    {"log-rate",         required_argument, NULL, OPT_LOG_RATE},
+    {"upload",           required_argument, NULL, OPT_UPLOAD},
+    {"upload-fragments", no_argument,       NULL, OPT_UPLOAD_FRAGMENTS},
+    {"upload-keep",      no_argument,       NULL, OPT_UPLOAD_KEEP},
+    {"upload-parallel",  required_argument, NULL, OPT_UPLOAD_PARALLEL},
+    {"upload-part-size", required_argument, NULL, OPT_UPLOAD_PART_SIZE},
+    {"slo-latency",      required_argument, NULL, OPT_SLO_LATENCY},
+    {"slo-drop-rate",    required_argument, NULL, OPT_SLO_DROP_RATE},
+    {"slo-window",       required_argument, NULL, OPT_SLO_WINDOW},
+    {"slo-dir",          required_argument, NULL, OPT_SLO_DIR},
+    {"slo-interval",     required_argument, NULL, OPT_SLO_INTERVAL},
+    {"slo-perf",         no_argument,       NULL, OPT_SLO_PERF},
+    {"pace-rate",        required_argument, NULL, OPT_PACE_RATE},
+    {"pace-burst",       required_argument, NULL, OPT_PACE_BURST},
+    {"pace-queue",       required_argument, NULL, OPT_PACE_QUEUE},
+    {"adapt",            no_argument,       NULL, OPT_ADAPT},
+    {"adapt-down",       required_argument, NULL, OPT_ADAPT_DOWN},
+    {"adapt-up",         required_argument, NULL, OPT_ADAPT_UP},
+    {"adapt-steps",      required_argument, NULL, OPT_ADAPT_STEPS},
+    {"shadow",           required_argument, NULL, OPT_SHADOW},
+    {"shadow-crf",       required_argument, NULL, OPT_SHADOW_CRF},
+    {"shadow-params",    required_argument, NULL, OPT_SHADOW_PARAMS},
+    {"shadow-every",     required_argument, NULL, OPT_SHADOW_EVERY},
+    {NULL, 0, NULL, 0}
+  };
 
-  auto output_avfc = FormatContext::open_output("out.mp4");
-  if (!output_avfc.get()) {
-    throw std::runtime_error("Failed to open the output format");
+  int opt;
+  Rect rect;
+  while ((opt = getopt_long(argc, argv, "nd:v:b:r:Rc:o:as", long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'n':
+      options.native = true;
+      break;
+    case 'd':
+      options.display = optarg;
+      break;
+    case 'v':
+      options.vnc = optarg;
+      break;
+    case 'b':
+      options.bands = atoi(optarg);
+      break;
+    case 'r':
+      options.fps = atoi(optarg);
+      break;
+    case 'R':
+      options.rgb = true;
+      break;
+    case OPT_GRAY:
+      options.gray = true;
+      break;
+    case 'c':
+      options.codec = optarg;
+      break;
+    case 'o':
+      options.url = optarg;
+      break;
+    case 'a':
+      audit = true;
+      break;
+    case 's':
+      options.skip_idle = true;
+      break;
+    case OPT_INCREMENTAL:
+      options.incremental = true;
+      break;
+    case OPT_SCROLL:
+      options.incremental = true;
+      options.change.scroll = true;
+      break;
+    case OPT_KEYFRAME_RATIO:
+      options.keyframe_ratio = atof(optarg);
+      break;
+    case OPT_MAX_GOP:
+      options.max_gop = atof(optarg);
+      break;
+    case OPT_TILE:
+      options.change.tile = atoi(optarg);
+      break;
+    case OPT_THRESHOLD_PIXELS:
+      options.change.threshold_pixels = atoi(optarg);
+      break;
+    case OPT_THRESHOLD_SAD:
+      options.change.threshold_sad = atoll(optarg);
+      break;
+    case OPT_IGNORE:
+      if (parse_geometry(optarg, rect) < 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      options.change.ignore.push_back(rect);
+      break;
+    case OPT_IGNORE_REFRESH:
+      options.change.ignore_refresh = atof(optarg);
+      break;
+    case OPT_SEGMENT:
+      segment = atoi(optarg);
+      break;
+    case OPT_ACTIVITY:
+      options.activity = true;
+      break;
+    case OPT_RECOMPRESS: {
+      recompress = true;
+      std::string arg = optarg;
+      size_t colon = arg.find(':');
+      recompress_options.codec = arg.substr(0, colon);
+      if (colon != std::string::npos) {
+        recompress_options.preset = arg.substr(colon + 1);
+      }
+      break;
+    }
+    case OPT_RECOMPRESS_CPU:
+      recompress_options.cpu_cap = atof(optarg);
+      break;
+    case OPT_SAMPLE:
+      sample = true;
+      sample_options.dir = optarg;
+      break;
+    case OPT_SAMPLE_INTERVAL:
+      sample_options.interval = atof(optarg);
+      break;
+    case OPT_SAMPLE_LENGTH:
+      sample_options.length = atof(optarg);
+      break;
+    case OPT_SAMPLE_DOWNSCALE:
+      sample_options.downscale = atoi(optarg);
+      break;
+    case OPT_SAMPLE_MASK:
+      if (parse_geometry(optarg, rect) < 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      sample_options.mask.push_back(rect);
+      break;
+    case OPT_ADMISSION:
+      if (strcmp(optarg, "off") == 0) {
+        session_options.admission = Admission::off;
+      } else if (strcmp(optarg, "refuse") == 0) {
+        session_options.admission = Admission::refuse;
+      } else if (strcmp(optarg, "queue") == 0) {
+        session_options.admission = Admission::queue;
+      } else if (strcmp(optarg, "downgrade") == 0) {
+        session_options.admission = Admission::downgrade;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case OPT_METRICS:
+      metrics_port = atoi(optarg);
+      break;
+    case OPT_TAG:
+      options.tag = optarg;
+      break;
+    case OPT_USAGE_LOG:
+      options.usage_log = optarg;
+      break;
+    case OPT_LOG_RATE:
+      log_rate = atoi(optarg);
+      break;
+    case OPT_UPLOAD:
+      if (Uploader::parse_location(optarg, upload_options) < 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      upload = true;
+      break;
+    case OPT_UPLOAD_FRAGMENTS:
+      upload_fragments = true;
+      break;
+    case OPT_UPLOAD_KEEP:
+      upload_options.remove = false;
+      break;
+    case OPT_UPLOAD_PARALLEL:
+      upload_options.parallel = atoi(optarg);
+      break;
+    case OPT_UPLOAD_PART_SIZE:
+      upload_options.part_size = (size_t)atoi(optarg) << 20;
+      break;
+    case OPT_SLO_LATENCY:
+      options.slo.latency_ms = atof(optarg);
+      break;
+    case OPT_SLO_DROP_RATE:
+      options.slo.drop_rate = atof(optarg);
+      break;
+    case OPT_SLO_WINDOW:
+      options.slo.window = atof(optarg);
+      break;
+    case OPT_SLO_DIR:
+      options.slo.dir = optarg;
+      break;
+    case OPT_SLO_INTERVAL:
+      options.slo.min_interval = atof(optarg);
+      break;
+    case OPT_SLO_PERF:
+      options.slo.perf = true;
+      break;
+    case OPT_PACE_RATE:
+      options.pacing.rate = atoll(optarg) * 1000;
+      break;
+    case OPT_PACE_BURST:
+      options.pacing.burst = atoi(optarg);
+      break;
+    case OPT_PACE_QUEUE:
+      options.pacing.max_queue = atoll(optarg) << 10;
+      break;
+    case OPT_ADAPT:
+      options.adapt.enabled = true;
+      break;
+    case OPT_ADAPT_DOWN:
+      options.adapt.down_after = atof(optarg);
+      break;
+    case OPT_ADAPT_UP:
+      options.adapt.up_after = atof(optarg);
+      break;
+    case OPT_ADAPT_STEPS:
+      options.adapt.max_steps = atoi(optarg);
+      break;
+    case OPT_SHADOW: {
+      options.shadow.enabled = true;
+      std::string arg = optarg;
+      size_t colon = arg.find(':');
+      options.shadow.codec = arg.substr(0, colon);
+      if (colon != std::string::npos) {
+        options.shadow.preset = arg.substr(colon + 1);
+      }
+      break;
+    }
+    case OPT_SHADOW_CRF:
+      options.shadow.crf = atoi(optarg);
+      break;
+    case OPT_SHADOW_PARAMS:
+      options.shadow.params = optarg;
+      break;
+    case OPT_SHADOW_EVERY:
+      options.shadow.every = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
   }
 
-  auto output_avcc = EncoderContext::alloc_context_by_name("libx264");
-  if (!output_avcc.get()) {
-    throw std::runtime_error("Failed to allocate the output codec context");
+  // Recompression rewrites a segment after it is finished, so it can't be
+  // uploaded while it is written. A UDP stream leaves no files behind.
+  std::string udp_host;
+  int udp_port;
+  bool udp = PacedSender::parse_location(options.url, udp_host, udp_port) == 0;
+  size_t placeholder_pos, placeholder_length;
+  int placeholder_width;
+  if (!udp && find_placeholder(options.url, placeholder_pos, placeholder_length,
+                               placeholder_width) < 0) {
+    std::cerr << "The output may hold one %d or %0Nd and no other %" << std::endl;
+    return 1;
+  }
+  if (options.fps <= 0 || options.bands <= 0 || segment < 0 ||
+      upload_options.parallel <= 0 || upload_options.part_size == 0 ||
+      options.pacing.burst <= 0 || options.adapt.max_steps < 0 ||
+      options.shadow.every <= 0 ||
+      (options.rgb && options.gray) ||
+      (upload_fragments && (!upload || recompress)) ||
+      (udp && (segment > 0 || upload || recompress || options.activity))) {
+    usage(argv[0]);
+    return 1;
   }
 
-  av_opt_set(output_avcc->priv_data, "preset", "fast", 0);
-  output_avcc->pix_fmt             = AV_PIX_FMT_YUV420P;
-  output_avcc->height              = input_avcc->height;
-  output_avcc->width               = input_avcc->width;
-  output_avcc->sample_aspect_ratio = input_avcc->sample_aspect_ratio;
-  output_avcc->bit_rate            = 2 * 1000 * 1000;
-  output_avcc->rc_buffer_size      = 4 * 1000 * 1000;
-  output_avcc->rc_max_rate         = 2 * 1000 * 1000;
-  output_avcc->rc_min_rate         = 2.5 * 1000 * 1000;
-  output_avcc->time_base           = timebase;
+  if (const char* password = getenv("VNC_PASSWORD")) {
+    options.vnc_password = password;
+  }
+  if (const char* key = getenv("AWS_ACCESS_KEY_ID")) {
+    upload_options.access_key = key;
+  }
+  if (const char* secret = getenv("AWS_SECRET_ACCESS_KEY")) {
+    upload_options.secret_key = secret;
+  }
+  if (const char* region = getenv("AWS_REGION")) {
+    upload_options.region = region;
+  }
+  options.fragmented = upload_fragments;
 
-  if (output_avcc.open() < 0) {
-    throw std::runtime_error("Failed to open the output codec context");
+  std::string pattern = options.url;
+  std::atomic<int> segment_index{0};
+  if (segment > 0) {
+    options.url = segment_url(pattern, segment_index);
   }
 
-  int stream_idx = output_avfc.create_stream(output_avcc);
-  if (stream_idx < 0) {
-    throw std::runtime_error("Failed to create new output stream");
+  signal(SIGINT, &signal_handler);
+  avdevice_register_all();
+
+  AsyncLog& log = AsyncLog::instance();
+  log.start(log_rate);
+
+  Metrics metrics;
+  MetricsServer metrics_server(metrics);
+  SessionManager sessions(session_options);
+  sessions.publish(metrics);
+  log.publish(metrics);
+  if (metrics_port > 0 && metrics_server.start(metrics_port) < 0) {
+    throw std::runtime_error("Failed to start the metrics server");
   }
 
-  if (avformat_write_header(output_avfc.get(), NULL) < 0) {
-    throw std::runtime_error("Failed to write output headers");
+  Uploader uploader(upload_options);
+  if (upload) {
+    uploader.start();
   }
 
-  /** Define the codec callbacks
-   *
-   * encode_callback is passed the encoded packet and writes it to the output
-   * format context.
-   *
-   * decode_callback is passed the decoded frame which it scales to set the
-   * picture's strobe and sends to the encoder.
-   */
+  // Recompress only while every recorder spends under half of each frame busy.
+  Recompressor recompressor(recompress_options, [&] {
+    return sessions.max_load() < 0.5;
+  });
+  if (recompress) {
+    if (upload) {
+      recompressor.on_finished([&](const std::string& url) {
+        uploader.enqueue(url);
+        if (options.activity) {
+          uploader.enqueue(ActivityLog::path_of(url));
+        }
+      });
+    }
+    recompressor.start();
+  }
 
-  std::function<int(Packet packet)> encode_callback = [&](Packet packet) {
-    packet->stream_index = stream_idx;
+  Sampler sampler(sample_options);
+  if (sample) {
+    sampler.start();
+  }
 
-    return av_write_frame(output_avfc.get(), packet.get());
-  };
+  if (upload_fragments) {
+    uploader.follow(options.url);
+  }
 
-  std::function<int(Frame frame)> decode_callback = [&](Frame frame) {
-    auto scale_frame = frame.scale(frame->width, frame->height, AV_PIX_FMT_YUV420P);
-    scale_frame->pts = frames++ * output_avcc->time_base.num;
-    scale_frame->pkt_dts = scale_frame->pts;
+  int id = sessions.submit(options, [&](Recorder& recorder) {
+    recorder.on_resize([&](int w, int h) {
+      if (udp) {
+        av_log(NULL, AV_LOG_INFO, "Encoding at %dx%d\n", w, h);
+        return std::string();
+      }
+      std::string url = segment_url(pattern, ++segment_index);
+      av_log(NULL, AV_LOG_INFO, "Encoding at %dx%d from %s\n", w, h, url.c_str());
+      if (upload_fragments) {
+        uploader.follow(url);
+      }
+      return url;
+    });
+    if (recompress) {
+      recorder.on_segment([&](const std::string& url) {
+        recompressor.enqueue(url);
+      });
+    } else if (upload) {
+      recorder.on_segment([&](const std::string& url) {
+        if (upload_fragments) {
+          uploader.finish(url);
+        } else {
+          uploader.enqueue(url);
+        }
+        // The sidecar is written whole when the segment closes.
+        if (options.activity) {
+          uploader.enqueue(ActivityLog::path_of(url));
+        }
+      });
+    }
+    if (sample) {
+      recorder.add_frame_tap([&](Frame frame) {
+        return sampler.tap(std::move(frame));
+      });
+      recorder.add_state("sampler", [&] {
+        return std::to_string(sampler.get_queued()) + " frames queued";
+      });
+    }
+    if (recompress) {
+      recorder.add_state("recompressor", [&] {
+        return std::to_string(recompressor.get_queued()) + " segments queued";
+      });
+    }
+    if (upload) {
+      recorder.add_state("uploader", [&] {
+        return std::to_string(uploader.get_pending()) + " files pending";
+      });
+    }
+  });
+  if (id < 0) {
+    throw std::runtime_error(sessions.get_error());
+  }
 
-    return output_avcc.send_frame(scale_frame, encode_callback);
-  };
+  // A queued recording waits here for capacity.
+  std::shared_ptr<Recorder> recorder;
+  while (!stop && sessions.has(id) && !(recorder = sessions.get(id))) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    sessions.poll();
+  }
+  if (!recorder && !stop) {
+    throw std::runtime_error(sessions.get_error());
+  }
 
-  /** Run it!
-   *
-   * Read from the input format context, packet by packet, until either the
-   * signal handler is called or the program hits a runtime error.
-   */
+  auto segment_start = std::chrono::steady_clock::now();
+  while (!stop && recorder && recorder->is_running()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    sessions.poll();
 
-  while(!stop) {
-    if (av_read_frame(input_avfc.get(), packet.get()) < 0) {
-      break;
+    if (segment > 0 &&
+        std::chrono::steady_clock::now() - segment_start >= std::chrono::seconds(segment)) {
+      segment_start = std::chrono::steady_clock::now();
+      std::string url = segment_url(pattern, ++segment_index);
+      if (upload_fragments) {
+        uploader.follow(url);
+      }
+      if (recorder->rotate(url).get() < 0) {
+        break;
+      }
     }
-    input_avcc.send_packet(packet, decode_callback);
   }
 
-  av_write_trailer(output_avfc.get());
+  if (recorder && recorder->stop().get() < 0) {
+    throw std::runtime_error(recorder->get_error());
+  }
+  if (auto shadow = recorder ? recorder->get_shadow() : NULL) {
+    ShadowTotals control = shadow->get_control();
+    ShadowTotals candidate = shadow->get_candidate();
+    std::cerr << "Shadow: " << shadow->get_windows() << " windows compared, "
+              << shadow->get_skipped() << " skipped" << std::endl
+              << "  control:   " << control.bytes << " bytes, " << control.cpu << " s CPU, "
+              << control.psnr() << " dB" << std::endl
+              << "  candidate: " << candidate.bytes << " bytes, " << candidate.cpu << " s CPU, "
+              << candidate.psnr() << " dB" << std::endl;
+  }
+  sessions.stop_all();
+  recompressor.stop();
+  sampler.stop();
+  uploader.stop();
+  log.stop();
+
+  if (audit) {
+    CopyAudit::report(std::cerr);
+  }
   return 0;
 }
@@ -0,0 +1,265 @@
+// metrics.hpp -*- c++ -*-
+
+/*
+ * MIT License
+ *
+ * Copyright (c) 2022 Walker Griggs
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <string>
+#include <sstream>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/** A registry of metric collectors, rendered in the Prometheus text format.
+ *
+ * Components register a collector that writes their current values when the
+ * metrics are scraped, so nothing is sampled or stored in between.
+ */
+class Metrics {
+public:
+  using Collector = std::function<void(std::ostream&)>;
+
+  /** Registers a collector.
+   *
+   * @return An id for `remove`.
+   */
+  int add(Collector fn) {
+    std::lock_guard<std::mutex> lock(mutex);
+    collectors[next_id] = std::move(fn);
+    return next_id++;
+  }
+
+  void remove(int id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    collectors.erase(id);
+  }
+
+  /** Runs every collector into the stream.
+   */
+  void render(std::ostream& os) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& c : collectors) {
+      c.second(os);
+    }
+  }
+
+  /** Writes the HELP and TYPE lines that precede a metric's samples.
+   *
+   * @param type gauge or counter
+   */
+  static void header(std::ostream& os, const char* name, const char* type, const char* help) {
+    os << "# HELP " << name << " " << help << "\n"
+       << "# TYPE " << name << " " << type << "\n";
+  }
+
+  /** Writes one sample.
+   *
+   * Whole numbers, such as byte and frame counters, are written exactly;
+   * others with 15 significant digits, not the stream's default of 6.
+   *
+   * @param labels the label set without braces, such as session="3", or empty
+   */
+  static void sample(std::ostream& os, const char* name, double value,
+                     const std::string& labels = "") {
+    os << name;
+    if (!labels.empty()) {
+      os << "{" << labels << "}";
+    }
+    os << " ";
+    if (std::isfinite(value) && std::fabs(value) < 9e15 && value == std::trunc(value)) {
+      os << (int64_t)value;
+    } else {
+      std::streamsize precision = os.precision(15);
+      os << value;
+      os.precision(precision);
+    }
+    os << "\n";
+  }
+
+  /** Escapes a label value: backslashes, double quotes and newlines.
+   */
+  static std::string escape(const std::string& value) {
+    std::string out;
+    for (char c : value) {
+      if (c == '\\' || c == '"') {
+        out += '\\';
+        out += c;
+      } else if (c == '\n') {
+        out += "\\n";
+      } else {
+        out += c;
+      }
+    }
+    return out;
+  }
+
+  /** Writes a metric with a single, unlabelled sample.
+   */
+  static void single(std::ostream& os, const char* name, const char* type,
+                     const char* help, double value) {
+    header(os, name, type, help);
+    sample(os, name, value);
+  }
+
+private:
+  std::mutex mutex;
+  std::map<int, Collector> collectors;
+  int next_id = 0;
+};
+
+/** Serves a Metrics registry over HTTP at /metrics.
+ *
+ * One request is served at a time on a single thread; scrapes are small and
+ * rare, and the server must never compete with recording for CPU.
+ */
+class MetricsServer {
+public:
+  explicit MetricsServer(Metrics& registry) : metrics(registry) {}
+
+  MetricsServer(const MetricsServer&) = delete;
+  MetricsServer& operator=(const MetricsServer&) = delete;
+
+  ~MetricsServer() {
+    stop();
+  }
+
+  /** Listens on the address and port and starts serving.
+   *
+   * @param port    the TCP port
+   * @param address the IPv4 address to bind, loopback by default
+   *
+   * @return Zero on success, a negative value on error.
+   */
+  int start(int port, const char* address = "127.0.0.1") {
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+      return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address, &addr.sin_addr) != 1 ||
+        bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(fd, 8) < 0) {
+      ::close(fd);
+      fd = -1;
+      return -1;
+    }
+
+    quit = false;
+    thread = std::thread(&MetricsServer::run, this);
+    return 0;
+  }
+
+  void stop() {
+    quit = true;
+    if (thread.joinable()) {
+      thread.join();
+    }
+    if (fd >= 0) {
+      ::close(fd);
+      fd = -1;
+    }
+  }
+
+private:
+  void run() {
+    while (!quit) {
+      struct pollfd pfd = {fd, POLLIN, 0};
+      if (poll(&pfd, 1, 200) <= 0) {
+        continue;
+      }
+
+      int client = accept(fd, NULL, NULL);
+      if (client < 0) {
+        continue;
+      }
+      serve(client);
+      ::close(client);
+    }
+  }
+
+  void serve(int client) {
+    struct timeval tv = {1, 0};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    std::string request;
+    char buf[1024];
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+      ssize_t n = recv(client, buf, sizeof(buf), 0);
+      if (n <= 0) {
+        return;
+      }
+      request.append(buf, n);
+    }
+
+    std::ostringstream body;
+    const char* status = "200 OK";
+    if (request.compare(0, 13, "GET /metrics ") == 0) {
+      metrics.render(body);
+    } else {
+      status = "404 Not Found";
+    }
+
+    std::string content = body.str();
+    std::ostringstream response;
+    response << "HTTP/1.1 " << status << "\r\n"
+             << "Content-Type: text/plain; version=0.0.4\r\n"
+             << "Content-Length: " << content.size() << "\r\n"
+             << "Connection: close\r\n\r\n"
+             << content;
+
+    std::string out = response.str();
+    for (size_t sent = 0; sent < out.size();) {
+      ssize_t n = send(client, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+      if (n <= 0) {
+        return;
+      }
+      sent += n;
+    }
+  }
+
+  Metrics& metrics;
+  int fd = -1;
+  std::thread thread;
+  std::atomic<bool> quit{false};
+};
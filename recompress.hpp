@@ -0,0 +1,410 @@
+// recompress.hpp -*- c++ -*-
+
+/*
+ * MIT License
+ *
+ * Copyright (c) 2022 Walker Griggs
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <string>
+#include <deque>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <cmath>
+#include <cstdio>
+#include <ctime>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "libav.hpp"
+
+/** Settings for re-encoding finished segments.
+ */
+struct RecompressOptions {
+  std::string codec = "libx265";  ///< the long-term encoder: libx265, libsvtav1, libx264, ...
+  std::string preset = "slow";    ///< the encoder preset, where supported
+  int crf = -1;                   ///< constant rate factor, negative for the encoder default
+  double cpu_cap = 0.5;           ///< the CPU, in cores, the job may use on average
+};
+
+/** A background job that recompresses finished segments for long-term storage.
+ *
+ * Live segments are encoded with a real-time preset. Once a segment is
+ * finished, the Recompressor re-encodes it with a slower preset or a more
+ * efficient codec on a single worker thread running under SCHED_IDLE. The
+ * worker keeps its average CPU use below `cpu_cap` cores and pauses whenever
+ * the headroom callback reports that live recorders are busy.
+ *
+ * The result is written next to the segment and only replaces it, with an
+ * atomic rename, after its frame count and duration have been checked against
+ * the original. On any failure the original is left untouched.
+ *
+ * Encoders are asked for a single thread where their wrapper allows it, so the
+ * cap, which is measured on the worker thread, is meaningful.
+ */
+class Recompressor {
+public:
+  /** @param opts     the encoder and CPU settings
+   *  @param headroom returns true while live recorders have spare capacity;
+   *                  empty to always run
+   */
+  Recompressor(RecompressOptions opts, std::function<bool()> headroom)
+    : options(std::move(opts)), has_headroom(std::move(headroom)) {}
+
+  Recompressor(const Recompressor&) = delete;
+  Recompressor& operator=(const Recompressor&) = delete;
+
+  ~Recompressor() {
+    stop();
+  }
+
+  void start() {
+    quit = false;
+    worker = std::thread(&Recompressor::run, this);
+  }
+
+  /** Stop the worker; a job in progress is abandoned and its segment kept.
+   *
+   * Segments still queued are left as they are and reported to the
+   * `on_finished` callback, on the calling thread, so they still reach
+   * whatever follows recompression.
+   */
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      quit = true;
+    }
+    cv.notify_all();
+
+    if (worker.joinable()) {
+      worker.join();
+    }
+
+    std::deque<std::string> remaining;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      remaining.swap(queue);
+    }
+    if (finished_callback) {
+      for (auto& path : remaining) {
+        finished_callback(path);
+      }
+    }
+  }
+
+  /** Queue a finished segment for recompression.
+   */
+  void enqueue(const std::string& path) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      queue.push_back(path);
+    }
+    cv.notify_one();
+  }
+
+  /** Registers a callback run on the worker after each job, with the
+   *  segment's path, whether or not it was recompressed. Segments still
+   *  queued when the worker stops are reported unchanged by `stop`.
+   */
+  void on_finished(std::function<void(const std::string&)> fn) {
+    finished_callback = std::move(fn);
+  }
+
+  /** The number of segments waiting to be recompressed.
+   */
+  size_t get_queued() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return queue.size();
+  }
+
+  int get_completed() const {
+    return completed;
+  }
+
+  int get_failed() const {
+    return failed;
+  }
+
+private:
+  void run() {
+    // Only ever run when nothing else wants the CPU.
+    struct sched_param param = {};
+    if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0) {
+      setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+    }
+
+    while (true) {
+      std::string path;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return quit || !queue.empty(); });
+        if (quit) {
+          return;
+        }
+        path = queue.front();
+        queue.pop_front();
+      }
+
+      if (recompress(path) < 0) {
+        failed++;
+      } else {
+        completed++;
+      }
+      if (finished_callback) {
+        finished_callback(path);
+      }
+    }
+  }
+
+  /** Re-encode one segment, verify it and swap it in.
+   */
+  int recompress(const std::string& path) {
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+    std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+    std::string tmp = dir + ".recompress-" + name;
+
+    int64_t src_frames, dst_frames;
+    double src_duration, dst_duration, frame_duration;
+    if (probe(path, src_frames, src_duration, frame_duration) < 0) {
+      return -1;
+    }
+
+    if (transcode(path, tmp) < 0 ||
+        probe(tmp, dst_frames, dst_duration, frame_duration) < 0 ||
+        dst_frames != src_frames ||
+        std::fabs(dst_duration - src_duration) > 1.5 * frame_duration) {
+      unlink(tmp.c_str());
+      return -1;
+    }
+
+    if (rename(tmp.c_str(), path.c_str()) < 0) {
+      unlink(tmp.c_str());
+      return -1;
+    }
+    return 0;
+  }
+
+  /** Count a file's video packets and measure its duration.
+   *
+   * @param path           the file to probe
+   * @param frames         the number of video packets
+   * @param duration       the span from the first timestamp to the end of the
+   *                       last packet, in seconds
+   * @param frame_duration the average frame duration, in seconds
+   *
+   * @return Zero on success, a negative value on error.
+   */
+  static int probe(const std::string& path, int64_t& frames, double& duration,
+                   double& frame_duration) {
+    auto avfc = FormatContext::open_input_file(path);
+    if (!avfc.get()) {
+      return -1;
+    }
+
+    int idx = avfc.find_best_stream_idx(AVMEDIA_TYPE_VIDEO, -1);
+    if (idx < 0) {
+      return -1;
+    }
+    AVRational tb = avfc->streams[idx]->time_base;
+
+    auto packet = Packet::alloc();
+    int64_t first = AV_NOPTS_VALUE, last = AV_NOPTS_VALUE;
+    frames = 0;
+    while (av_read_frame(avfc.get(), packet.get()) >= 0) {
+      if (packet->stream_index == idx && packet->pts != AV_NOPTS_VALUE) {
+        frames++;
+        if (first == AV_NOPTS_VALUE || packet->pts < first) {
+          first = packet->pts;
+        }
+        if (last == AV_NOPTS_VALUE || packet->pts + packet->duration > last) {
+          last = packet->pts + packet->duration;
+        }
+      }
+      av_packet_unref(packet.get());
+    }
+
+    if (frames == 0) {
+      return -1;
+    }
+    duration = (last - first) * av_q2d(tb);
+    frame_duration = duration / frames;
+    return 0;
+  }
+
+  /** Decode a segment and encode it again with the long-term settings.
+   */
+  int transcode(const std::string& src, const std::string& dst) {
+    auto input_avfc = FormatContext::open_input_file(src);
+    if (!input_avfc.get()) {
+      return -1;
+    }
+
+    auto input_avs = input_avfc.find_best_stream(AVMEDIA_TYPE_VIDEO, -1);
+    if (!input_avs) {
+      return -1;
+    }
+
+    auto input_avcc = DecoderContext::open_context(input_avs->codecpar);
+    if (!input_avcc.get()) {
+      return -1;
+    }
+
+    auto output_avfc = FormatContext::open_output(dst);
+    if (!output_avfc.get()) {
+      return -1;
+    }
+
+    auto output_avcc = EncoderContext::alloc_context_by_name(options.codec);
+    if (!output_avcc.get()) {
+      return -1;
+    }
+
+    av_opt_set(output_avcc->priv_data, "preset", options.preset.c_str(), 0);
+    if (options.crf >= 0) {
+      av_opt_set_int(output_avcc->priv_data, "crf", options.crf, 0);
+    }
+    av_opt_set(output_avcc->priv_data, "x265-params", "pools=none:frame-threads=1", 0);
+    av_opt_set_int(output_avcc->priv_data, "lp", 1, 0);
+    output_avcc->thread_count        = 1;
+    output_avcc->pix_fmt             = input_avcc->pix_fmt;
+    output_avcc->width               = input_avcc->width;
+    output_avcc->height              = input_avcc->height;
+    output_avcc->sample_aspect_ratio = input_avcc->sample_aspect_ratio;
+    output_avcc->time_base           = input_avs->time_base;
+
+    if (output_avcc.open() < 0) {
+      return -1;
+    }
+
+    int stream_idx = output_avfc.create_stream(output_avcc);
+    if (stream_idx < 0) {
+      return -1;
+    }
+
+    if (avformat_write_header(output_avfc.get(), NULL) < 0) {
+      return -1;
+    }
+
+    std::function<int(Packet)> encode_callback = [&](Packet packet) {
+      packet->stream_index = stream_idx;
+      return output_avfc.write_packet(packet, output_avcc->time_base);
+    };
+
+    job_start = std::chrono::steady_clock::now();
+    job_cpu = thread_cpu();
+
+    std::function<int(Frame)> decode_callback = [&](Frame frame) {
+      if (throttle() < 0) {
+        return -1;
+      }
+      frame->pts = frame->best_effort_timestamp;
+      return output_avcc.send_frame(frame, encode_callback);
+    };
+
+    auto packet = Packet::alloc();
+    while (av_read_frame(input_avfc.get(), packet.get()) >= 0) {
+      int res = 0;
+      if (packet->stream_index == input_avs->index) {
+        res = input_avcc.send_packet(packet, decode_callback);
+      }
+      av_packet_unref(packet.get());
+      if (res < 0) {
+        return res;
+      }
+    }
+
+    auto flush_packet = Packet(NULL, [](AVPacket*) {});
+    if (input_avcc.send_packet(flush_packet, decode_callback) < 0) {
+      return -1;
+    }
+
+    auto flush_frame = Frame(NULL, [](AVFrame*) {});
+    if (output_avcc.send_frame(flush_frame, encode_callback) < 0) {
+      return -1;
+    }
+
+    return av_write_trailer(output_avfc.get());
+  }
+
+  /** Hold the worker back while recorders are busy or the CPU cap is spent.
+   *
+   * @return Zero to continue, a negative value if the worker is stopping.
+   */
+  int throttle() {
+    bool paused = false;
+    while (has_headroom && !has_headroom()) {
+      if (quit) {
+        return -1;
+      }
+      paused = true;
+      std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    }
+
+    // Time spent paused is not credit for a burst afterwards.
+    if (paused) {
+      job_start = std::chrono::steady_clock::now();
+      job_cpu = thread_cpu();
+    }
+
+    if (quit) {
+      return -1;
+    }
+
+    double cpu = thread_cpu() - job_cpu;
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - job_start).count();
+    if (options.cpu_cap > 0 && cpu > options.cpu_cap * wall) {
+      std::this_thread::sleep_for(std::chrono::duration<double>(cpu / options.cpu_cap - wall));
+    }
+    return 0;
+  }
+
+  static double thread_cpu() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+  RecompressOptions options;
+  std::function<bool()> has_headroom;
+  std::function<void(const std::string&)> finished_callback;
+
+  std::thread worker;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<std::string> queue;
+  std::atomic<bool> quit{false};
+  std::atomic<int> completed{0};
+  std::atomic<int> failed{0};
+
+  std::chrono::steady_clock::time_point job_start;
+  double job_cpu = 0;
+};
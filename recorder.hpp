@@ -0,0 +1,1176 @@
+// recorder.hpp -*- c++ -*-
+
+/*
+ * MIT License
+ *
+ * Copyright (c) 2022 Walker Griggs
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <future>
+#include <functional>
+#include <memory>
+#include <cmath>
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "libav.hpp"
+#include "capture.hpp"
+#include "rfb.hpp"
+#include "change.hpp"
+#include "convert.hpp"
+#include "diagnostics.hpp"
+#include "udp.hpp"
+#include "shadow.hpp"
+#include "activity.hpp"
+#include "usage.hpp"
+
+/** When to trade encode resolution for keeping up.
+ *
+ * Each step down encodes at 3/4 of the width and height, a little over half
+ * the pixels, so a recorder stepping back up needs its load to nearly double
+ * without crossing `overload`; `headroom` sits below half of it for that
+ * reason.
+ */
+struct AdaptOptions {
+  bool enabled = false;   ///< lower the encode resolution under sustained overload
+  double overload = 1.0;  ///< the load above which the recorder can't keep up
+  double headroom = 0.5;  ///< the load below which it can afford a step back up
+  double down_after = 5;  ///< seconds of overload before stepping down
+  double up_after = 30;   ///< seconds of headroom before stepping back up
+  int max_steps = 3;      ///< the most steps down
+};
+
+/** Everything needed to set up a recording.
+ */
+struct RecorderOptions {
+  std::string url = "out.mp4";  ///< the first segment's output location, udp://host:port for paced MPEG-TS
+  std::string codec;            ///< the encoder, empty for libx264 (libx264rgb if rgb)
+  std::string preset = "fast";  ///< the encoder preset, where supported
+  bool native = false;          ///< capture with X11Capture instead of x11grab
+  std::string display;          ///< the X display, empty for $DISPLAY
+  std::string vnc;              ///< capture a VNC server instead, as host[:display] or host::port
+  std::string vnc_password;     ///< the VNC password, empty if the server needs none
+  int bands = 1;                ///< parallel bands for the native source
+  int fps = 30;                 ///< the capture frame rate
+  bool rgb = false;             ///< encode the captured RGB without conversion
+  bool gray = false;            ///< encode luma only, 4:0:0, for monitoring
+  bool skip_idle = false;       ///< don't encode frames without significant change
+  bool incremental = false;     ///< convert only changed tiles into a persistent YUV frame
+  double keyframe_ratio = 0;    ///< force an IDR when this fraction of tiles changes at once, 0 to leave it to the encoder
+  double max_gop = 60;          ///< the longest GOP, in seconds, when forcing IDRs
+  double min_gop = 2;           ///< the shortest gap, in seconds, between forced IDRs
+  bool fragmented = false;      ///< write MP4 as fragments, so the file only ever grows
+  bool activity = false;        ///< write a per-second activity log beside each segment
+  SloOptions slo;               ///< objectives whose breach snapshots diagnostics
+  PacingOptions pacing;         ///< how UDP output is paced
+  AdaptOptions adapt;           ///< when to lower the encode resolution
+  ShadowOptions shadow;         ///< candidate encoder settings to evaluate on sampled windows
+  std::string tag;              ///< who the recording is charged to, carried into its usage record
+  std::string usage_log;        ///< append a usage record here as each recording ends, empty for none
+  ChangeOptions change;         ///< what counts as a significant change
+};
+
+/** An embeddable screen recorder.
+ *
+ * Recorder runs the capture, convert and encode pipeline that main used to
+ * run inline, on its own thread. `start`, `stop` and `rotate` return
+ * immediately with a future that resolves once the pipeline has acted on the
+ * request, so callers can drive a recording from a test harness or a daemon
+ * without spawning a process.
+ *
+ * Taps receive refcounted references to captured frames and encoded packets
+ * as they pass through the pipeline; nothing is copied for them. A tap that
+ * wants to modify a frame must `make_writable` it first. Taps run on the
+ * recorder thread and should return quickly; they may call `rotate` or `stop`
+ * but not register further taps. A negative return value stops the
+ * recording.
+ */
+class Recorder {
+public:
+  explicit Recorder(RecorderOptions opts) : options(std::move(opts)), detector(options.change), converter(options.gray) {
+    if (options.codec.empty()) {
+      options.codec = options.rgb ? "libx264rgb" : "libx264";
+    }
+  }
+
+  Recorder(const Recorder&) = delete;
+  Recorder& operator=(const Recorder&) = delete;
+
+  ~Recorder() {
+    stop();
+    if (thread.joinable()) {
+      thread.join();
+    }
+  }
+
+  /** Starts recording on a new thread.
+   *
+   * @return A future that resolves to zero once the input and first segment
+   *         are open, or to a negative value if setup failed or the recorder
+   *         is already running.
+   */
+  std::future<int> start() {
+    std::promise<int> promise;
+    auto future = promise.get_future();
+
+    if (running) {
+      promise.set_value(-1);
+      return future;
+    }
+
+    if (thread.joinable()) {
+      thread.join();
+    }
+
+    // The writer outlives each run, so a snapshot taken as the recording
+    // fails is still written.
+    if (!diagnostics && (options.slo.latency_ms > 0 || options.slo.drop_rate > 0)) {
+      diagnostics = std::make_unique<DiagnosticsWriter>(options.slo);
+      diagnostics->start();
+    }
+    traces = TraceWindow(options.slo);
+
+    // Shadow totals cover every run.
+    if (!shadow && options.shadow.enabled) {
+      shadow = std::make_unique<ShadowEncoder>(options.shadow);
+      shadow->start();
+      usage.adopt(shadow->native_handle());
+    }
+
+    // The socket outlives each run too, so the stream keeps its destination.
+    std::string host;
+    int port;
+    if (!sender && PacedSender::parse_location(options.url, host, port) == 0) {
+      sender = std::make_unique<PacedSender>();
+      if (sender->open(host, port) < 0) {
+        sender.reset();
+        fail("Failed to open the UDP output");
+        promise.set_value(-1);
+        return future;
+      }
+      sender_url = options.url;
+    }
+
+    stopping = false;
+    running = true;
+    stop_promise = std::promise<int>();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop_future = stop_promise.get_future().share();
+    }
+    thread = std::thread(&Recorder::run, this, std::move(promise));
+    return future;
+  }
+
+  /** Asks the recorder to stop after the current frame.
+   *
+   * @return A future that resolves once the encoder is flushed and the last
+   *         segment is finished, to zero on success or a negative value if
+   *         the recording failed.
+   */
+  std::shared_future<int> stop() {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+
+    if (!running) {
+      std::promise<int> promise;
+      promise.set_value(0);
+      return promise.get_future().share();
+    }
+    return stop_future;
+  }
+
+  /** Finishes the current segment and continues into a new one.
+   *
+   * The encoder is flushed and reopened, so the new segment starts with a
+   * keyframe and plays on its own.
+   *
+   * @param url the next segment's output location
+   *
+   * @return A future that resolves to zero once the new segment is open, or
+   *         to a negative value on error or if a rotation is already pending.
+   */
+  std::future<int> rotate(std::string url) {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::promise<int> promise;
+    auto future = promise.get_future();
+
+    if (!running || rotate_pending) {
+      promise.set_value(-1);
+      return future;
+    }
+
+    rotate_url = std::move(url);
+    rotate_promise = std::move(promise);
+    rotate_pending = true;
+    return future;
+  }
+
+  /** Registers a tap for captured frames, before conversion.
+   */
+  void add_frame_tap(std::function<int(Frame)> fn) {
+    std::lock_guard<std::mutex> lock(taps_mutex);
+    frame_taps.push_back(std::move(fn));
+  }
+
+  /** Registers a tap for encoded packets, before muxing.
+   */
+  void add_packet_tap(std::function<int(Packet)> fn) {
+    std::lock_guard<std::mutex> lock(taps_mutex);
+    packet_taps.push_back(std::move(fn));
+  }
+
+  /** Registers a callback run on the recorder thread each time the encode
+   *  resolution changes, with the new width and height, that names the
+   *  segment the change starts.
+   *
+   * Without one, the segment is named after the first, with the change's
+   * number and the resolution before its extension. UDP output changes
+   * resolution within the stream instead, and the name goes unused.
+   */
+  void on_resize(std::function<std::string(int, int)> fn) {
+    std::lock_guard<std::mutex> lock(mutex);
+    resize_callback = std::move(fn);
+  }
+
+  /** Registers a callback run on the recorder thread each time a segment is
+   *  finished, with the segment's url.
+   */
+  void on_segment(std::function<void(const std::string&)> fn) {
+    std::lock_guard<std::mutex> lock(mutex);
+    segment_callbacks.push_back(std::move(fn));
+  }
+
+  bool is_running() const {
+    return running;
+  }
+
+  /** The fraction of each frame interval spent capturing, converting and
+   *  encoding, smoothed over roughly a second. At 1 or more the recorder is
+   *  not keeping up.
+   */
+  double get_load() const {
+    return load.load(std::memory_order_relaxed);
+  }
+
+  /** Registers a callback describing a queue or other state, such as a
+   *  tap's backlog, for diagnostics snapshots. It runs on the recorder
+   *  thread.
+   */
+  void add_state(std::string name, std::function<std::string()> fn) {
+    std::lock_guard<std::mutex> lock(mutex);
+    states.emplace_back(std::move(name), std::move(fn));
+  }
+
+  /** The number of once-a-second SLO checks that found a breach.
+   */
+  int get_slo_breaches() const {
+    return slo_breaches;
+  }
+
+  /** The number of diagnostics snapshots written.
+   */
+  int get_snapshots() const {
+    return diagnostics ? diagnostics->get_written() : 0;
+  }
+
+  /** The fraction of the captured width and height being encoded.
+   */
+  double get_encode_scale() const {
+    return std::pow(0.75, adapt_step.load());
+  }
+
+  /** The number of times the encode resolution has changed.
+   */
+  int get_resizes() const {
+    return resizes;
+  }
+
+  /** The UDP output's sender, for its queue and pacing statistics, or NULL
+   *  if the recording isn't sent over UDP.
+   */
+  const PacedSender* get_sender() const {
+    return sender.get();
+  }
+
+  /** The shadow encoder, for its comparison with the live settings, or NULL
+   *  if shadow mode is off.
+   */
+  ShadowEncoder* get_shadow() {
+    return shadow.get();
+  }
+
+  /** What the current or last recording has consumed: CPU as of the last
+   *  sample, taken about once a second, and output and frames up to date.
+   */
+  Usage get_usage() {
+    return usage.get();
+  }
+
+  /** The number of keyframes forced by change-driven placement.
+   */
+  int get_keyframes() const {
+    return keyframes;
+  }
+
+  /** A description of the last error, empty if there was none.
+   */
+  std::string get_error() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return error;
+  }
+
+  const RecorderOptions& get_options() const {
+    return options;
+  }
+
+private:
+  /** The recorder thread: set up, loop until stopped, then tear down.
+   */
+  void run(std::promise<int> started) {
+    tid = syscall(SYS_gettid);
+    usage.reset();
+    usage.attach();
+    usage_sampled = std::chrono::steady_clock::now();
+    trace_start = std::chrono::steady_clock::now();
+    last_check = trace_start;
+    overload_since = headroom_since = trace_start;
+    resize_step = 0;
+    adapt_step = 0;
+    last_pts = AV_NOPTS_VALUE;
+    missed = 0;
+
+    int res = open_input();
+    if (res >= 0) {
+      res = open_output(options.url);
+    }
+    started.set_value(res < 0 ? res : 0);
+
+    if (res >= 0) {
+      res = loop();
+      if (int closed = close_output(); res >= 0) {
+        res = closed;
+      }
+    }
+    if (sender) {
+      sender->stop();
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (rotate_pending) {
+        rotate_promise.set_value(-1);
+        rotate_pending = false;
+      }
+    }
+
+    // Sample before the capture's band threads exit, or their CPU is lost.
+    usage.sample();
+    input_avcc = DecoderContext(NULL, [](AVCodecContext*) {});
+    input_avfc = FormatContext(NULL, [](AVFormatContext*) {});
+    capture.reset();
+
+    // One record covers the whole recording: url is where it began, the
+    // first segment, and last_url where it ended.
+    if (!options.usage_log.empty() &&
+        UsageMeter::write_record(options.usage_log, usage.get(), {
+          {"recorder", usage.get_name()},
+          {"url", options.url},
+          {"last_url", segment_url},
+          {"tag", options.tag},
+          {"result", res < 0 ? "failed" : "ok"},
+        }) < 0 && res >= 0) {
+      res = fail("Failed to write the usage record");
+    }
+
+    running = false;
+    stop_promise.set_value(res < 0 ? res : 0);
+  }
+
+  /** Setup the capture source.
+   *
+   * Natively, this opens the X display and sets up damage tracking and shared
+   * memory; frames are already raw BGR0 and the timebase is our own. A VNC
+   * source is the same, except the damage comes from the server's updates.
+   *
+   * Otherwise these calls:
+   *   1. allocates and opens the input format context at the requested frame
+   *      rate.
+   *   2. reads stream metadata from the input format context.
+   *   3. allocates and opens the appropriate decoder / codec context.
+   *   4. find the input timebase.
+   */
+  int open_input() {
+    const char* display_name = options.display.empty() ? NULL : options.display.c_str();
+
+    if (!options.vnc.empty()) {
+      auto rfb = std::make_unique<RfbCapture>();
+      if (rfb->open(options.vnc, options.vnc_password) < 0) {
+        return fail("Failed to connect to the VNC server");
+      }
+      capture = std::move(rfb);
+    } else if (options.native) {
+      auto x11 = std::make_unique<X11Capture>();
+      if (x11->open(display_name, options.bands) < 0) {
+        return fail("Failed to open the native capture source");
+      }
+      capture = std::move(x11);
+    }
+
+    if (capture) {
+      width = capture->get_width();
+      height = capture->get_height();
+      sample_aspect_ratio = av_make_q(1, 1);
+      timebase = av_make_q(1, options.fps);
+      input_pix_fmt = AV_PIX_FMT_BGR0;
+      return 0;
+    }
+
+    const AVInputFormat *input_format = av_find_input_format("x11grab");
+    if (!input_format) {
+      return fail("Failed to find input format");
+    }
+
+    AVDictionary* input_options = NULL;
+    av_dict_set_int(&input_options, "framerate", options.fps, 0);
+    input_avfc = FormatContext::open_input_format(input_format, display_name, &input_options);
+    av_dict_free(&input_options);
+    if (!input_avfc.get()) {
+      return fail("Failed to open the input format");
+    }
+
+    auto input_avs = input_avfc.find_best_stream(AVMEDIA_TYPE_VIDEO, -1);
+    if (!input_avs) {
+      return fail("Failed to find an input video stream");
+    }
+
+    input_avcc = DecoderContext::open_context(input_avs->codecpar);
+    if (!input_avcc.get()) {
+      return fail("Failed to allocate the input codec context");
+    }
+
+    auto framerate = av_guess_frame_rate(input_avfc.get(), input_avs, NULL);
+    timebase = av_inv_q(framerate);
+
+    width = input_avcc->width;
+    height = input_avcc->height;
+    sample_aspect_ratio = input_avcc->sample_aspect_ratio;
+    input_pix_fmt = input_avcc->pix_fmt;
+    return 0;
+  }
+
+  /** Setup the encoder format and input context for a new segment.
+   *
+   * These calls:
+   *   1. allocates and opens the output format context.
+   *   2. allocates and opens the appropriate encoder / codec context.
+   *   3. set all relevant codec context fields (derived from the decoder, and
+   *      scaled down while the recorder is overloaded). In
+   *      RGB mode the encoder takes the captured picture format as-is, and
+   *      opening fails if the codec cannot accept it.
+   *   4. creates a video stream for the output format context
+   *   5. writes the file header to the output format context.
+   */
+  int open_output(const std::string& url) {
+    bool udp = sender && url == sender_url;
+    header_written = false;
+    output_avfc = udp
+      ? FormatContext::open_output_io("mpegts", sender.get(), &PacedSender::write, PacedSender::datagram_size)
+      : FormatContext::open_output(url);
+    if (!output_avfc.get()) {
+      return fail("Failed to open the output format");
+    }
+
+    if (open_encoder() < 0) {
+      return -1;
+    }
+
+    stream_idx = output_avfc.create_stream(output_avcc);
+    if (stream_idx < 0) {
+      return fail("Failed to create new output stream");
+    }
+
+    // Fragmented MP4 never seeks back to patch the header, so a reader can
+    // follow the file while it is written.
+    AVDictionary* header_options = NULL;
+    if (options.fragmented) {
+      av_dict_set(&header_options, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+    }
+    int res = avformat_write_header(output_avfc.get(), &header_options);
+    av_dict_free(&header_options);
+    if (res < 0) {
+      return fail("Failed to write output headers");
+    }
+    header_written = true;
+    segment_url = url;
+
+    if (udp && start_sender() < 0) {
+      return fail("Failed to start the UDP output");
+    }
+    if (options.activity && !udp && activity_log.open(ActivityLog::path_of(url), timebase) < 0) {
+      return fail("Failed to open the activity log");
+    }
+
+    output_pos = 0;
+    frames = 0;
+    last_keyframe = 0;
+    detector.invalidate();
+    return 0;
+  }
+
+  /** Allocate, configure and open the encoder at the current encode
+   *  resolution.
+   */
+  int open_encoder() {
+    if (output_avcc.get()) {
+      usage.sample();
+    }
+    output_avcc = EncoderContext::alloc_context_by_name(options.codec);
+    if (!output_avcc.get()) {
+      return fail("Failed to allocate the output codec context");
+    }
+
+    // A 4:0:0 picture has two thirds of the samples of a 4:2:0 one, and the
+    // rate targets shrink with it. libx264 codes it in the High profile.
+    double share = options.gray ? 2.0 / 3 : 1;
+
+    av_opt_set(output_avcc->priv_data, "preset", options.preset.c_str(), 0);
+    output_avcc->pix_fmt             = options.rgb ? input_pix_fmt : options.gray ? AV_PIX_FMT_GRAY8 : AV_PIX_FMT_YUV420P;
+    output_avcc->height              = encode_height();
+    output_avcc->width               = encode_width();
+    output_avcc->sample_aspect_ratio = sample_aspect_ratio;
+    output_avcc->bit_rate            = 2 * 1000 * 1000 * share;
+    output_avcc->rc_buffer_size      = 4 * 1000 * 1000 * share;
+    output_avcc->rc_max_rate         = 2 * 1000 * 1000 * share;
+    output_avcc->rc_min_rate         = 2.5 * 1000 * 1000 * share;
+    output_avcc->time_base           = timebase;
+
+    // Keyframes follow the content instead: long GOPs, no scene-cut
+    // detection, and forced keyframes coded as IDRs so they are seek points.
+    if (options.keyframe_ratio > 0) {
+      output_avcc->gop_size = options.max_gop * options.fps;
+      av_opt_set_int(output_avcc->priv_data, "forced-idr", 1, 0);
+      av_opt_set(output_avcc->priv_data, "x264-params", "scenecut=0", 0);
+      av_opt_set(output_avcc->priv_data, "x265-params", "scenecut=0", 0);
+    }
+
+    if (output_avcc.open() < 0) {
+      return fail("Failed to open the output codec context");
+    }
+    if (shadow) {
+      shadow->configure(output_avcc.get());
+    }
+    return 0;
+  }
+
+  /** Start pacing UDP output, at a rate derived from the encoder's rate
+   *  control unless one was given.
+   *
+   * The encoder's VBV model promises that its output, drained at the peak
+   * rate, never backs up by more than the VBV buffer; the overhead covers
+   * TS and PES headers on top of that. The queue may hold twice the buffer
+   * before datagrams are dropped.
+   */
+  int start_sender() {
+    int64_t peak = std::max(output_avcc->rc_max_rate, output_avcc->bit_rate);
+    int64_t rate = options.pacing.rate > 0 ? options.pacing.rate : std::llrint(peak * options.pacing.overhead);
+    int64_t max_queue = options.pacing.max_queue > 0
+      ? options.pacing.max_queue
+      : 2 * (int64_t)output_avcc->rc_buffer_size / 8;
+    return sender->start(rate, options.pacing.burst, max_queue);
+  }
+
+  /** Flush the encoder into the current segment and finish it. An output
+   *  that failed to open before its header was written is only freed.
+   */
+  int close_output() {
+    if (!output_avfc.get()) {
+      return 0;
+    }
+    if (!header_written) {
+      output_avcc = EncoderContext(NULL, [](AVCodecContext*) {});
+      output_avfc = FormatContext(NULL, [](AVFormatContext*) {});
+      return 0;
+    }
+    header_written = false;
+
+    // A UDP resolution change that failed to reopen the encoder leaves none.
+    int res = 0;
+    if (output_avcc.get()) {
+      auto flush = Frame(NULL, [](AVFrame*) {});
+      res = output_avcc.send_frame(flush, encode_callback());
+    }
+
+    if (av_write_trailer(output_avfc.get()) < 0 && res >= 0) {
+      res = fail("Failed to write output trailer");
+    }
+    count_output();
+
+    // The encoder's threads exit with it; count their time first.
+    usage.sample();
+    output_avcc = EncoderContext(NULL, [](AVCodecContext*) {});
+    output_avfc = FormatContext(NULL, [](AVFormatContext*) {});
+    activity_log.close();
+
+    std::vector<std::function<void(const std::string&)>> callbacks;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      callbacks = segment_callbacks;
+    }
+    for (auto& fn : callbacks) {
+      fn(segment_url);
+    }
+    return res;
+  }
+
+  /** Finish the current segment and open the requested one.
+   */
+  int rotate_output() {
+    std::string url;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      url = rotate_url;
+    }
+
+    int res = close_output();
+    if (res >= 0) {
+      res = open_output(url);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    rotate_promise.set_value(res < 0 ? res : 0);
+    rotate_pending = false;
+    return res;
+  }
+
+  /** Run it!
+   *
+   * Read from the capture source, frame by frame, until either `stop` is
+   * called or the pipeline hits a runtime error. The native and VNC sources
+   * are paced by us; x11grab paces itself.
+   */
+  int loop() {
+    if (capture) {
+      auto interval = std::chrono::microseconds(1000000 / options.fps);
+      auto next = std::chrono::steady_clock::now();
+
+      while (!stopping) {
+        if (rotate_pending && rotate_output() < 0) {
+          return -1;
+        }
+        if (resize_step != adapt_step && resize_output() < 0) {
+          return -1;
+        }
+
+        auto busy = std::chrono::steady_clock::now();
+        if (capture->grab() < 0) {
+          return fail("Failed to grab from the capture source");
+        }
+        begin_trace(busy);
+        current.grab_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - busy).count();
+
+        if (int res = process(capture->get_frame()); res < 0) {
+          return res;
+        }
+        account(busy);
+
+        // Falling behind skips whole intervals; those are dropped frames.
+        next += interval;
+        auto now = std::chrono::steady_clock::now();
+        if (next < now) {
+          missed += (now - next) / interval;
+          next = now;
+        }
+        std::this_thread::sleep_until(next);
+      }
+      return 0;
+    }
+
+    Packet packet = Packet::alloc();
+    if (!packet) {
+      return fail("Failed to allocate a decoder packet");
+    }
+
+    std::function<int(Frame frame)> decode_callback = [&](Frame frame) {
+      return process(frame);
+    };
+
+    while (!stopping) {
+      if (rotate_pending && rotate_output() < 0) {
+        return -1;
+      }
+      if (resize_step != adapt_step && resize_output() < 0) {
+        return -1;
+      }
+
+      if (av_read_frame(input_avfc.get(), packet.get()) < 0) {
+        break;
+      }
+      CopyAudit::add(CopyAudit::fetch, packet->size);
+      auto busy = std::chrono::steady_clock::now();
+
+      // x11grab drops frames it can't deliver in time; they show up as gaps
+      // in the timestamps.
+      if (packet->pts != AV_NOPTS_VALUE) {
+        if (last_pts != AV_NOPTS_VALUE) {
+          AVRational tb = input_avfc->streams[packet->stream_index]->time_base;
+          int64_t gap = std::llrint((packet->pts - last_pts) * av_q2d(tb) * options.fps);
+          missed += std::max<int64_t>(gap - 1, 0);
+        }
+        last_pts = packet->pts;
+      }
+      begin_trace(busy);
+
+      // x11grab packets are raw pictures; wrap them rather than decoding.
+      int res;
+      if (options.rgb) {
+        auto frame = Frame::wrap_packet(packet, width, height, input_pix_fmt);
+        if (!frame) {
+          return fail("Failed to wrap the captured packet");
+        }
+        res = process(frame);
+      } else {
+        res = input_avcc.send_packet(packet, decode_callback);
+      }
+      av_packet_unref(packet.get());
+
+      if (res < 0) {
+        return res;
+      }
+      account(busy);
+    }
+    return 0;
+  }
+
+  /** Fold one frame's busy time into the smoothed load.
+   *
+   * @param busy when work on the frame started
+   */
+  void account(std::chrono::steady_clock::time_point busy) {
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - busy).count();
+    double alpha = 1.0 / options.fps;
+    double smoothed = load.load(std::memory_order_relaxed);
+    load.store(smoothed + alpha * (seconds * options.fps - smoothed), std::memory_order_relaxed);
+    end_trace(busy);
+    adapt();
+
+    auto now = std::chrono::steady_clock::now();
+    if (now - usage_sampled >= std::chrono::seconds(1)) {
+      usage.sample();
+      usage_sampled = now;
+    }
+  }
+
+  /** Step the encode resolution down once the load has stayed above
+   *  `overload` for `down_after` seconds, and back up once it has stayed
+   *  below `headroom` for `up_after`.
+   *
+   * The gap between the thresholds, and the longer wait to step up, keep a
+   * recorder near the edge from flapping between resolutions. Both clocks
+   * restart after a change, once the load reflects the new resolution.
+   */
+  void adapt() {
+    const AdaptOptions& a = options.adapt;
+    if (!a.enabled || resize_step != adapt_step) {
+      return;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    double l = get_load();
+    if (l <= a.overload || adapt_step >= a.max_steps) {
+      overload_since = now;
+    }
+    if (l >= a.headroom || adapt_step == 0) {
+      headroom_since = now;
+    }
+
+    if (now - overload_since >= std::chrono::duration<double>(a.down_after)) {
+      resize_step = adapt_step + 1;
+    } else if (now - headroom_since >= std::chrono::duration<double>(a.up_after)) {
+      resize_step = adapt_step - 1;
+    }
+  }
+
+  /** The encode width and height at the current step, kept even for 4:2:0.
+   */
+  int encode_width() const {
+    return std::max((int)(width * get_encode_scale()) & ~1, 2);
+  }
+
+  int encode_height() const {
+    return std::max((int)(height * get_encode_scale()) & ~1, 2);
+  }
+
+  /** Change the encode resolution to the requested step.
+   *
+   * The encoder is flushed and reopened at the new size. A file can't change
+   * resolution partway, so it is finished and a new segment opened, as in a
+   * rotation. MPEG-TS over UDP carries the new parameter sets in-band, so the
+   * stream goes on and a player picks up the change at the first keyframe.
+   */
+  int resize_output() {
+    adapt_step = resize_step;
+    resizes++;
+    overload_since = headroom_since = std::chrono::steady_clock::now();
+
+    std::function<std::string(int, int)> callback;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      callback = resize_callback;
+    }
+    std::string url = callback
+      ? callback(encode_width(), encode_height())
+      : resized_url(options.url, resizes, encode_width(), encode_height());
+
+    if (sender && segment_url == sender_url) {
+      auto flush = Frame(NULL, [](AVFrame*) {});
+      if (output_avcc.send_frame(flush, encode_callback()) < 0) {
+        return fail("Failed to flush the encoder for a resolution change");
+      }
+      if (open_encoder() < 0) {
+        return -1;
+      }
+      if (avcodec_parameters_from_context(output_avfc->streams[stream_idx]->codecpar, output_avcc.get()) < 0) {
+        return fail("Failed to update the stream for a resolution change");
+      }
+      // Timestamps carry on; the new encoder's first DTS sits up to its
+      // reorder delay before its first PTS, so leave that gap.
+      frames += std::max(output_avcc->max_b_frames, 0) + 1;
+      last_keyframe = frames;
+      detector.invalidate();
+      return 0;
+    }
+
+    int res = close_output();
+    if (res >= 0) {
+      res = open_output(url);
+    }
+    return res;
+  }
+
+  /** The default name of the segment a resolution change starts: out.mp4
+   *  becomes out-r1-1440x810.mp4.
+   */
+  static std::string resized_url(const std::string& url, int n, int w, int h) {
+    size_t dot = url.rfind('.');
+    size_t slash = url.rfind('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+      dot = url.size();
+    }
+    return url.substr(0, dot) + "-r" + std::to_string(n) + "-" +
+           std::to_string(w) + "x" + std::to_string(h) + url.substr(dot);
+  }
+
+  /** Start the trace of a new frame.
+   */
+  void begin_trace(std::chrono::steady_clock::time_point busy) {
+    current = FrameTrace();
+    current.time = std::chrono::duration<double>(busy - trace_start).count();
+    current.dropped = missed;
+    missed = 0;
+  }
+
+  /** Finish the frame's trace and, once a second, check the SLOs over the
+   *  window; on a breach, hand a snapshot to the diagnostics writer.
+   *
+   * Only the check and, rarely, a copy of the window run here; everything
+   * else happens on the writer's idle-priority thread.
+   */
+  void end_trace(std::chrono::steady_clock::time_point busy) {
+    if (!diagnostics) {
+      return;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    current.total_ms = std::chrono::duration<float, std::milli>(now - busy).count();
+    current.in_flight = frames_sent - packets_received;
+    traces.add(current);
+
+    if (now - last_check < std::chrono::seconds(1)) {
+      return;
+    }
+    last_check = now;
+
+    std::string reason;
+    if (!traces.breached(reason)) {
+      return;
+    }
+    slo_breaches++;
+    if (!diagnostics->ready()) {
+      return;
+    }
+
+    auto snapshot = std::make_unique<Snapshot>();
+    snapshot->reason = reason;
+    snapshot->frames.assign(traces.get_frames().begin(), traces.get_frames().end());
+    snapshot->histograms = traces.get_histograms();
+    snapshot->tid = tid;
+    snapshot->states.emplace_back("encoder", std::to_string(current.in_flight) + " frames in flight");
+    snapshot->states.emplace_back("load", std::to_string(get_load()));
+    snapshot->states.emplace_back("encode", std::to_string(encode_width()) + "x" + std::to_string(encode_height()));
+    if (sender) {
+      snapshot->states.emplace_back("udp", std::to_string(sender->get_queued_bytes()) + " bytes queued, " +
+                                    std::to_string(sender->get_pacing_error() * 1e6) + " us mean pacing error, " +
+                                    std::to_string(sender->get_dropped()) + " datagrams dropped");
+    }
+
+    std::vector<std::pair<std::string, std::function<std::string()>>> callbacks;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      callbacks = states;
+    }
+    for (auto& state : callbacks) {
+      snapshot->states.emplace_back(state.first, state.second());
+    }
+    diagnostics->submit(std::move(snapshot));
+  }
+
+  /** Hand a captured frame to the taps, then convert and encode it.
+   *
+   * When skipping idle frames, frames without a significant change are
+   * dropped here; their timestamps are still consumed, so the output simply
+   * holds the previous picture for longer.
+   *
+   * The frame is scaled to set the picture's strobe and sent to the encoder.
+   * In RGB mode the frame is sent as-is, and in gray mode only its luma is
+   * extracted. Incrementally, only the tiles the detector found dirty, and
+   * the strips its scrolls exposed, are converted, in the same pass as
+   * detection.
+   */
+  int process(Frame& frame) {
+    auto start = std::chrono::steady_clock::now();
+    if (int res = run_taps(frame, frame_taps); res < 0) {
+      return res;
+    }
+
+    // Incremental conversion keeps a full-size picture, so it is set aside
+    // while encoding smaller; the detector runs on its own instead.
+    bool incremental = options.incremental && !options.rgb && adapt_step == 0;
+    bool keyframe = false;
+    if (options.skip_idle || incremental || options.keyframe_ratio > 0 || activity_log.is_open()) {
+      auto damage = capture ? &capture->damaged() : NULL;
+      int dirty = incremental
+        ? converter.update(frame, detector, damage)
+        : detector.detect(frame, damage);
+      if (dirty < 0) {
+        return fail("Failed to run change detection");
+      }
+      current.dirty = dirty;
+      activity_log.add(frames, detector);
+      if (options.skip_idle && dirty == 0 && detector.scrolled().empty()) {
+        current.skipped = true;
+        current.convert_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+        frames++;
+        return 0;
+      }
+      keyframe = place_keyframe();
+    }
+
+    if (options.rgb && adapt_step == 0) {
+      frame->pts = frames++;
+      frame->pkt_dts = frame->pts;
+
+      return encode(frame, keyframe, start);
+    }
+
+    auto scale_frame = incremental
+      ? converter.get_frame()
+      : options.gray && adapt_step == 0
+      ? LumaKernel::convert(frame)
+      : frame.scale(encode_width(), encode_height(), output_avcc->pix_fmt);
+    if (!scale_frame) {
+      return fail("Failed to convert the captured frame");
+    }
+    scale_frame->pts = frames++;
+    scale_frame->pkt_dts = scale_frame->pts;
+
+    return encode(scale_frame, keyframe, start);
+  }
+
+  /** Send a converted frame to the encoder, timing the conversion that
+   *  came before and the encode itself.
+   */
+  int encode(Frame& frame, bool keyframe, std::chrono::steady_clock::time_point start) {
+    auto converted = std::chrono::steady_clock::now();
+    current.convert_ms = std::chrono::duration<float, std::milli>(converted - start).count();
+    current.keyframe = keyframe;
+
+    frames_sent++;
+    int res = output_avcc.send_frame(frame, encode_callback(), keyframe);
+    current.encode_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - converted).count();
+    if (shadow && res >= 0) {
+      shadow->tap(frame);
+    }
+    return res;
+  }
+
+  /** Whether the frame just run through change detection should be an IDR.
+   *
+   * An app switch or page load changes most of the screen in one frame; that
+   * frame is mostly intra-coded anyway, so making it an IDR costs next to
+   * nothing and puts a seek point where the content changed. Only the rising
+   * edge counts, and forced IDRs are at least `min_gop` apart, so sustained
+   * motion such as a scroll the detector could not follow doesn't produce a
+   * run of them.
+   */
+  bool place_keyframe() {
+    if (options.keyframe_ratio <= 0) {
+      return false;
+    }
+
+    double ratio = detector.dirty_ratio();
+    bool rising = ratio >= options.keyframe_ratio && last_ratio < options.keyframe_ratio;
+    last_ratio = ratio;
+
+    if (!rising || frames - last_keyframe < options.min_gop * options.fps) {
+      return false;
+    }
+    last_keyframe = frames;
+    keyframes++;
+    return true;
+  }
+
+  /** The callback passed the encoded packet, which it hands to the packet
+   *  taps and writes to the output format context.
+   *
+   * Frame timestamps count frame intervals in the encoder's time base; the
+   * muxer rescales them to the stream's.
+   */
+  std::function<int(Packet)> encode_callback() {
+    return [this](Packet packet) {
+      packet->stream_index = stream_idx;
+      packets_received++;
+      current.bytes += packet->size;
+      usage.add_frame();
+
+      if (int res = run_taps(packet, packet_taps); res < 0) {
+        return res;
+      }
+
+      int res = output_avfc.write_packet(packet, output_avcc->time_base);
+      count_output();
+      return res;
+    };
+  }
+
+  /** Count what the muxer has written to the output since last asked,
+   *  container overhead included.
+   */
+  void count_output() {
+    int64_t pos = avio_tell(output_avfc->pb);
+    if (pos > output_pos) {
+      usage.add_bytes(pos - output_pos);
+      output_pos = pos;
+    }
+  }
+
+  template <typename T>
+  int run_taps(const T& object, const std::vector<std::function<int(T)>>& taps) {
+    std::lock_guard<std::mutex> lock(taps_mutex);
+    if (taps.empty()) {
+      return 0;
+    }
+    return object.fan_out(taps);
+  }
+
+  int fail(const std::string& message) {
+    std::lock_guard<std::mutex> lock(mutex);
+    error = message;
+    return -1;
+  }
+
+  RecorderOptions options;
+
+  std::unique_ptr<CaptureSource> capture;
+  ChangeDetector detector;
+  IncrementalConverter converter;
+  FormatContext input_avfc = FormatContext(NULL, [](AVFormatContext*) {});
+  DecoderContext input_avcc = DecoderContext(NULL, [](AVCodecContext*) {});
+  FormatContext output_avfc = FormatContext(NULL, [](AVFormatContext*) {});
+  EncoderContext output_avcc = EncoderContext(NULL, [](AVCodecContext*) {});
+
+  int width = 0;
+  int height = 0;
+  AVRational sample_aspect_ratio = {0, 1};
+  AVRational timebase = {0, 1};
+  AVPixelFormat input_pix_fmt = AV_PIX_FMT_NONE;
+  int stream_idx = -1;
+  bool header_written = false;  ///< whether the output needs a flush and trailer
+  int frames = 0;
+  int last_keyframe = 0;
+  double last_ratio = 0;
+  std::atomic<int> keyframes{0};
+
+  std::atomic<int> adapt_step{0};
+  int resize_step = 0;
+  std::atomic<int> resizes{0};
+  std::chrono::steady_clock::time_point overload_since;
+  std::chrono::steady_clock::time_point headroom_since;
+  std::function<std::string(int, int)> resize_callback;
+
+  std::unique_ptr<DiagnosticsWriter> diagnostics;
+  TraceWindow traces;
+  FrameTrace current;
+  std::chrono::steady_clock::time_point trace_start;
+  std::chrono::steady_clock::time_point last_check;
+  int64_t last_pts = AV_NOPTS_VALUE;
+  int missed = 0;
+  int64_t frames_sent = 0;
+  int64_t packets_received = 0;
+  pid_t tid = 0;
+  std::atomic<int> slo_breaches{0};
+  std::vector<std::pair<std::string, std::function<std::string()>>> states;
+  std::unique_ptr<PacedSender> sender;
+  std::string sender_url;
+  std::unique_ptr<ShadowEncoder> shadow;
+  ActivityLog activity_log;
+  UsageMeter usage;
+  std::chrono::steady_clock::time_point usage_sampled;
+  int64_t output_pos = 0;
+  std::string segment_url;
+
+  std::thread thread;
+  std::mutex mutex;
+  std::mutex taps_mutex;
+  std::atomic<bool> running{false};
+  std::atomic<bool> stopping{false};
+  std::atomic<double> load{0};
+  std::promise<int> stop_promise;
+  std::shared_future<int> stop_future;
+
+  std::atomic<bool> rotate_pending{false};
+  std::string rotate_url;
+  std::promise<int> rotate_promise;
+
+  std::vector<std::function<int(Frame)>> frame_taps;
+  std::vector<std::function<int(Packet)>> packet_taps;
+  std::vector<std::function<void(const std::string&)>> segment_callbacks;
+  std::string error;
+};
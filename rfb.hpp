@@ -0,0 +1,994 @@
+// rfb.hpp -*- c++ -*-
+
+/*
+ * MIT License
+ *
+ * Copyright (c) 2022 Walker Griggs
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <zlib.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#include <libavutil/des.h>
+#include <libavutil/mem.h>
+}
+#endif
+
+#include "libav.hpp"
+#include "capture.hpp"
+
+/** A capture source that reads a remote screen over RFB, the VNC protocol.
+ *
+ * RfbCapture asks the server for 32-bit BGR0 pixels and keeps one incremental
+ * framebuffer update request outstanding. The server only answers once part
+ * of the screen changed, so an idle screen costs nothing but a poll. Raw,
+ * CopyRect, ZRLE and Tight rectangles are decoded straight into a persistent
+ * frame and the server's update rectangles are reported as the damage.
+ *
+ * Tight's JPEG subencoding is never requested, so the picture is lossless.
+ * Security types None and VNC authentication are supported.
+ *
+ * The persistent frame is updated in place; consumers that hold on to it
+ * across calls to `grab` must take their own reference or copy.
+ */
+class RfbCapture : public CaptureSource {
+public:
+  /** The default port, to which a display number is added.
+   */
+  static constexpr int base_port = 5900;
+
+  /** Seconds a blocking read may stall before the server is considered gone.
+   */
+  static constexpr int read_timeout = 10;
+
+  RfbCapture() = default;
+  RfbCapture(const RfbCapture&) = delete;
+  RfbCapture& operator=(const RfbCapture&) = delete;
+
+  ~RfbCapture() override {
+    close();
+  }
+
+  /** Connects to the server, authenticates and sets the pixel format and
+   *  encodings.
+   *
+   * @param address  the server, as host, host:display or host::port
+   * @param password the VNC password, empty if the server needs none
+   *
+   * @return Zero on success, a negative value on error.
+   */
+  int open(const std::string& address, const std::string& password = "") {
+    if (connect_to(address) < 0 || handshake(password) < 0) {
+      close();
+      return -1;
+    }
+
+    for (auto& zs : streams) {
+      if (inflateInit(&zs) != Z_OK) {
+        close();
+        return -1;
+      }
+    }
+    streams_open = true;
+
+    frame = Frame::alloc(width, height, AV_PIX_FMT_BGR0);
+    if (!frame) {
+      close();
+      return -1;
+    }
+
+    full_refresh = true;
+    return 0;
+  }
+
+  /** Closes the connection and releases the decompression state.
+   */
+  void close() override {
+    if (streams_open) {
+      for (auto& zs : streams) {
+        inflateEnd(&zs);
+      }
+      streams_open = false;
+    }
+
+    if (fd >= 0) {
+      ::close(fd);
+      fd = -1;
+    }
+    in_pos = in_len = 0;
+  }
+
+  /** Applies the updates the server has sent to the persistent frame.
+   *
+   * This never waits for the screen to change: if no update has arrived, no
+   * rectangles are reported. The first call after `open` or `invalidate`
+   * requests the whole screen and waits for it.
+   *
+   * @return The number of updated rectangles on success, a negative value on
+   *         error.
+   */
+  int grab() override {
+    rects.clear();
+
+    // An encoder may still hold the last frame; copy it out from under them
+    // rather than overwrite a picture that is in flight.
+    if (frame.make_writable() < 0) {
+      return -1;
+    }
+
+    bool wait = full_refresh;
+    if (full_refresh && request_update(false) < 0) {
+      return -1;
+    }
+
+    while (wait || readable()) {
+      int res = read_message();
+      if (res < 0) {
+        return -1;
+      }
+
+      // Answered; ask for the next change straight away so the server can
+      // prepare it while we encode this one.
+      if (res > 0) {
+        wait = false;
+        if (request_update(true) < 0) {
+          return -1;
+        }
+      }
+    }
+
+    if (full_refresh) {
+      rects.assign(1, Rect{0, 0, width, height});
+      full_refresh = false;
+    }
+    return rects.size();
+  }
+
+  /** Forces the next call to `grab` to request the whole screen.
+   */
+  void invalidate() override {
+    full_refresh = true;
+  }
+
+  /** The persistent, full-screen BGR0 frame.
+   */
+  Frame& get_frame() override {
+    return frame;
+  }
+
+  /** The rectangles the server updated, as of the last call to `grab`.
+   */
+  const std::vector<Rect>& damaged() const override {
+    return rects;
+  }
+
+  int get_width() const override {
+    return width;
+  }
+
+  int get_height() const override {
+    return height;
+  }
+
+  /** The desktop name the server announced.
+   */
+  const std::string& get_name() const {
+    return name;
+  }
+
+private:
+  enum Encoding {
+    encoding_raw = 0,
+    encoding_copyrect = 1,
+    encoding_tight = 7,
+    encoding_zrle = 16,
+  };
+
+  enum Security {
+    security_invalid = 0,
+    security_none = 1,
+    security_vnc = 2,
+  };
+
+  /** ZRLE's single stream, then Tight's four.
+   */
+  static constexpr int zrle_stream = 0;
+  static constexpr int tight_streams = 1;
+
+  /** Resolve the address and open a TCP connection to it.
+   */
+  int connect_to(const std::string& address) {
+    std::string host = address;
+    int port = base_port;
+
+    size_t colon = address.find(':');
+    if (colon != std::string::npos) {
+      host = address.substr(0, colon);
+      if (address.compare(colon, 2, "::") == 0) {
+        port = atoi(address.c_str() + colon + 2);
+      } else {
+        port = base_port + atoi(address.c_str() + colon + 1);
+      }
+    }
+    if (host.empty()) {
+      host = "localhost";
+    }
+
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo* res = NULL;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res) != 0) {
+      return -1;
+    }
+
+    for (auto ai = res; ai; ai = ai->ai_next) {
+      fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if (fd < 0) {
+        continue;
+      }
+      if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+        break;
+      }
+      ::close(fd);
+      fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd < 0) {
+      return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct timeval tv = {read_timeout, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return 0;
+  }
+
+  /** Negotiate the protocol version and security, then exchange the init
+   *  messages and configure the pixel format and encodings.
+   */
+  int handshake(const std::string& password) {
+    char version[13] = {};
+    int major, minor;
+    if (read_bytes(version, 12) < 0 ||
+        sscanf(version, "RFB %03d.%03d\n", &major, &minor) != 2 || major != 3) {
+      return -1;
+    }
+
+    minor = minor >= 8 ? 8 : minor == 7 ? 7 : 3;
+    snprintf(version, sizeof(version), "RFB 003.%03d\n", minor);
+    if (write_bytes(version, 12) < 0) {
+      return -1;
+    }
+
+    // 3.3 servers dictate the security type, later ones offer a list.
+    uint32_t security = security_invalid;
+    if (minor == 3) {
+      if (read_u32(security) < 0) {
+        return -1;
+      }
+    } else {
+      uint8_t n;
+      if (read_bytes(&n, 1) < 0) {
+        return -1;
+      }
+      std::vector<uint8_t> types(n);
+      if (read_bytes(types.data(), n) < 0) {
+        return -1;
+      }
+      for (uint8_t type : types) {
+        if (type == security_none ||
+            (type == security_vnc && !password.empty() && security != security_none)) {
+          security = type;
+        }
+      }
+      if (security == security_invalid) {
+        return -1;
+      }
+      uint8_t choice = security;
+      if (write_bytes(&choice, 1) < 0) {
+        return -1;
+      }
+    }
+
+    if (security == security_vnc) {
+      if (authenticate(password) < 0) {
+        return -1;
+      }
+    } else if (security != security_none) {
+      return -1;
+    }
+
+    // 3.8 reports the result even for None.
+    if (security == security_vnc || minor == 8) {
+      uint32_t result;
+      if (read_u32(result) < 0 || result != 0) {
+        return -1;
+      }
+    }
+
+    // ClientInit: share the desktop with other viewers.
+    uint8_t shared = 1;
+    if (write_bytes(&shared, 1) < 0) {
+      return -1;
+    }
+
+    // ServerInit: the geometry, the server's pixel format, which we replace,
+    // and the desktop name.
+    uint8_t init[24];
+    if (read_bytes(init, sizeof(init)) < 0) {
+      return -1;
+    }
+    width = u16(init);
+    height = u16(init + 2);
+    uint32_t name_len = u32(init + 20);
+    name.resize(name_len);
+    if (read_bytes(&name[0], name_len) < 0 || width <= 0 || height <= 0) {
+      return -1;
+    }
+
+    // SetPixelFormat: 32 bits per pixel, little-endian 0x00RRGGBB, which is
+    // BGR0 in memory.
+    const uint8_t pixel_format[20] = {
+      0, 0, 0, 0,
+      32, 24, 0, 1, 0, 255, 0, 255, 0, 255, 16, 8, 0, 0, 0, 0,
+    };
+    if (write_bytes(pixel_format, sizeof(pixel_format)) < 0) {
+      return -1;
+    }
+
+    // SetEncodings, in order of preference.
+    const int32_t encodings[] = {encoding_tight, encoding_zrle, encoding_copyrect, encoding_raw};
+    const int nb_encodings = sizeof(encodings) / sizeof(encodings[0]);
+    uint8_t msg[4 + 4 * nb_encodings] = {2, 0, 0, nb_encodings};
+    for (int i = 0; i < nb_encodings; i++) {
+      put_u32(msg + 4 + 4 * i, encodings[i]);
+    }
+    return write_bytes(msg, sizeof(msg));
+  }
+
+  /** Answer the VNC authentication challenge: DES-encrypt it keyed with the
+   *  password, each key byte bit-reversed as the protocol requires.
+   */
+  int authenticate(const std::string& password) {
+    uint8_t challenge[16], response[16], key[8] = {};
+    if (read_bytes(challenge, sizeof(challenge)) < 0) {
+      return -1;
+    }
+
+    for (size_t i = 0; i < 8 && i < password.size(); i++) {
+      uint8_t c = password[i], r = 0;
+      for (int b = 0; b < 8; b++) {
+        r |= ((c >> b) & 1) << (7 - b);
+      }
+      key[i] = r;
+    }
+
+    struct AVDES* des = av_des_alloc();
+    if (!des || av_des_init(des, key, 64, 0) < 0) {
+      av_free(des);
+      return -1;
+    }
+    av_des_crypt(des, response, challenge, 2, NULL, 0);
+    av_free(des);
+
+    return write_bytes(response, sizeof(response));
+  }
+
+  /** Send a FramebufferUpdateRequest for the whole screen.
+   *
+   * @param incremental whether only changes are wanted
+   */
+  int request_update(bool incremental) {
+    uint8_t msg[10] = {3, (uint8_t)incremental};
+    put_u16(msg + 6, width);
+    put_u16(msg + 8, height);
+    return write_bytes(msg, sizeof(msg));
+  }
+
+  /** Read and handle one server message.
+   *
+   * @return One if it was a framebuffer update, zero if it was another
+   *         message, a negative value on error.
+   */
+  int read_message() {
+    uint8_t type;
+    if (read_bytes(&type, 1) < 0) {
+      return -1;
+    }
+
+    uint8_t header[7];
+    switch (type) {
+    case 0: {  // FramebufferUpdate
+      if (read_bytes(header, 3) < 0) {
+        return -1;
+      }
+      int n = u16(header + 1);
+      for (int i = 0; i < n; i++) {
+        if (read_rect() < 0) {
+          return -1;
+        }
+      }
+      return 1;
+    }
+    case 1:  // SetColourMapEntries; never used with a true-colour format
+      if (read_bytes(header, 5) < 0) {
+        return -1;
+      }
+      return skip(6 * u16(header + 3));
+    case 2:  // Bell
+      return 0;
+    case 3:  // ServerCutText
+      if (read_bytes(header, 7) < 0) {
+        return -1;
+      }
+      return skip(u32(header + 3));
+    default:
+      return -1;
+    }
+  }
+
+  /** Read one update rectangle and decode it into the frame.
+   */
+  int read_rect() {
+    uint8_t header[12];
+    if (read_bytes(header, sizeof(header)) < 0) {
+      return -1;
+    }
+
+    Rect r{u16(header), u16(header + 2), u16(header + 4), u16(header + 6)};
+    int32_t encoding = u32(header + 8);
+    if (r.x + r.w > width || r.y + r.h > height) {
+      return -1;
+    }
+
+    int res;
+    switch (encoding) {
+    case encoding_raw:
+      res = decode_raw(r);
+      break;
+    case encoding_copyrect:
+      res = decode_copyrect(r);
+      break;
+    case encoding_zrle:
+      res = decode_zrle(r);
+      break;
+    case encoding_tight:
+      res = decode_tight(r);
+      break;
+    default:
+      return -1;
+    }
+    if (res < 0) {
+      return -1;
+    }
+
+    if (!r.empty()) {
+      rects.push_back(r);
+      CopyAudit::add(CopyAudit::capture, (int64_t)r.w * r.h * 4);
+    }
+    return 0;
+  }
+
+  /** Raw: rows of 32-bit pixels, read straight into the frame.
+   */
+  int decode_raw(const Rect& r) {
+    for (int y = r.y; y < r.y + r.h; y++) {
+      if (read_bytes(row(r.x, y), r.w * 4) < 0) {
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  /** CopyRect: move an area of the frame the client already has.
+   */
+  int decode_copyrect(const Rect& r) {
+    uint8_t src[4];
+    if (read_bytes(src, sizeof(src)) < 0) {
+      return -1;
+    }
+
+    int sx = u16(src), sy = u16(src + 2);
+    if (sx + r.w > width || sy + r.h > height) {
+      return -1;
+    }
+
+    move_rect(frame->data[0], frame->linesize[0], 4, r, sx, sy);
+    return 0;
+  }
+
+  /** ZRLE: 64x64 tiles of zlib-compressed, run-length or palette coded
+   *  3-byte pixels.
+   */
+  int decode_zrle(const Rect& r) {
+    uint32_t len;
+    if (read_u32(len) < 0) {
+      return -1;
+    }
+    compressed.resize(len);
+    if (read_bytes(compressed.data(), len) < 0 ||
+        inflate_all(streams[zrle_stream], compressed.data(), len, decompressed) < 0) {
+      return -1;
+    }
+
+    Cursor in{decompressed.data(), decompressed.data() + decompressed.size()};
+    uint32_t palette[128];
+
+    for (int ty = 0; ty < r.h; ty += 64) {
+      for (int tx = 0; tx < r.w; tx += 64) {
+        Rect t{r.x + tx, r.y + ty, std::min(64, r.w - tx), std::min(64, r.h - ty)};
+        int n = t.w * t.h;
+
+        const uint8_t* p;
+        uint8_t sub;
+        if (in.read(&sub, 1) < 0) {
+          return -1;
+        }
+
+        if (sub == 0) {  // raw
+          if (!(p = in.take(3 * n))) {
+            return -1;
+          }
+          for (int i = 0; i < n; i++, p += 3) {
+            *pixel(t, i) = cpixel(p);
+          }
+        } else if (sub == 1) {  // solid
+          if (!(p = in.take(3))) {
+            return -1;
+          }
+          fill(t, cpixel(p));
+        } else if (sub <= 16) {  // packed palette
+          if (read_palette(in, palette, sub, cpixel) < 0) {
+            return -1;
+          }
+          int bits = sub == 2 ? 1 : sub <= 4 ? 2 : 4;
+          int stride = (t.w * bits + 7) / 8;
+          if (!(p = in.take(stride * t.h))) {
+            return -1;
+          }
+          for (int y = 0; y < t.h; y++) {
+            uint32_t* dst = (uint32_t*)row(t.x, t.y + y);
+            for (int x = 0; x < t.w; x++) {
+              int shift = 8 - bits - (x * bits) % 8;
+              int idx = (p[y * stride + x * bits / 8] >> shift) & ((1 << bits) - 1);
+              if (idx >= sub) {
+                return -1;
+              }
+              dst[x] = palette[idx];
+            }
+          }
+        } else if (sub == 128) {  // plain RLE
+          for (int i = 0; i < n;) {
+            int run;
+            if (!(p = in.take(3)) || (run = in.run_length()) < 0 || i + run > n) {
+              return -1;
+            }
+            uint32_t c = cpixel(p);
+            for (int end = i + run; i < end; i++) {
+              *pixel(t, i) = c;
+            }
+          }
+        } else if (sub >= 130) {  // palette RLE
+          int size = sub - 128;
+          if (read_palette(in, palette, size, cpixel) < 0) {
+            return -1;
+          }
+          for (int i = 0; i < n;) {
+            uint8_t idx;
+            int run = 1;
+            if (in.read(&idx, 1) < 0) {
+              return -1;
+            }
+            if (idx & 128) {
+              idx &= 127;
+              run = in.run_length();
+            }
+            if (idx >= size || run < 0 || i + run > n) {
+              return -1;
+            }
+            for (int end = i + run; i < end; i++) {
+              *pixel(t, i) = palette[idx];
+            }
+          }
+        } else {
+          return -1;
+        }
+      }
+    }
+    return 0;
+  }
+
+  /** Tight: a fill colour, or rows of 3-byte pixels through a copy, palette
+   *  or gradient filter, zlib-compressed on one of four streams.
+   */
+  int decode_tight(const Rect& r) {
+    uint8_t control;
+    if (read_bytes(&control, 1) < 0) {
+      return -1;
+    }
+
+    for (int i = 0; i < 4; i++) {
+      if (control & (1 << i)) {
+        inflateReset(&streams[tight_streams + i]);
+      }
+    }
+    control >>= 4;
+
+    if (control == 8) {  // fill
+      uint8_t c[3];
+      if (read_bytes(c, sizeof(c)) < 0) {
+        return -1;
+      }
+      fill(r, tpixel(c));
+      return 0;
+    }
+
+    // JPEG (9) is only sent to clients that ask for a quality level.
+    if (control > 8) {
+      return -1;
+    }
+
+    uint8_t filter = 0;
+    if ((control & 4) && read_bytes(&filter, 1) < 0) {
+      return -1;
+    }
+
+    uint32_t palette[256];
+    int colors = 0;
+    size_t stride = (size_t)r.w * 3;
+    if (filter == 1) {
+      uint8_t n;
+      if (read_bytes(&n, 1) < 0) {
+        return -1;
+      }
+      colors = n + 1;
+      uint8_t entries[256 * 3];
+      if (read_bytes(entries, 3 * colors) < 0) {
+        return -1;
+      }
+      for (int i = 0; i < colors; i++) {
+        palette[i] = tpixel(entries + 3 * i);
+      }
+      stride = colors == 2 ? (r.w + 7) / 8 : r.w;
+    } else if (filter > 2) {
+      return -1;
+    }
+
+    // Payloads under 12 bytes are sent uncompressed.
+    size_t size = stride * r.h;
+    decompressed.resize(size);
+    if (size < 12) {
+      if (read_bytes(decompressed.data(), size) < 0) {
+        return -1;
+      }
+    } else {
+      uint32_t len = 0;
+      for (int i = 0; i < 3; i++) {
+        uint8_t b;
+        if (read_bytes(&b, 1) < 0) {
+          return -1;
+        }
+        len |= (b & (i < 2 ? 0x7F : 0xFF)) << (7 * i);
+        if (!(b & 0x80)) {
+          break;
+        }
+      }
+      compressed.resize(len);
+      if (read_bytes(compressed.data(), len) < 0 ||
+          inflate_exact(streams[tight_streams + (control & 3)], compressed.data(), len,
+                        decompressed.data(), size) < 0) {
+        return -1;
+      }
+    }
+
+    const uint8_t* p = decompressed.data();
+    for (int y = 0; y < r.h; y++, p += stride) {
+      uint32_t* dst = (uint32_t*)row(r.x, r.y + y);
+
+      if (filter == 1) {
+        for (int x = 0; x < r.w; x++) {
+          int idx = colors == 2 ? (p[x / 8] >> (7 - x % 8)) & 1 : p[x];
+          if (idx >= colors) {
+            return -1;
+          }
+          dst[x] = palette[idx];
+        }
+      } else if (filter == 2) {
+        // Each component is coded as the error of a gradient prediction from
+        // the left, upper and upper-left pixels, already decoded in place.
+        const uint8_t* up = y > 0 ? (const uint8_t*)row(r.x, r.y + y - 1) : NULL;
+        uint8_t* out = (uint8_t*)dst;
+        for (int x = 0; x < r.w; x++) {
+          for (int c = 0; c < 3; c++) {
+            // TPIXELs are R, G, B; BGR0 puts red at offset 2.
+            int o = 2 - c;
+            int left = x > 0 ? out[4 * (x - 1) + o] : 0;
+            int above = up ? up[4 * x + o] : 0;
+            int corner = up && x > 0 ? up[4 * (x - 1) + o] : 0;
+            int predicted = std::max(0, std::min(255, left + above - corner));
+            out[4 * x + o] = p[3 * x + c] + predicted;
+          }
+          out[4 * x + 3] = 0;
+        }
+      } else {
+        for (int x = 0; x < r.w; x++) {
+          dst[x] = tpixel(p + 3 * x);
+        }
+      }
+    }
+    return 0;
+  }
+
+  /** A bounds-checked reader over decompressed data.
+   */
+  struct Cursor {
+    const uint8_t* p;
+    const uint8_t* end;
+
+    const uint8_t* take(size_t n) {
+      if ((size_t)(end - p) < n) {
+        return NULL;
+      }
+      const uint8_t* q = p;
+      p += n;
+      return q;
+    }
+
+    int read(uint8_t* dst, size_t n) {
+      const uint8_t* q = take(n);
+      if (!q) {
+        return -1;
+      }
+      memcpy(dst, q, n);
+      return 0;
+    }
+
+    /** ZRLE run lengths: bytes summed while they are 255, plus one.
+     */
+    int run_length() {
+      int run = 1;
+      uint8_t b;
+      do {
+        if (read(&b, 1) < 0) {
+          return -1;
+        }
+        run += b;
+      } while (b == 255);
+      return run;
+    }
+  };
+
+  template <typename F>
+  static int read_palette(Cursor& in, uint32_t* palette, int n, F convert) {
+    const uint8_t* p = in.take(3 * n);
+    if (!p) {
+      return -1;
+    }
+    for (int i = 0; i < n; i++) {
+      palette[i] = convert(p + 3 * i);
+    }
+    return 0;
+  }
+
+  /** A ZRLE CPIXEL: the low three bytes of our pixel format, B, G, R.
+   */
+  static uint32_t cpixel(const uint8_t* p) {
+    return p[0] | p[1] << 8 | p[2] << 16;
+  }
+
+  /** A Tight TPIXEL: the components in R, G, B order.
+   */
+  static uint32_t tpixel(const uint8_t* p) {
+    return p[2] | p[1] << 8 | p[0] << 16;
+  }
+
+  uint8_t* row(int x, int y) {
+    return frame->data[0] + y * frame->linesize[0] + x * 4;
+  }
+
+  /** The nth pixel of a rectangle, in row-major order.
+   */
+  uint32_t* pixel(const Rect& r, int i) {
+    return (uint32_t*)row(r.x + i % r.w, r.y + i / r.w);
+  }
+
+  void fill(const Rect& r, uint32_t c) {
+    for (int y = r.y; y < r.y + r.h; y++) {
+      std::fill_n((uint32_t*)row(r.x, y), r.w, c);
+    }
+  }
+
+  /** Inflate a chunk of a stream whose decompressed size is not known.
+   */
+  static int inflate_all(z_stream& zs, const uint8_t* src, size_t len, std::vector<uint8_t>& dst) {
+    const size_t chunk = 64 * 1024;
+    dst.clear();
+    zs.next_in = (Bytef*)src;
+    zs.avail_in = len;
+    do {
+      size_t used = dst.size();
+      dst.resize(used + chunk);
+      zs.next_out = dst.data() + used;
+      zs.avail_out = chunk;
+      int ret = inflate(&zs, Z_SYNC_FLUSH);
+      if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        return -1;
+      }
+      dst.resize(used + chunk - zs.avail_out);
+    } while (zs.avail_out == 0);
+    return zs.avail_in == 0 ? 0 : -1;
+  }
+
+  /** Inflate a chunk of a stream into exactly `size` bytes.
+   */
+  static int inflate_exact(z_stream& zs, const uint8_t* src, size_t len, uint8_t* dst, size_t size) {
+    zs.next_in = (Bytef*)src;
+    zs.avail_in = len;
+    zs.next_out = dst;
+    zs.avail_out = size;
+    while (zs.avail_out > 0) {
+      int ret = inflate(&zs, Z_SYNC_FLUSH);
+      if (ret != Z_OK) {
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  /** Whether a message can be read without blocking.
+   */
+  bool readable() {
+    if (in_pos < in_len) {
+      return true;
+    }
+    struct pollfd pfd = {fd, POLLIN, 0};
+    return poll(&pfd, 1, 0) > 0;
+  }
+
+  /** Read exactly `n` bytes, through the input buffer.
+   */
+  int read_bytes(void* dst, size_t n) {
+    uint8_t* out = (uint8_t*)dst;
+    while (n > 0) {
+      if (in_pos == in_len) {
+        // Large reads bypass the buffer.
+        if (n >= sizeof(in)) {
+          ssize_t got = recv(fd, out, n, 0);
+          if (got <= 0) {
+            return -1;
+          }
+          CopyAudit::add(CopyAudit::fetch, got);
+          out += got;
+          n -= got;
+          continue;
+        }
+
+        ssize_t got = recv(fd, in, sizeof(in), 0);
+        if (got <= 0) {
+          return -1;
+        }
+        CopyAudit::add(CopyAudit::fetch, got);
+        in_pos = 0;
+        in_len = got;
+      }
+
+      size_t k = std::min(n, in_len - in_pos);
+      memcpy(out, in + in_pos, k);
+      in_pos += k;
+      out += k;
+      n -= k;
+    }
+    return 0;
+  }
+
+  int skip(size_t n) {
+    uint8_t scratch[256];
+    while (n > 0) {
+      size_t k = std::min(n, sizeof(scratch));
+      if (read_bytes(scratch, k) < 0) {
+        return -1;
+      }
+      n -= k;
+    }
+    return 0;
+  }
+
+  int write_bytes(const void* src, size_t n) {
+    const uint8_t* p = (const uint8_t*)src;
+    while (n > 0) {
+      ssize_t sent = send(fd, p, n, MSG_NOSIGNAL);
+      if (sent <= 0) {
+        return -1;
+      }
+      p += sent;
+      n -= sent;
+    }
+    return 0;
+  }
+
+  int read_u32(uint32_t& v) {
+    uint8_t b[4];
+    if (read_bytes(b, 4) < 0) {
+      return -1;
+    }
+    v = u32(b);
+    return 0;
+  }
+
+  static int u16(const uint8_t* p) {
+    return p[0] << 8 | p[1];
+  }
+
+  static uint32_t u32(const uint8_t* p) {
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+  }
+
+  static void put_u16(uint8_t* p, int v) {
+    p[0] = v >> 8;
+    p[1] = v;
+  }
+
+  static void put_u32(uint8_t* p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+  }
+
+  int fd = -1;
+  uint8_t in[64 * 1024];
+  size_t in_pos = 0;
+  size_t in_len = 0;
+
+  z_stream streams[5] = {};
+  bool streams_open = false;
+  std::vector<uint8_t> compressed;
+  std::vector<uint8_t> decompressed;
+
+  int width = 0;
+  int height = 0;
+  std::string name;
+  bool full_refresh = true;
+  std::vector<Rect> rects;
+  Frame frame = Frame(NULL, [](AVFrame*) {});
+};
@@ -0,0 +1,318 @@
+// sampler.hpp -*- c++ -*-
+
+/*
+ * MIT License
+ *
+ * Copyright (c) 2022 Walker Griggs
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <random>
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+
+#include "libav.hpp"
+#include "capture.hpp"
+
+/** Settings for sampling production frames into replay files.
+ */
+struct SamplerOptions {
+  std::string dir = ".";        ///< where replay files are written
+  double interval = 600;        ///< mean seconds between the starts of samples
+  double length = 5;            ///< seconds of frames in each sample
+  int downscale = 1;            ///< divide the width and height by this much
+  std::vector<Rect> mask;       ///< regions blacked out, in capture coordinates
+  size_t max_queued = 64;       ///< frames waiting to be written before dropping
+};
+
+/** Saves occasional short sequences of captured frames for replay.
+ *
+ * The sampler is a frame tap. At random moments, on average once per
+ * `interval`, it starts a sample and keeps every frame for `length` seconds,
+ * downscaled and masked as configured. Each sample is written to its own
+ * replay file by a background thread, so the recorder only pays for the copy;
+ * frames arriving while the writer is behind are dropped, and the timestamps
+ * of the frames that are kept still tell the true timing.
+ *
+ * The replay format is NUT holding uncompressed BGR0 pictures with timestamps
+ * in microseconds from the start of the sample, which `bench -r` reads back.
+ */
+class Sampler {
+public:
+  static constexpr AVRational time_base = {1, 1000000};
+
+  explicit Sampler(SamplerOptions opts)
+    : options(std::move(opts)), rng(std::random_device()()) {
+    options.downscale = std::max(options.downscale, 1);
+  }
+
+  Sampler(const Sampler&) = delete;
+  Sampler& operator=(const Sampler&) = delete;
+
+  ~Sampler() {
+    stop();
+  }
+
+  void start() {
+    quit = false;
+    next_sample = std::chrono::steady_clock::now() + random_interval();
+    worker = std::thread(&Sampler::run, this);
+  }
+
+  /** Stop the writer, finishing any sample in progress.
+   */
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (active) {
+        queue.push_back(Item{Frame(NULL, [](AVFrame*) {}), 0, Item::end});
+        active = false;
+      }
+      quit = true;
+    }
+    cv.notify_all();
+
+    if (worker.joinable()) {
+      worker.join();
+    }
+  }
+
+  /** The frame tap: copy the frame into the current sample, if any.
+   *
+   * Sampling never fails a recording; errors are counted instead.
+   *
+   * @return Zero.
+   */
+  int tap(Frame frame) {
+    auto now = std::chrono::steady_clock::now();
+
+    if (!active) {
+      if (now < next_sample) {
+        return 0;
+      }
+      active = true;
+      sample_start = now;
+      push(Item{Frame(NULL, [](AVFrame*) {}), 0, Item::begin});
+    } else if (now - sample_start >= std::chrono::duration<double>(options.length)) {
+      active = false;
+      next_sample = sample_start + random_interval();
+      push(Item{Frame(NULL, [](AVFrame*) {}), 0, Item::end});
+      return 0;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (queue.size() >= options.max_queued) {
+        dropped++;
+        return 0;
+      }
+    }
+
+    int w = (frame->width / options.downscale) & ~1;
+    int h = (frame->height / options.downscale) & ~1;
+    auto copy = frame.scale(w, h, AV_PIX_FMT_BGR0);
+    if (!copy) {
+      failed++;
+      return 0;
+    }
+
+    for (auto& m : options.mask) {
+      Rect r = Rect{m.x / options.downscale, m.y / options.downscale,
+                    m.w / options.downscale, m.h / options.downscale}.intersected(Rect{0, 0, w, h});
+      for (int y = r.y; y < r.y + r.h; y++) {
+        memset(copy->data[0] + y * copy->linesize[0] + r.x * 4, 0, r.w * 4);
+      }
+    }
+
+    auto pts = std::chrono::duration_cast<std::chrono::microseconds>(now - sample_start).count();
+    push(Item{std::move(copy), pts, Item::picture});
+    return 0;
+  }
+
+  /** The number of samples written in full.
+   */
+  int get_samples() const {
+    return samples;
+  }
+
+  /** The number of frames waiting to be written.
+   */
+  size_t get_queued() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return queue.size();
+  }
+
+  /** The number of frames dropped because the writer was behind.
+   */
+  int get_dropped() const {
+    return dropped;
+  }
+
+  /** The number of frames or samples lost to errors.
+   */
+  int get_failed() const {
+    return failed;
+  }
+
+private:
+  struct Item {
+    Frame frame;
+    int64_t pts;
+    enum { begin, picture, end } kind;
+  };
+
+  void push(Item item) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      queue.push_back(std::move(item));
+    }
+    cv.notify_one();
+  }
+
+  /** The writer thread: open a file per sample and write its pictures.
+   */
+  void run() {
+    FormatContext avfc = FormatContext(NULL, [](AVFormatContext*) {});
+    int stream_idx = -1;
+    bool broken = false;
+
+    while (true) {
+      Item item{Frame(NULL, [](AVFrame*) {}), 0, Item::begin};
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return quit || !queue.empty(); });
+        if (queue.empty()) {
+          break;
+        }
+        item = std::move(queue.front());
+        queue.pop_front();
+      }
+
+      switch (item.kind) {
+      case Item::begin:
+        avfc = FormatContext(NULL, [](AVFormatContext*) {});
+        path = next_path();
+        stream_idx = -1;
+        broken = false;
+        break;
+
+      case Item::picture:
+        if (broken) {
+          break;
+        }
+        // The header is written once the first picture gives the geometry.
+        if (!avfc.get()) {
+          avfc = FormatContext::open_output(path);
+          if (!avfc.get() ||
+              (stream_idx = avfc.create_raw_stream(item.frame->width, item.frame->height,
+                                                   AV_PIX_FMT_BGR0, time_base)) < 0 ||
+              avformat_write_header(avfc.get(), NULL) < 0) {
+            broken = true;
+            failed++;
+            break;
+          }
+        }
+        if (write(avfc, stream_idx, item) < 0) {
+          broken = true;
+          failed++;
+        }
+        break;
+
+      case Item::end:
+        if (avfc.get() && !broken && av_write_trailer(avfc.get()) >= 0) {
+          samples++;
+        }
+        avfc = FormatContext(NULL, [](AVFormatContext*) {});
+        break;
+      }
+    }
+  }
+
+  /** Pack one picture into a packet and write it.
+   */
+  static int write(FormatContext& avfc, int stream_idx, Item& item) {
+    AVFrame* frame = item.frame.get();
+    int size = av_image_get_buffer_size((AVPixelFormat)frame->format, frame->width, frame->height, 1);
+
+    auto packet = Packet::alloc();
+    if (!packet || av_new_packet(packet.get(), size) < 0) {
+      return -1;
+    }
+
+    if (av_image_copy_to_buffer(packet->data, size, frame->data, frame->linesize,
+                                (AVPixelFormat)frame->format, frame->width, frame->height, 1) < 0) {
+      return -1;
+    }
+
+    packet->stream_index = stream_idx;
+    packet->pts = packet->dts = item.pts;
+    packet->flags |= AV_PKT_FLAG_KEY;
+    return avfc.write_packet(packet, time_base);
+  }
+
+  /** A file name for a new sample, from the wall-clock time.
+   */
+  std::string next_path() {
+    char name[64];
+    time_t t = time(NULL);
+    struct tm tm;
+    localtime_r(&t, &tm);
+    strftime(name, sizeof(name), "sample-%Y%m%d-%H%M%S", &tm);
+    return options.dir + "/" + name + "-" + std::to_string(sequence++) + ".nut";
+  }
+
+  /** Exponentially distributed, so samples land at unpredictable moments.
+   */
+  std::chrono::steady_clock::duration random_interval() {
+    std::exponential_distribution<double> dist(1.0 / std::max(options.interval, 1.0));
+    return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double>(dist(rng)));
+  }
+
+  SamplerOptions options;
+  std::mt19937 rng;
+
+  std::atomic<bool> active{false};
+  std::chrono::steady_clock::time_point next_sample;
+  std::chrono::steady_clock::time_point sample_start;
+
+  std::thread worker;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<Item> queue;
+  bool quit = false;
+
+  std::string path;
+  int sequence = 0;
+  std::atomic<int> samples{0};
+  std::atomic<int> dropped{0};
+  std::atomic<int> failed{0};
+};
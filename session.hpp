@@ -0,0 +1,926 @@
+// session.hpp -*- c++ -*-
+
+/*
+ * MIT License
+ *
+ * Copyright (c) 2022 Walker Griggs
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <random>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include "libav.hpp"
+#include "capture.hpp"
+#include "rfb.hpp"
+#include "recorder.hpp"
+#include "metrics.hpp"
+
+/** A predicted or measured load.
+ */
+struct Cost {
+  double cpu = 0;        ///< CPU cores
+  double bandwidth = 0;  ///< memory traffic, bytes per second
+};
+
+/** Predicts what a recording costs the host, from measurements on the host.
+ *
+ * For each encoder and preset, `calibrate` encodes a few seconds of a
+ * synthetic busy desktop, a moving window and a line of new text each frame,
+ * on one thread, and measures that thread's CPU time and the bytes it copied,
+ * both per pixel. Neither includes other sessions' work, and the copies are
+ * kept out of the process's CopyAudit. A session's cost is then that times
+ * its pixel rate. Both are per captured pixel, so resolution and frame rate
+ * scale the prediction linearly; encoder settings are captured by
+ * calibrating each combination.
+ *
+ * Capacity is the host's cores and its memory bandwidth, measured with
+ * large copies, each derated by a headroom fraction.
+ */
+class CostModel {
+public:
+  /** Measure the cost of an encoder configuration, if not already known.
+   *
+   * @return Zero on success, a negative value if the encoder failed.
+   */
+  int calibrate(const RecorderOptions& options) {
+    std::string key = key_of(options);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (calibrations.count(key)) {
+        return 0;
+      }
+    }
+
+    Calibration c;
+    if (measure(options, c) < 0) {
+      return -1;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    calibrations[key] = c;
+    return 0;
+  }
+
+  /** Predict a session's cost, calibrating its encoder first if need be.
+   *
+   * @param options the session's options
+   * @param width   the captured width
+   * @param height  the captured height
+   * @param cost    the prediction
+   *
+   * @return Zero on success, a negative value if calibration failed.
+   */
+  int predict(const RecorderOptions& options, int width, int height, Cost& cost) {
+    if (calibrate(options) < 0) {
+      return -1;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& c = calibrations[key_of(options)];
+    double pixels = (double)width * height * options.fps;
+    cost.cpu = pixels * c.cpu_per_pixel;
+    cost.bandwidth = pixels * c.bytes_per_pixel;
+    return 0;
+  }
+
+  /** The host's usable capacity.
+   *
+   * @param cpu_headroom       the fraction of the cores sessions may use
+   * @param bandwidth_headroom the fraction of memory bandwidth sessions may use
+   */
+  Cost capacity(double cpu_headroom, double bandwidth_headroom) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (bandwidth == 0) {
+      bandwidth = measure_bandwidth();
+    }
+    return Cost{std::max(1u, std::thread::hardware_concurrency()) * cpu_headroom,
+                bandwidth * bandwidth_headroom};
+  }
+
+  static double process_cpu() {
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+  static double thread_cpu() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+  /** All bytes the CopyAudit has seen copied, by every stage.
+   */
+  static int64_t audit_bytes() {
+    int64_t total = 0;
+    for (int i = 0; i < CopyAudit::nb_stages; i++) {
+      total += CopyAudit::get_bytes((CopyAudit::Stage)i);
+    }
+    return total;
+  }
+
+private:
+  struct Calibration {
+    double cpu_per_pixel = 0;    ///< CPU seconds per captured pixel
+    double bytes_per_pixel = 0;  ///< memory traffic per captured pixel
+  };
+
+  static constexpr int calibration_width = 1280;
+  static constexpr int calibration_height = 720;
+  static constexpr int calibration_frames = 60;
+
+  static std::string codec_of(const RecorderOptions& options) {
+    if (!options.codec.empty()) {
+      return options.codec;
+    }
+    return options.rgb ? "libx264rgb" : "libx264";
+  }
+
+  static std::string key_of(const RecorderOptions& options) {
+    return codec_of(options) + ":" + options.preset + (options.rgb ? ":rgb" : options.gray ? ":gray" : "");
+  }
+
+  /** Encode the synthetic desktop the way the recorder would.
+   *
+   * The encoder runs single-threaded, so the calling thread's CPU time is all
+   * of the encode's; a session's encoder spreads the same work over threads.
+   * Every frame is converted from a BGR0 canvas, which also stands in for
+   * the capture copy in RGB mode. Copies are counted twice, once for the
+   * read and once for the write, to match `measure_bandwidth`; the capture
+   * source's own fetch is added at four bytes a pixel.
+   */
+  static int measure(const RecorderOptions& options, Calibration& c) {
+    const int w = calibration_width, h = calibration_height;
+
+    auto encoder = EncoderContext::alloc_context_by_name(codec_of(options));
+    if (!encoder.get()) {
+      return -1;
+    }
+    av_opt_set(encoder->priv_data, "preset", options.preset.c_str(), 0);
+    encoder->pix_fmt   = options.rgb ? AV_PIX_FMT_BGR0 : options.gray ? AV_PIX_FMT_GRAY8 : AV_PIX_FMT_YUV420P;
+    encoder->width     = w;
+    encoder->height    = h;
+    encoder->time_base = av_make_q(1, 30);
+    encoder->bit_rate  = 2 * 1000 * 1000;
+    encoder->thread_count = 1;
+    if (encoder.open() < 0) {
+      return -1;
+    }
+
+    auto canvas = Frame::alloc(w, h, AV_PIX_FMT_BGR0);
+    if (!canvas) {
+      return -1;
+    }
+    std::mt19937 rng(1);
+    for (int y = 0; y < h; y++) {
+      uint32_t* row = (uint32_t*)(canvas->data[0] + y * canvas->linesize[0]);
+      for (int x = 0; x < w; x++) {
+        row[x] = (x * 255 / w) << 16 | (y * 255 / h) << 8 | 0x80;
+      }
+    }
+
+    int64_t encoded = 0;
+    auto count = [&](Packet packet) {
+      encoded += packet->size;
+      return 0;
+    };
+
+    CopyAudit::Diversion copied;
+    double cpu = thread_cpu();
+
+    for (int i = 0; i <= calibration_frames; i++) {
+      int res;
+      if (i < calibration_frames) {
+        paint(canvas, i, rng);
+        auto frame = options.gray && !options.rgb
+          ? LumaKernel::convert(canvas)
+          : canvas.scale(w, h, encoder->pix_fmt);
+        if (!frame) {
+          return -1;
+        }
+        frame->pts = i;
+        res = encoder.send_frame(frame, count);
+      } else {
+        auto flush = Frame(NULL, [](AVFrame*) {});
+        res = encoder.send_frame(flush, count);
+      }
+      if (res < 0) {
+        return -1;
+      }
+    }
+
+    double pixels = (double)w * h * calibration_frames;
+    c.cpu_per_pixel = (thread_cpu() - cpu) / pixels;
+    c.bytes_per_pixel = 2 * (copied.get_bytes() + encoded) / pixels + 4;
+    return 0;
+  }
+
+  /** Move a window across the canvas and write a line of noise, like text.
+   */
+  static void paint(Frame& canvas, int i, std::mt19937& rng) {
+    int w = canvas->width, h = canvas->height;
+    int x0 = (i * 16) % (w - 256), y0 = h / 3;
+    for (int y = y0; y < y0 + 256; y++) {
+      uint32_t* row = (uint32_t*)(canvas->data[0] + y * canvas->linesize[0]);
+      for (int x = 0; x < w; x++) {
+        row[x] = (x >= x0 && x < x0 + 256) ? 0xe0e0e0 + i : (x * 255 / w) << 16 | (y * 255 / h) << 8 | 0x80;
+      }
+    }
+
+    int line = (i * 16) % (h / 4) + h / 2;
+    for (int y = line; y < line + 16; y++) {
+      uint32_t* row = (uint32_t*)(canvas->data[0] + y * canvas->linesize[0]);
+      for (int x = 0; x < w; x++) {
+        row[x] = rng() & 1 ? 0xffffff : 0;
+      }
+    }
+  }
+
+  /** Bytes per second memcpy reads and writes, over buffers far larger than
+   *  any cache.
+   */
+  static double measure_bandwidth() {
+    const size_t size = 64 << 20;
+    std::vector<uint8_t> a(size, 1), b(size);
+
+    memcpy(b.data(), a.data(), size);
+    auto start = std::chrono::steady_clock::now();
+    const int rounds = 8;
+    for (int i = 0; i < rounds; i++) {
+      memcpy(i % 2 ? a.data() : b.data(), i % 2 ? b.data() : a.data(), size);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return 2.0 * size * rounds / std::max(seconds, 1e-6);
+  }
+
+  std::mutex mutex;
+  std::map<std::string, Calibration> calibrations;
+  double bandwidth = 0;
+};
+
+/** What to do with a session that would overload the host.
+ */
+enum class Admission {
+  off,        ///< start every session without pricing it
+  refuse,     ///< fail the submission
+  queue,      ///< start it once enough running sessions finish
+  downgrade,  ///< cheapen its settings until it fits, else queue it
+};
+
+/** Settings for admitting sessions.
+ */
+struct SessionOptions {
+  Admission admission = Admission::off;        ///< the policy when a session doesn't fit
+  double cpu_headroom = 0.8;                   ///< the fraction of the cores sessions may use
+  double bandwidth_headroom = 0.5;             ///< the fraction of memory bandwidth sessions may use
+  int min_fps = 5;                             ///< the lowest frame rate a downgrade may pick
+  std::string fallback_preset = "ultrafast";   ///< the first thing a downgrade tries
+};
+
+/** Runs several recordings in one process without overloading the host.
+ *
+ * Each submitted session is priced by the CostModel before it starts. It is
+ * admitted if its predicted cost, added to the load already committed, fits
+ * the host's capacity. The committed load is the larger of the running
+ * sessions' predictions and the process's measured load, so the model
+ * corrects itself when it underestimates. A session that doesn't fit is
+ * refused, queued until enough capacity frees up, or downgraded: first to
+ * the fallback preset, then to halved frame rates down to `min_fps`. A
+ * session too large for an idle host is never queued, since it would wait
+ * forever.
+ *
+ * With admission off, the default, sessions start as submitted: nothing is
+ * probed, calibrated or measured, and they are counted as admitted.
+ *
+ * Calibration and a recorder's start run outside the manager's lock, so
+ * scrapes and polls carry on meanwhile; a session being started already
+ * counts towards the committed load.
+ *
+ * `poll` must be called periodically: it reaps finished sessions, starts
+ * queued ones that now fit, and samples the measured load. `publish` exposes
+ * the predicted and measured load, and the admission decisions, as metrics.
+ */
+class SessionManager {
+public:
+  explicit SessionManager(SessionOptions opts) : options(std::move(opts)) {}
+
+  SessionManager(const SessionManager&) = delete;
+  SessionManager& operator=(const SessionManager&) = delete;
+
+  ~SessionManager() {
+    if (metrics) {
+      metrics->remove(metrics_id);
+    }
+    stop_all();
+  }
+
+  /** Submits a recording.
+   *
+   * Unless admission is off, the geometry is probed from the X display or
+   * VNC server, which are briefly opened for it, and the encoder is
+   * calibrated if it is new.
+   *
+   * @param opts  the recording's options
+   * @param setup run on the new Recorder before it starts, to register taps
+   *              and callbacks
+   *
+   * @return The session id, zero or more, if it started or was queued; a
+   *         negative value if it was refused or failed to start.
+   */
+  int submit(RecorderOptions opts, std::function<void(Recorder&)> setup = {}) {
+    auto session = std::make_shared<Session>();
+    session->options = std::move(opts);
+    session->setup = std::move(setup);
+
+    if (options.admission == Admission::off) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        session->id = next_id++;
+        starting[session->id] = session;
+      }
+      return admit(session, admitted);
+    }
+
+    if (probe(session->options, session->width, session->height) < 0) {
+      return fail("Failed to probe the capture source's geometry");
+    }
+    if (model.predict(session->options, session->width, session->height, session->cost) < 0) {
+      return fail("Failed to calibrate the encoder");
+    }
+    Cost capacity = model.capacity(options.cpu_headroom, options.bandwidth_headroom);
+
+    // A downgrade may price the fallback preset; calibrate it here, outside
+    // the lock, so that the decision below only looks calibrations up.
+    if (options.admission == Admission::downgrade) {
+      bool fit;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        fit = fits(session->cost, committed());
+      }
+      RecorderOptions fallback = session->options;
+      fallback.preset = options.fallback_preset;
+      if (!fit && model.calibrate(fallback) < 0) {
+        return fail("Failed to calibrate the encoder");
+      }
+    }
+
+    int* counter = &admitted;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      session->id = next_id++;
+
+      if (!fits(session->cost, committed())) {
+        if (options.admission == Admission::downgrade && downgrade(*session)) {
+          counter = &downgraded;
+        } else if (options.admission == Admission::refuse || !fits(session->cost, Cost{})) {
+          refused++;
+          error = "Admission refused: the session needs " + describe(session->cost) +
+            " of " + describe(capacity) + " available";
+          return -1;
+        } else {
+          queue.push_back(session);
+          queued++;
+          return session->id;
+        }
+      }
+      starting[session->id] = session;
+    }
+    return admit(session, *counter);
+  }
+
+  /** Stops a session, removes it from the queue, or cancels its start.
+   *
+   * A session still starting is marked cancelled; its recorder is stopped,
+   * or never started, by the thread starting it.
+   *
+   * @return The recording's result, zero if it was queued, starting or
+   *         unknown.
+   */
+  int stop(int id) {
+    std::shared_ptr<Recorder> recorder;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (auto it = queue.begin(); it != queue.end(); ++it) {
+        if ((*it)->id == id) {
+          queue.erase(it);
+          return 0;
+        }
+      }
+      if (auto it = starting.find(id); it != starting.end()) {
+        it->second->cancelled = true;
+        starting.erase(it);
+        return 0;
+      }
+      auto it = running.find(id);
+      if (it == running.end()) {
+        return 0;
+      }
+      recorder = it->second->recorder;
+      running.erase(it);
+    }
+    return recorder->stop().get();
+  }
+
+  void stop_all() {
+    std::vector<int> ids;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      queue.clear();
+      for (auto& s : starting) {
+        s.second->cancelled = true;
+      }
+      starting.clear();
+      for (auto& s : running) {
+        ids.push_back(s.first);
+      }
+    }
+    for (int id : ids) {
+      stop(id);
+    }
+  }
+
+  /** The session's recorder, once it has started.
+   *
+   * The recorder stays valid for as long as the caller holds it, even after
+   * the session is reaped.
+   *
+   * @return The recorder, or null if the session is queued or unknown.
+   */
+  std::shared_ptr<Recorder> get(int id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = running.find(id);
+    return it == running.end() ? nullptr : it->second->recorder;
+  }
+
+  /** Whether the session is running, starting or queued.
+   */
+  bool has(int id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return running.count(id) || starting.count(id) ||
+      std::any_of(queue.begin(), queue.end(), [&](auto& s) { return s->id == id; });
+  }
+
+  /** Reaps finished sessions, starts queued sessions that now fit, and
+   *  samples the measured load.
+   */
+  void poll() {
+    auto now = std::chrono::steady_clock::now();
+    double cpu = CostModel::process_cpu();
+    int64_t bytes = CostModel::audit_bytes();
+
+    std::vector<std::shared_ptr<Session>> ready;
+    std::unique_lock<std::mutex> lock(mutex);
+    if (sampled) {
+      double seconds = std::chrono::duration<double>(now - sample_time).count();
+      if (seconds >= 1) {
+        measured.cpu = (cpu - sample_cpu) / seconds;
+        measured.bandwidth = 2 * (bytes - sample_bytes) / seconds;
+        sample_time = now;
+        sample_cpu = cpu;
+        sample_bytes = bytes;
+      }
+    } else {
+      sampled = true;
+      sample_time = now;
+      sample_cpu = cpu;
+      sample_bytes = bytes;
+    }
+
+    for (auto it = running.begin(); it != running.end();) {
+      if (!it->second->recorder->is_running()) {
+        finished++;
+        it = running.erase(it);
+      } else {
+        ++it;
+      }
+    }
+
+    while (!queue.empty() && fits(queue.front()->cost, committed())) {
+      auto session = queue.front();
+      queue.pop_front();
+      starting[session->id] = session;
+      ready.push_back(session);
+    }
+    lock.unlock();
+
+    for (auto& session : ready) {
+      start(session);
+    }
+  }
+
+  /** The highest smoothed load of any running session, see
+   *  `Recorder::get_load`.
+   */
+  double max_load() {
+    std::lock_guard<std::mutex> lock(mutex);
+    double load = 0;
+    for (auto& s : running) {
+      load = std::max(load, s.second->recorder->get_load());
+    }
+    return load;
+  }
+
+  /** Registers the session metrics with a registry that outlives the
+   *  manager.
+   */
+  void publish(Metrics& registry) {
+    metrics = &registry;
+    metrics_id = registry.add([this](std::ostream& os) { collect(os); });
+  }
+
+  /** A description of the last refusal or error, empty if there was none.
+   */
+  std::string get_error() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return error;
+  }
+
+private:
+  struct Session {
+    int id = -1;
+    RecorderOptions options;
+    std::function<void(Recorder&)> setup;
+    int width = 0;
+    int height = 0;
+    Cost cost;
+    std::shared_ptr<Recorder> recorder;
+    bool cancelled = false;   ///< stopped while starting; guarded by the manager's mutex
+  };
+
+  /** Find the size of the picture a session will capture.
+   */
+  static int probe(const RecorderOptions& options, int& width, int& height) {
+    if (!options.vnc.empty()) {
+      RfbCapture rfb;
+      if (rfb.open(options.vnc, options.vnc_password) < 0) {
+        return -1;
+      }
+      width = rfb.get_width();
+      height = rfb.get_height();
+      rfb.close();
+      return 0;
+    }
+
+    Display* display = XOpenDisplay(options.display.empty() ? NULL : options.display.c_str());
+    if (!display) {
+      return -1;
+    }
+    width = DisplayWidth(display, DefaultScreen(display));
+    height = DisplayHeight(display, DefaultScreen(display));
+    XCloseDisplay(display);
+    return 0;
+  }
+
+  /** The load already committed to running and starting sessions.
+   */
+  Cost committed() {
+    Cost total;
+    for (auto* sessions : {&running, &starting}) {
+      for (auto& s : *sessions) {
+        total.cpu += s.second->cost.cpu;
+        total.bandwidth += s.second->cost.bandwidth;
+      }
+    }
+    total.cpu = std::max(total.cpu, measured.cpu);
+    total.bandwidth = std::max(total.bandwidth, measured.bandwidth);
+    return total;
+  }
+
+  bool fits(const Cost& cost, const Cost& load) {
+    Cost capacity = model.capacity(options.cpu_headroom, options.bandwidth_headroom);
+    return load.cpu + cost.cpu <= capacity.cpu &&
+      load.bandwidth + cost.bandwidth <= capacity.bandwidth;
+  }
+
+  /** Cheapen the session's settings until it fits.
+   *
+   * @return Whether it fits now.
+   */
+  bool downgrade(Session& session) {
+    RecorderOptions candidate = session.options;
+    Cost cost = session.cost;
+    Cost load = committed();
+
+    if (candidate.preset != options.fallback_preset) {
+      candidate.preset = options.fallback_preset;
+      if (model.predict(candidate, session.width, session.height, cost) < 0) {
+        return false;
+      }
+    }
+
+    while (!fits(cost, load) && candidate.fps / 2 >= options.min_fps) {
+      candidate.fps /= 2;
+      if (model.predict(candidate, session.width, session.height, cost) < 0) {
+        return false;
+      }
+    }
+
+    if (!fits(cost, load)) {
+      return false;
+    }
+    session.options = candidate;
+    session.cost = cost;
+    return true;
+  }
+
+  int admit(std::shared_ptr<Session> session, int& counter) {
+    if (start(session) < 0) {
+      return -1;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    counter++;
+    return session->id;
+  }
+
+  /** Start a session already reserved in `starting`, without holding the
+   *  lock, and move it to `running`.
+   */
+  int start(std::shared_ptr<Session> session) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (session->cancelled) {
+        error = "The session was stopped while it started";
+        return -1;
+      }
+    }
+
+    auto recorder = std::make_shared<Recorder>(session->options);
+    if (session->setup) {
+      session->setup(*recorder);
+    }
+    int res = recorder->start().get();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    starting.erase(session->id);
+    if (res < 0) {
+      failed++;
+      error = recorder->get_error();
+      return -1;
+    }
+    if (session->cancelled) {
+      error = "The session was stopped while it started";
+      lock.unlock();
+      recorder->stop().get();
+      return -1;
+    }
+    session->recorder = recorder;
+    running[session->id] = session;
+    return 0;
+  }
+
+  int fail(const std::string& message) {
+    std::lock_guard<std::mutex> lock(mutex);
+    failed++;
+    error = message;
+    return -1;
+  }
+
+  static std::string describe(const Cost& cost) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.2f cores and %.2f GB/s", cost.cpu, cost.bandwidth / 1e9);
+    return buf;
+  }
+
+  void collect(std::ostream& os) {
+    // Capacity is measured on first use, which admission off never needs.
+    Cost capacity;
+    if (options.admission != Admission::off) {
+      capacity = model.capacity(options.cpu_headroom, options.bandwidth_headroom);
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+
+    Cost predicted;
+    for (auto& s : running) {
+      predicted.cpu += s.second->cost.cpu;
+      predicted.bandwidth += s.second->cost.bandwidth;
+    }
+
+    Metrics::single(os, "screencap_capacity_cpu_cores", "gauge",
+                    "CPU cores sessions may use.", capacity.cpu);
+    Metrics::single(os, "screencap_capacity_bandwidth_bytes", "gauge",
+                    "Memory bandwidth sessions may use, in bytes per second.", capacity.bandwidth);
+    Metrics::single(os, "screencap_predicted_cpu_cores", "gauge",
+                    "CPU cores the cost model predicts running sessions use.", predicted.cpu);
+    Metrics::single(os, "screencap_predicted_bandwidth_bytes", "gauge",
+                    "Memory bandwidth the cost model predicts running sessions use.", predicted.bandwidth);
+    Metrics::single(os, "screencap_actual_cpu_cores", "gauge",
+                    "CPU cores the process used over the last poll interval.", measured.cpu);
+    Metrics::single(os, "screencap_actual_bandwidth_bytes", "gauge",
+                    "Bytes per second the copy audit saw read and written.", measured.bandwidth);
+
+    Metrics::header(os, "screencap_sessions", "gauge", "Sessions by state.");
+    Metrics::sample(os, "screencap_sessions", running.size(), "state=\"running\"");
+    Metrics::sample(os, "screencap_sessions", queue.size(), "state=\"queued\"");
+
+    Metrics::header(os, "screencap_admissions_total", "counter", "Submitted sessions by outcome.");
+    Metrics::sample(os, "screencap_admissions_total", admitted, "result=\"admitted\"");
+    Metrics::sample(os, "screencap_admissions_total", downgraded, "result=\"downgraded\"");
+    Metrics::sample(os, "screencap_admissions_total", queued, "result=\"queued\"");
+    Metrics::sample(os, "screencap_admissions_total", refused, "result=\"refused\"");
+    Metrics::sample(os, "screencap_admissions_total", failed, "result=\"failed\"");
+    Metrics::single(os, "screencap_sessions_finished_total", "counter",
+                    "Sessions that have finished.", finished);
+
+    Metrics::header(os, "screencap_session_predicted_cpu_cores", "gauge",
+                    "CPU cores the cost model predicts for each session.");
+    for (auto& s : running) {
+      Metrics::sample(os, "screencap_session_predicted_cpu_cores", s.second->cost.cpu,
+                      "session=\"" + std::to_string(s.first) + "\"");
+    }
+    Metrics::header(os, "screencap_session_slo_breaches_total", "counter",
+                    "Once-a-second checks that found a session's SLOs breached.");
+    for (auto& s : running) {
+      Metrics::sample(os, "screencap_session_slo_breaches_total", s.second->recorder->get_slo_breaches(),
+                      "session=\"" + std::to_string(s.first) + "\"");
+    }
+    Metrics::header(os, "screencap_session_load", "gauge",
+                    "The fraction of each frame interval each session spends busy.");
+    for (auto& s : running) {
+      Metrics::sample(os, "screencap_session_load", s.second->recorder->get_load(),
+                      "session=\"" + std::to_string(s.first) + "\"");
+    }
+    Metrics::header(os, "screencap_session_encode_scale", "gauge",
+                    "The fraction of the captured width and height each session encodes.");
+    for (auto& s : running) {
+      Metrics::sample(os, "screencap_session_encode_scale", s.second->recorder->get_encode_scale(),
+                      "session=\"" + std::to_string(s.first) + "\"");
+    }
+    Metrics::header(os, "screencap_session_resizes_total", "counter",
+                    "Encode resolution changes each session made to keep up.");
+    for (auto& s : running) {
+      Metrics::sample(os, "screencap_session_resizes_total", s.second->recorder->get_resizes(),
+                      "session=\"" + std::to_string(s.first) + "\"");
+    }
+
+    Metrics::header(os, "screencap_session_udp_queue_bytes", "gauge",
+                    "Bytes waiting to be paced out by each session sending over UDP.");
+    for (auto& s : running) {
+      if (auto sender = s.second->recorder->get_sender()) {
+        Metrics::sample(os, "screencap_session_udp_queue_bytes", sender->get_queued_bytes(),
+                        "session=\"" + std::to_string(s.first) + "\"");
+      }
+    }
+    Metrics::header(os, "screencap_session_udp_pacing_error_seconds", "gauge",
+                    "How late datagrams left against the pacing schedule over the last second.");
+    for (auto& s : running) {
+      if (auto sender = s.second->recorder->get_sender()) {
+        std::string session = "session=\"" + std::to_string(s.first) + "\"";
+        Metrics::sample(os, "screencap_session_udp_pacing_error_seconds", sender->get_pacing_error(),
+                        session + ",stat=\"mean\"");
+        Metrics::sample(os, "screencap_session_udp_pacing_error_seconds", sender->get_max_pacing_error(),
+                        session + ",stat=\"max\"");
+      }
+    }
+    Metrics::header(os, "screencap_session_udp_datagrams_total", "counter",
+                    "Datagrams each session sending over UDP has handled, by outcome.");
+    for (auto& s : running) {
+      if (auto sender = s.second->recorder->get_sender()) {
+        std::string session = "session=\"" + std::to_string(s.first) + "\"";
+        Metrics::sample(os, "screencap_session_udp_datagrams_total", sender->get_sent(),
+                        session + ",result=\"sent\"");
+        Metrics::sample(os, "screencap_session_udp_datagrams_total", sender->get_dropped(),
+                        session + ",result=\"dropped\"");
+        Metrics::sample(os, "screencap_session_udp_datagrams_total", sender->get_errors(),
+                        session + ",result=\"refused\"");
+      }
+    }
+
+    // Chargeback: each recording's threads, output and frames, labelled with
+    // who it is charged to.
+    std::vector<std::pair<std::string, Usage>> usage;
+    for (auto& s : running) {
+      std::string labels = "session=\"" + std::to_string(s.first) + "\"";
+      const std::string& tag = s.second->recorder->get_options().tag;
+      if (!tag.empty()) {
+        labels += ",tag=\"" + Metrics::escape(tag) + "\"";
+      }
+      usage.emplace_back(labels, s.second->recorder->get_usage());
+    }
+    Metrics::header(os, "screencap_session_cpu_seconds_total", "counter",
+                    "CPU time used by each session's threads, the encoder's included.");
+    for (auto& u : usage) {
+      Metrics::sample(os, "screencap_session_cpu_seconds_total", u.second.cpu, u.first);
+    }
+    Metrics::header(os, "screencap_session_written_bytes_total", "counter",
+                    "Bytes each session has written to its outputs.");
+    for (auto& u : usage) {
+      Metrics::sample(os, "screencap_session_written_bytes_total", u.second.bytes, u.first);
+    }
+    Metrics::header(os, "screencap_session_encoded_frames_total", "counter",
+                    "Frames each session has encoded.");
+    for (auto& u : usage) {
+      Metrics::sample(os, "screencap_session_encoded_frames_total", u.second.frames, u.first);
+    }
+    Metrics::header(os, "screencap_session_peak_memory_bytes", "gauge",
+                    "The process's peak resident memory while each session ran.");
+    for (auto& u : usage) {
+      Metrics::sample(os, "screencap_session_peak_memory_bytes", u.second.peak_rss, u.first);
+    }
+
+    Metrics::header(os, "screencap_session_shadow_windows_total", "counter",
+                    "Sampled windows each shadowing session compared, by outcome.");
+    for (auto& s : running) {
+      if (auto shadow = s.second->recorder->get_shadow()) {
+        std::string session = "session=\"" + std::to_string(s.first) + "\"";
+        Metrics::sample(os, "screencap_session_shadow_windows_total", shadow->get_windows(),
+                        session + ",result=\"compared\"");
+        Metrics::sample(os, "screencap_session_shadow_windows_total", shadow->get_skipped(),
+                        session + ",result=\"skipped\"");
+      }
+    }
+
+    // The control codes the live settings on the same windows as the
+    // candidate, so the two compare like for like.
+    Metrics::header(os, "screencap_session_shadow_bytes_total", "counter",
+                    "Bytes the control and candidate encoders produced on sampled windows.");
+    for (auto& s : running) {
+      if (auto shadow = s.second->recorder->get_shadow()) {
+        std::string session = "session=\"" + std::to_string(s.first) + "\"";
+        Metrics::sample(os, "screencap_session_shadow_bytes_total", shadow->get_control().bytes,
+                        session + ",encoder=\"control\"");
+        Metrics::sample(os, "screencap_session_shadow_bytes_total", shadow->get_candidate().bytes,
+                        session + ",encoder=\"candidate\"");
+      }
+    }
+    Metrics::header(os, "screencap_session_shadow_cpu_seconds_total", "counter",
+                    "CPU time the control and candidate encoders spent on sampled windows.");
+    for (auto& s : running) {
+      if (auto shadow = s.second->recorder->get_shadow()) {
+        std::string session = "session=\"" + std::to_string(s.first) + "\"";
+        Metrics::sample(os, "screencap_session_shadow_cpu_seconds_total", shadow->get_control().cpu,
+                        session + ",encoder=\"control\"");
+        Metrics::sample(os, "screencap_session_shadow_cpu_seconds_total", shadow->get_candidate().cpu,
+                        session + ",encoder=\"candidate\"");
+      }
+    }
+    Metrics::header(os, "screencap_session_shadow_psnr_db", "gauge",
+                    "PSNR of the control and candidate encoders over sampled windows.");
+    for (auto& s : running) {
+      if (auto shadow = s.second->recorder->get_shadow()) {
+        std::string session = "session=\"" + std::to_string(s.first) + "\"";
+        Metrics::sample(os, "screencap_session_shadow_psnr_db", shadow->get_control().psnr(),
+                        session + ",encoder=\"control\"");
+        Metrics::sample(os, "screencap_session_shadow_psnr_db", shadow->get_candidate().psnr(),
+                        session + ",encoder=\"candidate\"");
+      }
+    }
+  }
+
+  SessionOptions options;
+  CostModel model;
+
+  std::mutex mutex;
+  std::map<int, std::shared_ptr<Session>> running;
+  std::map<int, std::shared_ptr<Session>> starting;   ///< admitted, their recorders starting
+  std::deque<std::shared_ptr<Session>> queue;
+  int next_id = 0;
+  std::string error;
+
+  Cost measured;
+  bool sampled = false;
+  std::chrono::steady_clock::time_point sample_time;
+  double sample_cpu = 0;
+  int64_t sample_bytes = 0;
+
+  int admitted = 0;
+  int downgraded = 0;
+  int queued = 0;
+  int refused = 0;
+  int failed = 0;
+  int finished = 0;
+
+  Metrics* metrics = NULL;
+  int metrics_id = -1;
+};
@@ -0,0 +1,551 @@
+// shadow.hpp -*- c++ -*-
+
+/*
+ * MIT License
+ *
+ * Copyright (c) 2022 Walker Griggs
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <string>
+#include <deque>
+#include <map>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+extern "C" {
+#include <libavutil/pixdesc.h>
+#include <libavutil/dict.h>
+#include <libavutil/opt.h>
+#include <libavutil/imgutils.h>
+}
+
+#include "libav.hpp"
+
+/** Candidate encoder settings to evaluate against the live ones.
+ */
+struct ShadowOptions {
+  bool enabled = false;  ///< evaluate the candidate on sampled windows
+  std::string codec;     ///< the candidate encoder, empty for the live one
+  std::string preset;    ///< the candidate preset, empty for the live one
+  int crf = -1;          ///< constant rate factor, negative to keep the live rate targets
+  std::string params;    ///< further encoder options, as key=value:key=value
+  int every = 20;        ///< sample one window in this many
+  int window = 60;       ///< frames per window, at most; shorter if the live GOP is
+};
+
+/** Totals over the windows one encoder has coded.
+ */
+struct ShadowTotals {
+  int64_t frames = 0;   ///< frames encoded
+  int64_t bytes = 0;    ///< bitstream produced
+  double cpu = 0;       ///< CPU seconds spent encoding
+  double sse = 0;       ///< summed squared error of the decoded pictures
+  int64_t samples = 0;  ///< samples the squared error was summed over
+
+  /** The PSNR over every window, in dB, for 8-bit samples.
+   */
+  double psnr() const {
+    if (samples == 0) {
+      return 0;
+    }
+    double mse = sse / samples;
+    return mse > 0 ? 10 * std::log10(255.0 * 255.0 / mse) : 100;
+  }
+};
+
+/** Evaluates candidate encoder settings on a sample of live frames, without
+ *  touching the live output.
+ *
+ * One window of frames in `every`, each as long as the live GOP, is handed
+ * to a worker under SCHED_IDLE. The worker codes the window twice from a
+ * fresh IDR: once as a control, with the live encoder's settings, and once
+ * with the candidate's. Both run single-threaded, so the CPU time measured on
+ * the worker is the encode's; both are decoded and compared with the source
+ * pictures for PSNR. Comparing against a control rather than the live
+ * packets means both sides start a window in the same state, whatever the
+ * live encoder's rate control and GOP were doing. Neither bitstream is
+ * written anywhere.
+ *
+ * On the recorder thread `tap` only takes a reference to the frame already
+ * sent to the live encoder. The incremental converter then copies its
+ * picture on write for the frames a window holds. If the worker falls a
+ * window behind, the window being tapped is abandoned rather than queued.
+ *
+ * The worker drives libavcodec directly rather than through EncoderContext
+ * and DecoderContext, and diverts the rest of its copies, the scaling in
+ * `compare`, so none of its work shows up in the CopyAudit totals.
+ */
+class ShadowEncoder {
+public:
+  explicit ShadowEncoder(ShadowOptions opts) : options(std::move(opts)) {
+    options.every = std::max(options.every, 1);
+    options.window = std::max(options.window, 1);
+  }
+
+  ShadowEncoder(const ShadowEncoder&) = delete;
+  ShadowEncoder& operator=(const ShadowEncoder&) = delete;
+
+  ~ShadowEncoder() {
+    stop();
+  }
+
+  void start() {
+    quit = false;
+    worker = std::thread(&ShadowEncoder::run, this);
+  }
+
+  /** The worker thread, so it can be named for accounting.
+   */
+  pthread_t native_handle() {
+    return worker.native_handle();
+  }
+
+  /** Stop the worker; a window in progress is abandoned.
+   */
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      quit = true;
+    }
+    cv.notify_all();
+
+    if (worker.joinable()) {
+      worker.join();
+    }
+  }
+
+  /** Take the live encoder's settings for the windows that follow. Called on
+   *  the recorder thread each time the live encoder is opened; a window in
+   *  progress is abandoned.
+   */
+  void configure(const AVCodecContext* live) {
+    Settings s;
+    s.codec = live->codec ? live->codec->name : "";
+    char* serialized = NULL;
+    if (live->priv_data &&
+        av_opt_serialize(live->priv_data, 0, AV_OPT_SERIALIZE_SKIP_DEFAULTS, &serialized, '=', ':') >= 0 &&
+        serialized) {
+      s.private_options = serialized;
+    }
+    av_free(serialized);
+    s.width = live->width;
+    s.height = live->height;
+    s.pix_fmt = live->pix_fmt;
+    s.time_base = live->time_base;
+    s.sample_aspect_ratio = live->sample_aspect_ratio;
+    s.bit_rate = live->bit_rate;
+    s.rc_max_rate = live->rc_max_rate;
+    s.rc_min_rate = live->rc_min_rate;
+    s.rc_buffer_size = live->rc_buffer_size;
+    s.gop_size = live->gop_size;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (position > 0) {
+      abandon();
+    }
+    settings = s;
+    generation++;
+    position = 0;
+  }
+
+  /** Offer a frame just sent to the live encoder.
+   */
+  void tap(const Frame& frame) {
+    std::unique_lock<std::mutex> lock(mutex);
+    int length = std::min(options.window, settings.gop_size > 0 ? settings.gop_size : options.window);
+
+    if (position == 0) {
+      sampling = windows++ % options.every == 0;
+      // The worker is still on an earlier window.
+      if (sampling && !queue.empty()) {
+        sampling = false;
+        skipped++;
+      }
+    }
+
+    if (sampling) {
+      auto ref = frame.ref();
+      if (!ref) {
+        abandon();
+      } else {
+        queue.push_back(Item{std::move(ref), generation, position == 0, position == length - 1});
+      }
+    }
+
+    position = (position + 1) % length;
+    if (sampling && position == 0) {
+      lock.unlock();
+      cv.notify_one();
+    }
+  }
+
+  /** The control encoder's totals: the live settings, on the sampled windows.
+   */
+  ShadowTotals get_control() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return control_totals;
+  }
+
+  /** The candidate encoder's totals on the same windows.
+   */
+  ShadowTotals get_candidate() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return candidate_totals;
+  }
+
+  /** Windows compared in full.
+   */
+  int get_windows() const {
+    return completed;
+  }
+
+  /** Windows that were due but abandoned because the worker was behind, the
+   *  live encoder changed, or an encoder failed.
+   */
+  int get_skipped() const {
+    return skipped;
+  }
+
+private:
+  /** The live encoder's settings, copied for the worker.
+   */
+  struct Settings {
+    std::string codec;
+    int width = 0;
+    int height = 0;
+    AVPixelFormat pix_fmt = AV_PIX_FMT_NONE;
+    AVRational time_base = {0, 1};
+    AVRational sample_aspect_ratio = {0, 1};
+    int64_t bit_rate = 0;
+    int64_t rc_max_rate = 0;
+    int64_t rc_min_rate = 0;
+    int rc_buffer_size = 0;
+    int gop_size = 0;
+    std::string private_options;  ///< the live encoder's non-default private options, serialized
+  };
+
+  struct Item {
+    Frame frame;
+    int generation;
+    bool first;
+    bool last;
+  };
+
+  /** One encoder's pass over a window: the encoder, a decoder for its output
+   *  and the source pictures still waiting for their decoded counterparts.
+   */
+  struct Pass {
+    EncoderContext encoder = EncoderContext(NULL, [](AVCodecContext*) {});
+    DecoderContext decoder = DecoderContext(NULL, [](AVCodecContext*) {});
+    std::map<int64_t, Frame> pending;
+    ShadowTotals totals;
+  };
+
+  /** Drop the frames of the window being tapped; the queue never holds
+   *  another's. The worker gives up on any it has begun when the next window
+   *  starts. Called with the lock held.
+   */
+  void abandon() {
+    if (sampling) {
+      queue.clear();
+      skipped++;
+    }
+    sampling = false;
+  }
+
+  /** The worker: code each complete window twice and fold in the results.
+   */
+  void run() {
+    CopyAudit::Diversion diversion;
+
+    struct sched_param param = {};
+    if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0) {
+      setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+    }
+
+    Pass control, candidate;
+    bool failed = false;
+
+    while (true) {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [this] { return quit || !queue.empty(); });
+      if (quit) {
+        break;
+      }
+      Item item = std::move(queue.front());
+      queue.pop_front();
+      Settings s = settings;
+
+      // The live encoder changed since the window began.
+      if (item.generation != generation) {
+        continue;
+      }
+      lock.unlock();
+
+      if (item.first) {
+        failed = open(control, s, false) < 0 || open(candidate, s, true) < 0;
+      }
+      if (!failed) {
+        failed = encode(control, item.frame) < 0 || encode(candidate, item.frame) < 0;
+      }
+      if (!item.last) {
+        continue;
+      }
+
+      auto flush = Frame(NULL, [](AVFrame*) {});
+      if (failed || encode(control, flush) < 0 || encode(candidate, flush) < 0) {
+        skipped++;
+        continue;
+      }
+
+      lock.lock();
+      add(control_totals, control.totals);
+      add(candidate_totals, candidate.totals);
+      completed++;
+    }
+  }
+
+  /** Open a fresh encoder, and a decoder for its output, for a window.
+   *
+   * Both passes take the live settings, private options included; the
+   * candidate's options are then laid over them. Options a different
+   * candidate codec doesn't know are ignored. Rate targets are dropped when
+   * the candidate sets a CRF.
+   */
+  int open(Pass& pass, const Settings& s, bool is_candidate) {
+    pass = Pass();
+
+    std::string codec = is_candidate && !options.codec.empty() ? options.codec : s.codec;
+    pass.encoder = EncoderContext::alloc_context_by_name(codec);
+    if (!pass.encoder.get()) {
+      return -1;
+    }
+
+    auto& enc = pass.encoder;
+    enc->width               = s.width;
+    enc->height              = s.height;
+    enc->pix_fmt             = s.pix_fmt;
+    enc->time_base           = s.time_base;
+    enc->sample_aspect_ratio = s.sample_aspect_ratio;
+    enc->gop_size            = s.gop_size;
+    enc->thread_count        = 1;
+    if (!is_candidate || options.crf < 0) {
+      enc->bit_rate       = s.bit_rate;
+      enc->rc_max_rate    = s.rc_max_rate;
+      enc->rc_min_rate    = s.rc_min_rate;
+      enc->rc_buffer_size = s.rc_buffer_size;
+    }
+
+    AVDictionary* opts = NULL;
+    if (!s.private_options.empty() &&
+        av_dict_parse_string(&opts, s.private_options.c_str(), "=", ":", 0) < 0) {
+      av_dict_free(&opts);
+      return -1;
+    }
+    if (is_candidate) {
+      if (!options.preset.empty()) {
+        av_dict_set(&opts, "preset", options.preset.c_str(), 0);
+      }
+      if (options.crf >= 0) {
+        av_dict_set_int(&opts, "crf", options.crf, 0);
+      }
+      if (!options.params.empty() &&
+          av_dict_parse_string(&opts, options.params.c_str(), "=", ":", 0) < 0) {
+        av_dict_free(&opts);
+        return -1;
+      }
+    }
+    int res = enc.open(&opts);
+    av_dict_free(&opts);
+    if (res < 0) {
+      return -1;
+    }
+
+    AVCodecParameters* codecpar = avcodec_parameters_alloc();
+    if (!codecpar) {
+      return -1;
+    }
+    if (avcodec_parameters_from_context(codecpar, enc.get()) >= 0) {
+      pass.decoder = DecoderContext::open_context(codecpar);
+    }
+    avcodec_parameters_free(&codecpar);
+    return pass.decoder.get() ? 0 : -1;
+  }
+
+  /** Encode a frame, or flush with a null one, timing the encoder on this
+   *  thread's CPU clock, and decode and score what comes out.
+   */
+  int encode(Pass& pass, Frame& frame) {
+    if (frame) {
+      frame->pict_type = pass.totals.frames == 0 ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+      pass.pending.emplace(frame->pts, frame.ref());
+      pass.totals.frames++;
+    }
+
+    std::vector<Packet> packets;
+    double cpu = thread_cpu();
+    int res = avcodec_send_frame(pass.encoder.get(), frame.get());
+    while (res >= 0) {
+      auto packet = Packet::alloc();
+      res = avcodec_receive_packet(pass.encoder.get(), packet.get());
+      if (res == AVERROR(EAGAIN) || res == AVERROR_EOF) {
+        break;
+      } else if (res < 0) {
+        return -1;
+      }
+      packets.push_back(std::move(packet));
+    }
+    pass.totals.cpu += thread_cpu() - cpu;
+    if (res < 0 && res != AVERROR(EAGAIN) && res != AVERROR_EOF) {
+      return -1;
+    }
+
+    for (auto& packet : packets) {
+      pass.totals.bytes += packet->size;
+      if (decode(pass, packet.get()) < 0) {
+        return -1;
+      }
+    }
+    return frame ? 0 : decode(pass, NULL);
+  }
+
+  /** Decode a packet, or drain with a null one, and score each picture
+   *  against its source.
+   */
+  int decode(Pass& pass, const AVPacket* packet) {
+    int res = avcodec_send_packet(pass.decoder.get(), packet);
+    while (res >= 0) {
+      auto decoded = Frame::alloc();
+      res = avcodec_receive_frame(pass.decoder.get(), decoded.get());
+      if (res == AVERROR(EAGAIN) || res == AVERROR_EOF) {
+        break;
+      } else if (res < 0) {
+        return -1;
+      }
+
+      auto source = pass.pending.find(decoded->pts);
+      if (source != pass.pending.end()) {
+        compare(source->second, decoded, pass.totals);
+        pass.pending.erase(source);
+      }
+    }
+    return res == AVERROR(EAGAIN) || res == AVERROR_EOF || res >= 0 ? 0 : -1;
+  }
+
+  /** Sum the squared error of a decoded picture against its source, over
+   *  every component of every plane. Bytes that belong to no component, such
+   *  as the X of BGR0, hold nothing the encoder keeps and are skipped.
+   */
+  static void compare(Frame& source, Frame& decoded, ShadowTotals& totals) {
+    Frame converted = Frame(NULL, [](AVFrame*) {});
+    if (decoded->format != source->format) {
+      converted = decoded.scale(source->width, source->height, (AVPixelFormat)source->format);
+      if (!converted) {
+        return;
+      }
+    }
+    const AVFrame* d = converted ? converted.get() : decoded.get();
+    const AVFrame* s = source.get();
+
+    auto fmt = (AVPixelFormat)s->format;
+    auto desc = av_pix_fmt_desc_get(fmt);
+    int widths[4];
+    if (!desc || av_image_fill_linesizes(widths, fmt, s->width) < 0) {
+      return;
+    }
+
+    for (int p = 0; p < av_pix_fmt_count_planes(fmt); p++) {
+      int offsets[4];
+      int n = 0;
+      int step = 1;
+      for (int c = 0; c < desc->nb_components; c++) {
+        if (desc->comp[c].plane == p) {
+          offsets[n++] = desc->comp[c].offset;
+          step = desc->comp[c].step;
+        }
+      }
+      int pixels = widths[p] / step;
+
+      int h = p == 0 || p == 3 ? s->height : -((-s->height) >> desc->log2_chroma_h);
+      for (int y = 0; y < h; y++) {
+        const uint8_t* a = s->data[p] + y * s->linesize[p];
+        const uint8_t* b = d->data[p] + y * d->linesize[p];
+        int64_t sse = 0;
+        for (int x = 0; x < pixels * step; x += step) {
+          for (int c = 0; c < n; c++) {
+            int e = a[x + offsets[c]] - b[x + offsets[c]];
+            sse += e * e;
+          }
+        }
+        totals.sse += sse;
+        totals.samples += (int64_t)pixels * n;
+      }
+    }
+  }
+
+  static void add(ShadowTotals& to, const ShadowTotals& from) {
+    to.frames += from.frames;
+    to.bytes += from.bytes;
+    to.cpu += from.cpu;
+    to.sse += from.sse;
+    to.samples += from.samples;
+  }
+
+  static double thread_cpu() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+  ShadowOptions options;
+
+  std::thread worker;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<Item> queue;
+  bool quit = false;
+
+  Settings settings;
+  int generation = 0;
+  int position = 0;
+  int64_t windows = 0;
+  bool sampling = false;
+
+  ShadowTotals control_totals;
+  ShadowTotals candidate_totals;
+  std::atomic<int> completed{0};
+  std::atomic<int> skipped{0};
+};
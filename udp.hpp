@@ -0,0 +1,346 @@
+// udp.hpp -*- c++ -*-
+
+/*
+ * MIT License
+ *
+ * Copyright (c) 2022 Walker Griggs
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <algorithm>
+#include <cstdlib>
+
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/** How MPEG-TS over UDP is paced.
+ */
+struct PacingOptions {
+  int64_t rate = 0;       ///< bits per second on the wire, 0 to derive it from the encoder's rate control
+  double overhead = 1.2;  ///< TS and PES overhead, plus headroom, over the encoder's peak rate
+  int burst = 4;          ///< datagrams that may leave back to back
+  int64_t max_queue = 0;  ///< bytes queued before datagrams are dropped, 0 for twice the VBV buffer
+};
+
+/** Sends a byte stream as UDP datagrams at a steady rate.
+ *
+ * An encoder's output is bursty: a keyframe can be many times the size of
+ * the frames around it, and the muxer writes it out in one go. Sent as fast
+ * as it is written, that burst overflows a receiver's socket buffer. Here
+ * writes are cut into datagrams of seven TS packets and queued, and a pacer
+ * thread releases them through a leaky bucket: on average one datagram per
+ * `size / rate`, with at most `burst` datagrams back to back after a lull.
+ *
+ * The rate should sit above the encoder's peak rate. Its VBV buffer then
+ * bounds how far the queue can grow; anything written past `max_queue` is
+ * dropped and counted rather than blocking the writer.
+ *
+ * The queue depth and the pacing error, how late each datagram left against
+ * its schedule, are reported over the last second.
+ */
+class PacedSender {
+public:
+  static constexpr int datagram_size = 7 * 188;
+
+  PacedSender() = default;
+  PacedSender(const PacedSender&) = delete;
+  PacedSender& operator=(const PacedSender&) = delete;
+
+  ~PacedSender() {
+    stop();
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  /** Parse a UDP location, udp://host:port.
+   *
+   * @return Zero on success, a negative value if the location isn't one.
+   */
+  static int parse_location(const std::string& url, std::string& host, int& port) {
+    const std::string scheme = "udp://";
+    if (url.compare(0, scheme.size(), scheme) != 0) {
+      return -1;
+    }
+
+    std::string authority = url.substr(scheme.size());
+    authority = authority.substr(0, authority.find_first_of("/?"));
+    size_t colon = authority.rfind(':');
+    if (colon == std::string::npos) {
+      return -1;
+    }
+
+    host = authority.substr(0, colon);
+    if (host.size() > 1 && host.front() == '[' && host.back() == ']') {
+      host = host.substr(1, host.size() - 2);
+    }
+    port = atoi(authority.c_str() + colon + 1);
+    return host.empty() || port <= 0 || port > 65535 ? -1 : 0;
+  }
+
+  /** Create a socket connected to the destination.
+   *
+   * @return Zero on success, a negative value on error.
+   */
+  int open(const std::string& host, int port) {
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    struct addrinfo* res = NULL;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res) != 0) {
+      return -1;
+    }
+
+    for (auto ai = res; ai; ai = ai->ai_next) {
+      fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if (fd < 0) {
+        continue;
+      }
+      if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+        break;
+      }
+      close(fd);
+      fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd < 0 ? -1 : 0;
+  }
+
+  /** Start the pacer thread. Does nothing if it is already running.
+   *
+   * @param rate      bits per second, 0 to send datagrams as soon as they
+   *                  are written
+   * @param burst     datagrams that may leave back to back
+   * @param max_queue bytes that may wait to be sent
+   *
+   * @return Zero on success, a negative value if the socket isn't open.
+   */
+  int start(int64_t rate, int burst, int64_t max_queue) {
+    if (fd < 0) {
+      return -1;
+    }
+    if (thread.joinable()) {
+      return 0;
+    }
+
+    this->rate = rate;
+    this->burst = std::max(burst, 1);
+    this->max_queue = max_queue > 0 ? max_queue : INT64_MAX;
+    quit = false;
+    thread = std::thread(&PacedSender::run, this);
+    return 0;
+  }
+
+  /** Send what is queued, at the paced rate, then stop the pacer thread.
+   */
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      quit = true;
+    }
+    cv.notify_all();
+    if (thread.joinable()) {
+      thread.join();
+    }
+  }
+
+  /** Queue bytes to send, as an AVIOContext's write callback.
+   *
+   * @return The number of bytes written; dropped bytes count as written, so
+   *         the muxer carries on.
+   */
+  static int write(void* opaque, const uint8_t* buf, int size) {
+    auto sender = (PacedSender*)opaque;
+    auto now = std::chrono::steady_clock::now();
+
+    {
+      std::lock_guard<std::mutex> lock(sender->mutex);
+      for (int offset = 0; offset < size; offset += datagram_size) {
+        int n = std::min(size - offset, datagram_size);
+        if (sender->queued_bytes + n > sender->max_queue) {
+          sender->dropped++;
+          continue;
+        }
+
+        sender->queue.push_back({std::vector<uint8_t>(buf + offset, buf + offset + n), now});
+        sender->queued_bytes += n;
+        sender->peak_queued_bytes = std::max(sender->peak_queued_bytes.load(), sender->queued_bytes.load());
+      }
+    }
+    sender->cv.notify_one();
+    return size;
+  }
+
+  /** Bytes waiting to be sent.
+   */
+  int64_t get_queued_bytes() const {
+    return queued_bytes;
+  }
+
+  /** The most bytes that have waited at once.
+   */
+  int64_t get_peak_queued_bytes() const {
+    return peak_queued_bytes;
+  }
+
+  /** How long the queue takes to drain at the paced rate, in seconds.
+   */
+  double get_queue_delay() const {
+    return rate > 0 ? queued_bytes * 8.0 / rate : 0;
+  }
+
+  /** The mean lateness of datagrams against their schedule, in seconds,
+   *  over the last full second of sending.
+   */
+  double get_pacing_error() const {
+    return pacing_error;
+  }
+
+  /** The worst lateness, in seconds, over the last full second of sending.
+   */
+  double get_max_pacing_error() const {
+    return max_pacing_error;
+  }
+
+  int64_t get_rate() const {
+    return rate;
+  }
+
+  int64_t get_sent() const {
+    return sent;
+  }
+
+  int64_t get_dropped() const {
+    return dropped;
+  }
+
+  /** Datagrams the socket refused, such as when nothing listens on a
+   *  loopback port.
+   */
+  int64_t get_errors() const {
+    return errors;
+  }
+
+private:
+  struct Datagram {
+    std::vector<uint8_t> data;
+    std::chrono::steady_clock::time_point queued;
+  };
+
+  /** The pacer thread.
+   *
+   * The bucket is tracked as the time it next empties, `tat`. A datagram is
+   * due when it was queued or when the bucket has room for it, whichever is
+   * later, and each datagram sent fills the bucket by its own duration at
+   * the paced rate. Lateness doesn't move the schedule, so the long-run rate
+   * holds even when a sleep overshoots.
+   */
+  void run() {
+    using clock = std::chrono::steady_clock;
+    int64_t bps = rate;
+    auto tolerance = std::chrono::nanoseconds(bps > 0 ? (int64_t)burst * datagram_size * 8 * 1000000000 / bps : 0);
+    auto tat = clock::now();
+    auto window = tat;
+    double error_sum = 0;
+    double error_max = 0;
+    int error_count = 0;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      cv.wait(lock, [&] { return quit || !queue.empty(); });
+      if (queue.empty()) {
+        break;
+      }
+      Datagram datagram = std::move(queue.front());
+      queue.pop_front();
+      lock.unlock();
+
+      auto due = bps > 0 ? std::max(datagram.queued, tat - tolerance) : datagram.queued;
+      if (due > clock::now()) {
+        std::this_thread::sleep_until(due);
+      }
+
+      auto now = clock::now();
+      if (send(fd, datagram.data.data(), datagram.data.size(), 0) < 0) {
+        errors++;
+      } else {
+        sent++;
+      }
+
+      if (bps > 0) {
+        auto duration = std::chrono::nanoseconds((int64_t)datagram.data.size() * 8 * 1000000000 / bps);
+        tat = std::max(tat, due) + duration;
+      }
+
+      double error = std::max(std::chrono::duration<double>(now - due).count(), 0.0);
+      error_sum += error;
+      error_max = std::max(error_max, error);
+      error_count++;
+      if (now - window >= std::chrono::seconds(1)) {
+        pacing_error = error_sum / error_count;
+        max_pacing_error = error_max;
+        error_sum = error_max = 0;
+        error_count = 0;
+        window = now;
+      }
+
+      lock.lock();
+      queued_bytes -= datagram.data.size();
+    }
+
+    // Report the partial second the queue drained in, too.
+    if (error_count > 0) {
+      pacing_error = error_sum / error_count;
+      max_pacing_error = error_max;
+    }
+  }
+
+  int fd = -1;
+  std::atomic<int64_t> rate{0};
+  int burst = 1;
+  int64_t max_queue = INT64_MAX;
+
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<Datagram> queue;
+  bool quit = false;
+
+  std::atomic<int64_t> queued_bytes{0};
+  std::atomic<int64_t> peak_queued_bytes{0};
+  std::atomic<int64_t> sent{0};
+  std::atomic<int64_t> dropped{0};
+  std::atomic<int64_t> errors{0};
+  std::atomic<double> pacing_error{0};
+  std::atomic<double> max_pacing_error{0};
+};
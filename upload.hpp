@@ -0,0 +1,710 @@
+// upload.hpp -*- c++ -*-
+
+/*
+ * MIT License
+ *
+ * Copyright (c) 2022 Walker Griggs
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <deque>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <condition_variable>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+extern "C" {
+#include <libavutil/sha.h>
+#include <libavutil/hmac.h>
+#include <libavutil/mem.h>
+}
+
+/** Where and how to upload recordings.
+ */
+struct UploadOptions {
+  std::string host;                 ///< the S3-compatible endpoint's host
+  int port = 80;                    ///< the endpoint's port
+  std::string bucket;               ///< the bucket, addressed path-style
+  std::string prefix;               ///< prepended to each file's name to form its key
+  std::string region = "us-east-1"; ///< the signing region
+  std::string access_key;           ///< the access key id, empty to send unsigned requests
+  std::string secret_key;           ///< the secret access key
+  size_t part_size = 8 << 20;       ///< bytes per part; S3 wants 5 MiB or more for all but the last
+  int parallel = 4;                 ///< concurrent part uploads
+  int retries = 5;                  ///< further attempts for a failed request
+  bool remove = true;               ///< delete each file once its upload is confirmed
+};
+
+/** Uploads recordings to an S3-compatible store while recording continues.
+ *
+ * Every file becomes one multipart upload. Parts are read from disk with
+ * `pread` and PUT by `parallel` worker threads, each with a single part-sized
+ * buffer, so memory use is bounded by `parallel * part_size` however far
+ * uploads fall behind; the backlog stays on disk.
+ *
+ * A file passed to `enqueue` is complete. A file passed to `follow` is still
+ * being written: its parts are uploaded as soon as the file has grown past
+ * them, and the upload completes after `finish`. Following only works for
+ * outputs that are written strictly in order, such as fragmented MP4 or
+ * MPEG-TS; a regular MP4 rewrites its header at the end.
+ *
+ * Failed requests are retried with exponential backoff, except for client
+ * errors, which retrying can't fix. A file is deleted only once the store has
+ * confirmed the completed upload; if the upload fails it is aborted and the
+ * file kept.
+ *
+ * Requests are plain HTTP/1.1 signed with AWS Signature Version 4, which
+ * suits a local MinIO or a TLS-terminating proxy in front of the store.
+ */
+class Uploader {
+public:
+  explicit Uploader(UploadOptions opts) : options(std::move(opts)) {
+    options.parallel = std::max(options.parallel, 1);
+    options.part_size = std::max(options.part_size, (size_t)1);
+  }
+
+  Uploader(const Uploader&) = delete;
+  Uploader& operator=(const Uploader&) = delete;
+
+  ~Uploader() {
+    stop();
+  }
+
+  /** Parse an upload location, http://host[:port]/bucket[/prefix].
+   *
+   * @return Zero on success, a negative value on error.
+   */
+  static int parse_location(const std::string& url, UploadOptions& options) {
+    const std::string scheme = "http://";
+    if (url.compare(0, scheme.size(), scheme) != 0) {
+      return -1;
+    }
+
+    std::string rest = url.substr(scheme.size());
+    size_t slash = rest.find('/');
+    if (slash == std::string::npos || slash + 1 >= rest.size()) {
+      return -1;
+    }
+
+    std::string authority = rest.substr(0, slash);
+    std::string path = rest.substr(slash + 1);
+
+    size_t colon = authority.rfind(':');
+    options.host = authority.substr(0, colon);
+    options.port = colon == std::string::npos ? 80 : atoi(authority.c_str() + colon + 1);
+
+    slash = path.find('/');
+    options.bucket = path.substr(0, slash);
+    options.prefix = slash == std::string::npos ? "" : path.substr(slash + 1);
+    if (!options.prefix.empty() && options.prefix.back() != '/') {
+      options.prefix += '/';
+    }
+    return options.host.empty() || options.port <= 0 || options.bucket.empty() ? -1 : 0;
+  }
+
+  void start() {
+    quit = false;
+    draining = false;
+    scheduler = std::thread(&Uploader::schedule, this);
+    for (int i = 0; i < options.parallel; i++) {
+      workers.emplace_back(&Uploader::work, this);
+    }
+  }
+
+  /** Finish uploading every complete file, abort the rest, and stop.
+   */
+  void stop() {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      draining = true;
+      cv.notify_all();
+      if (scheduler.joinable()) {
+        cv.wait(lock, [&] { return uploads.empty(); });
+      }
+      quit = true;
+    }
+    cv.notify_all();
+
+    if (scheduler.joinable()) {
+      scheduler.join();
+    }
+    for (auto& worker : workers) {
+      worker.join();
+    }
+    workers.clear();
+  }
+
+  /** Upload a finished file.
+   */
+  void enqueue(const std::string& path) {
+    add(path, true);
+  }
+
+  /** Start uploading a file that is still being written.
+   */
+  void follow(const std::string& path) {
+    add(path, false);
+  }
+
+  /** Mark a followed file as finished, so its upload can complete.
+   */
+  void finish(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& u : uploads) {
+      if (u->path == path) {
+        u->finished = true;
+      }
+    }
+    cv.notify_all();
+  }
+
+  /** The number of files being uploaded or waiting to be.
+   */
+  size_t get_pending() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return uploads.size();
+  }
+
+  /** The number of files uploaded and confirmed.
+   */
+  int get_completed() const {
+    return completed;
+  }
+
+  /** The number of uploads that failed; their files are kept.
+   */
+  int get_failed() const {
+    return failed;
+  }
+
+  /** The number of requests retried.
+   */
+  int get_retries() const {
+    return retried;
+  }
+
+  /** The bytes of part data uploaded.
+   */
+  int64_t get_bytes() const {
+    return bytes;
+  }
+
+private:
+  struct Upload {
+    std::string path;
+    std::string key;
+    std::string upload_id;
+    enum { pending, creating, open, completing, aborting } state = pending;
+    bool finished = false;     ///< the file is complete
+    bool failed = false;       ///< a request failed for good
+    int64_t scheduled = 0;     ///< bytes handed to part jobs
+    int next_part = 1;
+    int in_flight = 0;
+    std::map<int, std::string> etags;
+  };
+
+  struct Job {
+    std::shared_ptr<Upload> upload;
+    enum { create, part, complete, abort } kind;
+    int number = 0;            ///< the part number
+    int64_t offset = 0;
+    size_t size = 0;
+  };
+
+  struct Response {
+    int status = 0;
+    std::string etag;
+    std::string body;
+  };
+
+  void add(const std::string& path, bool finished) {
+    auto u = std::make_shared<Upload>();
+    u->path = path;
+    size_t slash = path.rfind('/');
+    u->key = options.prefix + (slash == std::string::npos ? path : path.substr(slash + 1));
+    u->finished = finished;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    uploads.push_back(u);
+    cv.notify_all();
+  }
+
+  /** The scheduler thread: turn upload state into jobs.
+   *
+   * Followed files are checked for growth twice a second. At most `parallel`
+   * jobs wait at once, so a long backlog costs nothing but disk.
+   */
+  void schedule() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!quit) {
+      for (auto it = uploads.begin(); it != uploads.end();) {
+        auto& u = *it;
+        if (draining && !u->finished) {
+          u->failed = true;
+        }
+
+        if (u->failed && u->in_flight == 0 && u->state != Upload::creating &&
+            u->state != Upload::completing && u->state != Upload::aborting) {
+          if (u->upload_id.empty()) {
+            failed++;
+            it = uploads.erase(it);
+            cv.notify_all();
+            continue;
+          }
+          u->state = Upload::aborting;
+          jobs.push_back(Job{u, Job::abort});
+        }
+
+        if (!u->failed && u->state == Upload::pending) {
+          u->state = Upload::creating;
+          jobs.push_back(Job{u, Job::create});
+        }
+
+        if (!u->failed && u->state == Upload::open) {
+          // Read the flag before the size, so a file finished in between is
+          // never completed short.
+          bool finished = u->finished;
+          // A followed file may not have been created yet.
+          struct stat st;
+          if (stat(u->path.c_str(), &st) < 0) {
+            u->failed = finished;
+            ++it;
+            continue;
+          }
+          int64_t size = st.st_size;
+
+          while (jobs.size() < (size_t)options.parallel &&
+                 (size - u->scheduled >= (int64_t)options.part_size ||
+                  (finished && (u->scheduled < size || u->next_part == 1)))) {
+            size_t len = std::min((int64_t)options.part_size, size - u->scheduled);
+            jobs.push_back(Job{u, Job::part, u->next_part++, u->scheduled, len});
+            u->scheduled += len;
+            u->in_flight++;
+          }
+
+          if (finished && u->scheduled == size && u->next_part > 1 && u->in_flight == 0) {
+            u->state = Upload::completing;
+            jobs.push_back(Job{u, Job::complete});
+          }
+        }
+        ++it;
+      }
+
+      cv.notify_all();
+      cv.wait_for(lock, std::chrono::milliseconds(500));
+    }
+  }
+
+  /** A worker thread: run jobs, each with its retries.
+   */
+  void work() {
+    std::vector<uint8_t> buffer;
+
+    while (true) {
+      Job job;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return quit || !jobs.empty(); });
+        if (jobs.empty()) {
+          return;
+        }
+        job = jobs.front();
+        jobs.pop_front();
+      }
+
+      int res = run(job, buffer);
+      auto& u = job.upload;
+
+      std::lock_guard<std::mutex> lock(mutex);
+      switch (job.kind) {
+      case Job::create:
+        u->state = Upload::open;
+        break;
+      case Job::part:
+        u->in_flight--;
+        break;
+      case Job::complete:
+        if (res >= 0) {
+          completed++;
+          uploads.remove(u);
+        } else {
+          u->state = Upload::open;
+        }
+        break;
+      case Job::abort:
+        failed++;
+        uploads.remove(u);
+        break;
+      }
+      if (res < 0) {
+        u->failed = true;
+      }
+      cv.notify_all();
+    }
+  }
+
+  int run(Job& job, std::vector<uint8_t>& buffer) {
+    auto& u = job.upload;
+    Response response;
+
+    switch (job.kind) {
+    case Job::create: {
+      if (request("POST", u->key, {{"uploads", ""}}, NULL, 0, response) < 0) {
+        return -1;
+      }
+      std::string id = extract(response.body, "UploadId");
+      if (id.empty()) {
+        return -1;
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      u->upload_id = id;
+      return 0;
+    }
+
+    case Job::part: {
+      buffer.resize(job.size);
+      int fd = open(u->path.c_str(), O_RDONLY);
+      if (fd < 0) {
+        return -1;
+      }
+      posix_fadvise(fd, job.offset, job.size, POSIX_FADV_SEQUENTIAL);
+      size_t got = 0;
+      while (got < job.size) {
+        ssize_t n = pread(fd, buffer.data() + got, job.size - got, job.offset + got);
+        if (n <= 0) {
+          break;
+        }
+        got += n;
+      }
+      // The pages won't be read again; don't let them crowd out the recording.
+      posix_fadvise(fd, job.offset, job.size, POSIX_FADV_DONTNEED);
+      close(fd);
+      if (got < job.size) {
+        return -1;
+      }
+
+      if (request("PUT", u->key, {{"partNumber", std::to_string(job.number)}, {"uploadId", u->upload_id}},
+                  buffer.data(), job.size, response) < 0 || response.etag.empty()) {
+        return -1;
+      }
+      bytes += job.size;
+      std::lock_guard<std::mutex> lock(mutex);
+      u->etags[job.number] = response.etag;
+      return 0;
+    }
+
+    case Job::complete: {
+      std::string xml = "<CompleteMultipartUpload>";
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& p : u->etags) {
+          xml += "<Part><PartNumber>" + std::to_string(p.first) + "</PartNumber><ETag>" +
+            p.second + "</ETag></Part>";
+        }
+      }
+      xml += "</CompleteMultipartUpload>";
+
+      // The store may report a failed completion in the body of a 200.
+      if (request("POST", u->key, {{"uploadId", u->upload_id}},
+                  (const uint8_t*)xml.data(), xml.size(), response) < 0 ||
+          response.body.find("<Error>") != std::string::npos) {
+        return -1;
+      }
+      if (options.remove) {
+        unlink(u->path.c_str());
+      }
+      return 0;
+    }
+
+    case Job::abort:
+      return request("DELETE", u->key, {{"uploadId", u->upload_id}}, NULL, 0, response);
+    }
+    return -1;
+  }
+
+  /** Send a request, retrying with backoff on server and network errors.
+   *
+   * @return Zero once the store answers with success, a negative value on
+   *         error.
+   */
+  int request(const std::string& method, const std::string& key,
+              std::vector<std::pair<std::string, std::string>> query,
+              const uint8_t* body, size_t size, Response& response) {
+    std::sort(query.begin(), query.end());
+
+    for (int attempt = 0; attempt <= options.retries; attempt++) {
+      if (attempt > 0) {
+        retried++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(500 << std::min(attempt - 1, 6)));
+        if (quit) {
+          return -1;
+        }
+      }
+
+      response = Response();
+      if (exchange(method, key, query, body, size, response) < 0) {
+        continue;
+      }
+      if (response.status >= 200 && response.status < 300) {
+        return 0;
+      }
+      if (response.status >= 400 && response.status < 500 &&
+          response.status != 408 && response.status != 429) {
+        return -1;
+      }
+    }
+    return -1;
+  }
+
+  /** One signed HTTP/1.1 request and its response, on a new connection.
+   */
+  int exchange(const std::string& method, const std::string& key,
+               const std::vector<std::pair<std::string, std::string>>& query,
+               const uint8_t* body, size_t size, Response& response) {
+    std::string host = options.host + (options.port == 80 ? "" : ":" + std::to_string(options.port));
+    std::string path = "/" + uri_encode(options.bucket, false) + "/" + uri_encode(key, false);
+
+    std::string qs;
+    for (auto& q : query) {
+      qs += (qs.empty() ? "" : "&") + uri_encode(q.first, true) + "=" + uri_encode(q.second, true);
+    }
+
+    char date[32];
+    time_t now = time(NULL);
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    strftime(date, sizeof(date), "%Y%m%dT%H%M%SZ", &tm);
+    std::string payload = hex(sha256(body, size));
+
+    std::string head = method + " " + path + (qs.empty() ? "" : "?" + qs) + " HTTP/1.1\r\n" +
+      "Host: " + host + "\r\n" +
+      "Content-Length: " + std::to_string(size) + "\r\n" +
+      "x-amz-content-sha256: " + payload + "\r\n" +
+      "x-amz-date: " + date + "\r\n";
+    if (!options.access_key.empty()) {
+      head += "Authorization: " + authorization(method, path, qs, host, payload, date) + "\r\n";
+    }
+    head += "Connection: close\r\n\r\n";
+
+    int fd = connect_endpoint();
+    if (fd < 0) {
+      return -1;
+    }
+
+    int res = send_all(fd, (const uint8_t*)head.data(), head.size());
+    if (res >= 0 && size > 0) {
+      res = send_all(fd, body, size);
+    }
+
+    std::string reply;
+    char buf[4096];
+    while (res >= 0) {
+      ssize_t n = recv(fd, buf, sizeof(buf), 0);
+      if (n < 0) {
+        res = -1;
+      } else if (n == 0) {
+        break;
+      } else {
+        reply.append(buf, n);
+      }
+    }
+    close(fd);
+
+    if (res < 0 || sscanf(reply.c_str(), "HTTP/1.%*d %d", &response.status) != 1) {
+      return -1;
+    }
+
+    size_t end = reply.find("\r\n\r\n");
+    std::string headers = reply.substr(0, end);
+    response.body = end == std::string::npos ? "" : reply.substr(end + 4);
+
+    std::string lower = headers;
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    size_t etag = lower.find("\r\netag:");
+    if (etag != std::string::npos) {
+      size_t start = headers.find_first_not_of(' ', etag + 7);
+      response.etag = headers.substr(start, headers.find("\r\n", start) - start);
+    }
+    return 0;
+  }
+
+  /** The AWS Signature Version 4 Authorization header.
+   */
+  std::string authorization(const std::string& method, const std::string& path,
+                            const std::string& qs, const std::string& host,
+                            const std::string& payload, const std::string& date) {
+    const std::string signed_headers = "host;x-amz-content-sha256;x-amz-date";
+    std::string canonical = method + "\n" + path + "\n" + qs + "\n" +
+      "host:" + host + "\n" +
+      "x-amz-content-sha256:" + payload + "\n" +
+      "x-amz-date:" + date + "\n\n" +
+      signed_headers + "\n" + payload;
+
+    std::string day = date.substr(0, 8);
+    std::string scope = day + "/" + options.region + "/s3/aws4_request";
+    std::string to_sign = "AWS4-HMAC-SHA256\n" + date + "\n" + scope + "\n" +
+      hex(sha256((const uint8_t*)canonical.data(), canonical.size()));
+
+    std::string k = hmac("AWS4" + options.secret_key, day);
+    k = hmac(k, options.region);
+    k = hmac(k, "s3");
+    k = hmac(k, "aws4_request");
+
+    return "AWS4-HMAC-SHA256 Credential=" + options.access_key + "/" + scope +
+      ", SignedHeaders=" + signed_headers + ", Signature=" + hex(hmac(k, to_sign));
+  }
+
+  int connect_endpoint() {
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo* res = NULL;
+    if (getaddrinfo(options.host.c_str(), std::to_string(options.port).c_str(), &hints, &res) != 0) {
+      return -1;
+    }
+
+    int fd = -1;
+    for (auto ai = res; ai; ai = ai->ai_next) {
+      fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if (fd < 0) {
+        continue;
+      }
+      if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+        break;
+      }
+      close(fd);
+      fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd >= 0) {
+      struct timeval tv = {30, 0};
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+    return fd;
+  }
+
+  static int send_all(int fd, const uint8_t* data, size_t size) {
+    while (size > 0) {
+      ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+      if (n <= 0) {
+        return -1;
+      }
+      data += n;
+      size -= n;
+    }
+    return 0;
+  }
+
+  /** The text of the first <tag> element in an XML reply.
+   */
+  static std::string extract(const std::string& xml, const std::string& tag) {
+    size_t start = xml.find("<" + tag + ">");
+    if (start == std::string::npos) {
+      return "";
+    }
+    start += tag.size() + 2;
+    size_t end = xml.find("</" + tag + ">", start);
+    return end == std::string::npos ? "" : xml.substr(start, end - start);
+  }
+
+  static std::string uri_encode(const std::string& s, bool slash) {
+    static const char digits[] = "0123456789ABCDEF";
+    std::string out;
+    for (unsigned char c : s) {
+      if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' || (c == '/' && !slash)) {
+        out += c;
+      } else {
+        out += '%';
+        out += digits[c >> 4];
+        out += digits[c & 15];
+      }
+    }
+    return out;
+  }
+
+  static std::string sha256(const uint8_t* data, size_t size) {
+    uint8_t digest[32];
+    struct AVSHA* sha = av_sha_alloc();
+    av_sha_init(sha, 256);
+    av_sha_update(sha, data, size);
+    av_sha_final(sha, digest);
+    av_free(sha);
+    return std::string((const char*)digest, sizeof(digest));
+  }
+
+  static std::string hmac(const std::string& key, const std::string& data) {
+    uint8_t digest[32];
+    struct AVHMAC* ctx = av_hmac_alloc(AV_HMAC_SHA256);
+    av_hmac_calc(ctx, (const uint8_t*)data.data(), data.size(),
+                 (const uint8_t*)key.data(), key.size(), digest, sizeof(digest));
+    av_hmac_free(ctx);
+    return std::string((const char*)digest, sizeof(digest));
+  }
+
+  static std::string hex(const std::string& bytes) {
+    static const char digits[] = "0123456789abcdef";
+    std::string out;
+    for (unsigned char c : bytes) {
+      out += digits[c >> 4];
+      out += digits[c & 15];
+    }
+    return out;
+  }
+
+  UploadOptions options;
+
+  std::thread scheduler;
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::list<std::shared_ptr<Upload>> uploads;
+  std::deque<Job> jobs;
+  std::atomic<bool> quit{false};
+  bool draining = false;
+
+  std::atomic<int> completed{0};
+  std::atomic<int> failed{0};
+  std::atomic<int> retried{0};
+  std::atomic<int64_t> bytes{0};
+};
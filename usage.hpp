@@ -0,0 +1,297 @@
+// usage.hpp -*- c++ -*-
+
+/*
+ * MIT License
+ *
+ * Copyright (c) 2022 Walker Griggs
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <string>
+#include <map>
+#include <chrono>
+#include <mutex>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/** What one recording consumed, for chargeback.
+ */
+struct Usage {
+  double cpu = 0;         ///< CPU seconds across the recording's threads
+  int threads = 0;        ///< threads that have run for the recording
+  int64_t bytes = 0;      ///< bytes written to its outputs
+  int64_t frames = 0;     ///< frames encoded
+  int64_t peak_rss = 0;   ///< the process's peak resident memory while it ran, in bytes
+  double seconds = 0;     ///< wall-clock time it has run
+};
+
+/** Accounts for the CPU, output and memory of one recording among several in
+ *  a process.
+ *
+ * The recorder thread takes a name of its own with `attach`. Linux copies a
+ * thread's name to the threads it creates, so the encoder's worker threads,
+ * the capture bands and the UDP pacer all carry it without being told.
+ * `sample` then sums the CPU time of every thread with that name, from
+ * /proc/self/task/<tid>/schedstat in nanoseconds, or from the clock ticks in
+ * stat where schedstat is missing. Threads that exit keep the time last
+ * sampled for them, so the recorder samples before it closes an encoder.
+ * Threads that rename themselves, and the process's shared workers such as
+ * the recompressor and uploader, aren't counted.
+ *
+ * Memory is shared by every thread in the process and can't be split between
+ * recordings; the peak reported is the process's resident set at its highest
+ * while the recording ran.
+ */
+class UsageMeter {
+public:
+  UsageMeter() {
+    static std::atomic<int> next{0};
+    name = "screencap-" + std::to_string(next++ % 100000);
+  }
+
+  /** Give the calling thread the meter's name, so it and the threads it
+   *  creates are counted.
+   */
+  void attach() {
+    pthread_setname_np(pthread_self(), name.c_str());
+  }
+
+  /** Give another thread the meter's name.
+   */
+  void adopt(pthread_t thread) {
+    pthread_setname_np(thread, name.c_str());
+  }
+
+  /** Start counting a new recording from zero.
+   */
+  void reset() {
+    std::lock_guard<std::mutex> lock(mutex);
+    tasks.clear();
+    retired = 0;
+    usage = Usage();
+    started = std::chrono::steady_clock::now();
+    bytes = frames = 0;
+  }
+
+  /** Read the CPU time of every thread with the meter's name, and the
+   *  process's resident memory.
+   */
+  void sample() {
+    std::map<pid_t, double> seen;
+    if (DIR* dir = opendir("/proc/self/task")) {
+      while (struct dirent* entry = readdir(dir)) {
+        pid_t tid = atoi(entry->d_name);
+        if (tid <= 0 || comm(tid) != name) {
+          continue;
+        }
+        double cpu = task_cpu(tid);
+        if (cpu >= 0) {
+          seen[tid] = cpu;
+        }
+      }
+      closedir(dir);
+    }
+    int64_t rss = resident();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& t : seen) {
+      auto it = tasks.find(t.first);
+      // A thread id handed to a new thread starts its clock again.
+      if (it != tasks.end() && t.second < it->second) {
+        retired += it->second;
+        usage.threads++;
+        it->second = t.second;
+      } else if (it == tasks.end()) {
+        tasks.emplace(t.first, t.second);
+        usage.threads++;
+      } else {
+        it->second = t.second;
+      }
+    }
+
+    double cpu = retired;
+    for (auto& t : tasks) {
+      cpu += t.second;
+    }
+    usage.cpu = cpu;
+    usage.peak_rss = std::max(usage.peak_rss, rss);
+  }
+
+  /** Count output written; callable from any thread.
+   */
+  void add_bytes(int64_t n) {
+    bytes += n;
+  }
+
+  /** Count an encoded frame; callable from any thread.
+   */
+  void add_frame() {
+    frames++;
+  }
+
+  /** The usage as of the last sample, with output and frames up to date.
+   */
+  Usage get() {
+    std::lock_guard<std::mutex> lock(mutex);
+    Usage u = usage;
+    u.bytes = bytes;
+    u.frames = frames;
+    u.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    return u;
+  }
+
+  const std::string& get_name() const {
+    return name;
+  }
+
+  /** Append a recording's usage to a log, as one line of JSON.
+   *
+   * Lines are written whole with O_APPEND, so several recordings may share
+   * a log.
+   *
+   * @param path   the log's location
+   * @param usage  what the recording consumed
+   * @param fields further string fields to record, such as its output and
+   *               who it is charged to
+   *
+   * @return Zero on success, a negative value on error.
+   */
+  static int write_record(const std::string& path, const Usage& usage,
+                          const std::map<std::string, std::string>& fields) {
+    std::ostringstream os;
+    os << "{\"time\":" << time(NULL);
+    for (auto& f : fields) {
+      os << ",\"" << escape(f.first) << "\":\"" << escape(f.second) << "\"";
+    }
+    os << std::fixed << std::setprecision(3)
+       << ",\"seconds\":" << usage.seconds
+       << ",\"cpu_seconds\":" << usage.cpu
+       << ",\"threads\":" << usage.threads
+       << ",\"bytes_written\":" << usage.bytes
+       << ",\"frames_encoded\":" << usage.frames
+       << ",\"peak_rss_bytes\":" << usage.peak_rss
+       << "}\n";
+    std::string line = os.str();
+
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      return -1;
+    }
+    ssize_t n = ::write(fd, line.data(), line.size());
+    close(fd);
+    return n == (ssize_t)line.size() ? 0 : -1;
+  }
+
+private:
+  /** A thread's name.
+   */
+  static std::string comm(pid_t tid) {
+    std::ifstream is("/proc/self/task/" + std::to_string(tid) + "/comm");
+    std::string s;
+    std::getline(is, s);
+    return s;
+  }
+
+  /** A thread's CPU time in seconds, or a negative value if it's gone.
+   */
+  static double task_cpu(pid_t tid) {
+    std::string task = "/proc/self/task/" + std::to_string(tid);
+    {
+      std::ifstream is(task + "/schedstat");
+      int64_t ns;
+      if (is >> ns) {
+        return ns / 1e9;
+      }
+    }
+
+    // The fields after the parenthesized name, which may itself hold spaces;
+    // utime and stime are the 12th and 13th.
+    std::ifstream is(task + "/stat");
+    std::string line;
+    if (!std::getline(is, line)) {
+      return -1;
+    }
+    size_t paren = line.rfind(')');
+    if (paren == std::string::npos) {
+      return -1;
+    }
+    std::istringstream fields(line.substr(paren + 2));
+    std::string field;
+    int64_t utime = 0, stime = 0;
+    for (int i = 1; i <= 13 && fields >> field; i++) {
+      if (i == 12) {
+        utime = atoll(field.c_str());
+      } else if (i == 13) {
+        stime = atoll(field.c_str());
+      }
+    }
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+  }
+
+  /** The process's resident memory, in bytes.
+   */
+  static int64_t resident() {
+    std::ifstream is("/proc/self/statm");
+    int64_t size, pages;
+    if (!(is >> size >> pages)) {
+      return 0;
+    }
+    return pages * sysconf(_SC_PAGESIZE);
+  }
+
+  static std::string escape(const std::string& s) {
+    std::string out;
+    for (char c : s) {
+      if (c == '"' || c == '\\') {
+        out += '\\';
+        out += c;
+      } else if ((unsigned char)c < 0x20) {
+        char buf[8];
+        snprintf(buf, sizeof(buf), "\\u%04x", c);
+        out += buf;
+      } else {
+        out += c;
+      }
+    }
+    return out;
+  }
+
+  std::string name;
+  std::mutex mutex;
+  std::map<pid_t, double> tasks;
+  double retired = 0;
+  Usage usage;
+  std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+  std::atomic<int64_t> bytes{0};
+  std::atomic<int64_t> frames{0};
+};